@@ -1,12 +1,24 @@
 #ifndef HTTPREQUESTDATA
 #define HTTPREQUESTDATA
 #include "timer.h"
+#include "outputQueue.h"
+#include "bodySink.h"
 #include <string>
 #include <unordered_map>
 #include <memory>
+#include <utility>
+#include <vector>
 #include <sys/types.h>
+#include <sys/stat.h>
 
 const int MAX_BUFF = 4096;
+// 一次最多连续读入的字节数，读满后先处理(请求体转存到BodySink)再继续读，大的上传不会全部积压在inBuffer中
+const size_t INPUT_READ_BATCH = 16 * MAX_BUFF;
+
+// 输出队列高水位：未发送的数据超过该值时暂停读取该连接，慢客户端只占用内存而不占用CPU
+const size_t OUTPUT_HIGH_WATER_MARK = 64 * 1024;
+// 目录列表的页面攒够该大小再作为一个块发出
+const size_t DIRECTORY_CHUNK_SIZE = 4096;
 
 // URI请求行
 const int STATE_PARSE_URI = 1;
@@ -34,6 +46,29 @@ const int PARSE_HEADER_AGAIN = -1;
 const int PARSE_HEADER_ERROR = -2;
 const int PARSE_HEADER_SUCCESS = 0;
 
+// 请求体
+const int PARSE_BODY_AGAIN = -1;
+const int PARSE_BODY_ERROR = -2;
+const int PARSE_BODY_SUCCESS = 0;
+const int PARSE_BODY_TOO_LARGE = -3; // 超过BodySink::maxSize()
+const int PARSE_BODY_IO_ERROR = -4;  // 写临时文件失败
+const int PARSE_BODY_FORM_ERROR = -5; // multipart/form-data格式错误
+
+// 请求体的长度由什么确定
+const int BODY_NONE = 0;    // 没有请求体
+const int BODY_LENGTH = 1;  // Content-Length
+const int BODY_CHUNKED = 2; // Transfer-Encoding: chunked
+
+// url编码的登录表单的最大长度，更大的请求体不读回内存
+const size_t LOGIN_FORM_MAX_SIZE = MAX_BUFF;
+
+// 分块请求体的解码状态
+const int CHUNK_SIZE = 0;     // 块大小行
+const int CHUNK_DATA = 1;     // 块数据
+const int CHUNK_DATA_END = 2; // 块数据之后的CRLF
+const int CHUNK_TRAILER = 3;  // 最后一块之后的trailer
+const int CHUNK_DONE = 4;
+
 // 解析
 const int ANALYSIS_ERROR = -2;
 const int ANALYSIS_SUCCESS = 0;
@@ -44,37 +79,87 @@ const int METHOD_GET = 2;
 const int HTTP_10 = 1;
 const int HTTP_11 = 2; // 浏览器发起请求后默认为1.1版本 所以Connection字段会省略
 
-// 单例模式
+// 响应中Connection头的形式
+const int CONN_HEADER_NONE = 0;       // 请求未带Connection头，响应也不带
+const int CONN_HEADER_KEEP_ALIVE = 1; // Connection: keep-alive
+const int CONN_HEADER_CLOSE = 2;      // Connection: close
+const int CONN_HEADER_NUM = 3;
+
+// 范围请求(Range)
+const int RANGE_NONE = 0;          // 没有Range头或应忽略Range头，返回完整内容
+const int RANGE_OK = 1;            // 至少有一个可满足的区间，返回206
+const int RANGE_UNSATISFIABLE = 2; // 所有区间都超出文件范围，返回416
+// 一个请求最多处理的区间数，超过时忽略Range头返回完整内容
+const int MAX_RANGES = 16;
+
+// MIME类型表(单例模式)：按扩展名(含'.'，不区分大小写)查找
+// 表在启动时构造为完美哈希：扩展名先按哈希分桶，每个桶选一个位移使桶内各项落在互不冲突的槽中
+// 查找时计算一次哈希、读一个位移、比较一个槽，与类型的个数无关，返回表中字符串的引用，不复制
 class MimeType
 {
 private:
-  static void init();
-  static std::unordered_map<std::string, std::string> mime;
+  struct Slot
+  {
+    std::string suffix; // 空表示空槽
+    std::string type;
+  };
+  static std::vector<Slot> slots;
+  static std::vector<unsigned int> seeds; // 每个桶的位移
+  static std::string default_type;
+  static bool ready;
+  static bool build(const std::vector<std::pair<std::string, std::string>> &entries);
+  static unsigned long long hash(const char *suffix, size_t len);
+  static size_t slotOf(unsigned long long h, unsigned int seed);
   MimeType();
   MimeType(const MimeType &m);
 
 public:
-  static std::string getMime(const std::string &suffix);
+  // 读入mime.types格式的文件(每行"类型 扩展名..."，'#'开始为注释)，其中的类型覆盖内置的类型
+  // 在IO线程启动之前调用，文件打不开时返回-1，只使用内置的类型
+  static int load(const char *path);
+  // 没有对应类型时返回缺省类型
+  static const std::string &getMime(const char *suffix, size_t len);
+  static const std::string &getMime(const std::string &suffix);
+  // 已知的扩展名个数
+  static size_t size();
+};
 
-private:
-  static pthread_once_t once_control;
+// 请求行与全部请求头合计的最大字节数，超过时按错误请求处理
+const size_t MAX_HEADER_SIZE = 8192;
+// 一个请求最多的请求头个数
+const int MAX_HEADERS = 64;
+// 请求头的值的最大长度
+const size_t MAX_HEADER_VALUE = 255;
+
+// 接收缓冲区inBuffer中的一段，用下标而不是指针表示，缓冲区扩容后仍然有效
+struct StrSpan
+{
+  unsigned int off;
+  unsigned int len;
+};
+
+struct HeaderSpan
+{
+  StrSpan key;
+  StrSpan value;
 };
 
-// 请求头格式
-enum HeadersState
+// 解析得到的请求，各字段都指向inBuffer中的原始数据，解析过程不复制、不分配内存
+struct RequestView
 {
-  h_start = 0,          // 开始
-  h_key,                // 键key
-  h_colon,              // 冒号
-  h_spaces_after_colon, // 冒号后空格
-  h_value,              // 值value
-  h_CR,                 // \r
-  h_LF,                 // \n
-  h_end_CR,             // 空行\r
-  h_end_LF              // 空行\n
+  StrSpan method;
+  StrSpan target;  // 请求目标，含查询串
+  StrSpan version;
+  HeaderSpan headers[MAX_HEADERS];
+  int header_count;
 };
 
 class TimerNode;
+class Epoll;
+struct CompressedVariant;
+struct VariantSlot;
+class MultipartParser;
+struct RouteMatch;
 
 class RequestData : public std::enable_shared_from_this<RequestData> // 自动添加成员函数shared_from_this
 {
@@ -83,43 +168,102 @@ private:
   std::string path;                                     // PATH="/"
   int fd;                                               // 客户端(服务器)fd
   std::string IP;                                       // 客户端IP
-  int epollfd;                                          // epollfd
+  Epoll *loop;                                          // 所属的事件循环
   std::string inBuffer;                                 // 读取内容缓存
-  std::string outBuffer;                                // 发送内容缓存
-  __uint32_t events;                                    // 事件变化
+  OutputQueue outQueue;                                 // 待发送的响应
   bool isError;                                         // 是否发生错误
+  bool input_paused;                                    // 输出积压，缓冲区中还有未处理的流水线请求
   int method;                                           // 请求方式GET/POST
   int HTTPversion;                                      // HTTP版本
   std::string file_name;                                // 请求的文件路径
-  int now_read_pos;                                     // 当前读取下标
+  size_t now_read_pos;                                  // 当前读取下标，之前的内容已解析
   int state;                                            // 当前读取状态
-  int h_state;                                          // 请求头状态
   bool isfinish;                                        // 是否解析完
   bool keep_alive;                                      // 长连接
-  std::unordered_map<std::string, std::string> headers; // 请求头key-value
-  std::weak_ptr<TimerNode> timer;
+  RequestView request;                                  // 当前请求的各部分在inBuffer中的位置
+  int body_framing;                                     // BODY_*
+  size_t body_length;                                   // Content-Length
+  int chunk_state;                                      // 分块请求体的解码状态CHUNK_*
+  size_t chunk_left;                                    // 当前块还未收到的字节数
+  size_t body_received;                                 // 已收到的请求体字节数(分块编码时为解码后)
+  BodySink body;                                        // 请求体，随数据到达从inBuffer移出
+  std::unique_ptr<MultipartParser> multipart;           // multipart/form-data请求体的解析器，此时请求体不放入body
+  bool chunked_output;                                  // 响应使用分块传输编码
+  std::shared_ptr<TimerNode> timer;                     // 计时节点，连接的各个请求复用同一个
 
   bool isAbleRead;
   bool isAbleWrite;
 
 private:
+  void parseRequest();
+  void processInput();
   int parse_URI();
   int parse_Headers();
+  int initBody(std::string &short_msg);
+  int beginBody(size_t expected, std::string &short_msg);
+  int parse_Body();
+  int storeBody(const char *data, size_t len);
+  int decodeChunks();
   int analysisRequest();
+  const HeaderSpan *findHeader(const char *name) const;
+  bool spanEquals(const StrSpan &span, const char *str) const;
+  std::string spanString(const StrSpan &span) const;
+  int parseConnection();
+  int parseRange(const struct stat &sbuf, std::vector<std::pair<off_t, off_t>> &ranges);
+  void handleRange(int conn_header, int range_state, const std::vector<std::pair<off_t, off_t>> &ranges,
+                   const struct stat &sbuf, const std::string &mime, const SP_Buffer &body, const SP_File &file);
+  bool notModified(const std::string &etag, const struct stat &sbuf);
+  std::string validatorHeader(const std::string &etag, const struct stat &sbuf, const std::string &mime);
+  int parseAcceptEncoding();
+  int serveDirectory(int conn_header);
+  // slot不为空时使用其中预先生成的响应头
+  void handleVariant(int conn_header, const std::shared_ptr<const CompressedVariant> &variant,
+                     const struct stat &sbuf, const std::string &mime, const VariantSlot *slot);
 
 public:
   RequestData();
-  RequestData(int _epollfd, int _fd, std::string addr_IP, std::string _path);
+  RequestData(Epoll *_loop, int _fd, std::string addr_IP, std::string _path);
   ~RequestData();
   void linkTimer(std::shared_ptr<TimerNode> mtimer);
+  std::shared_ptr<TimerNode> getTimer();
   void reset();
   void seperateTimer();
   int getFd();
+  Epoll *getLoop();
   void setFd(int _fd);
   void handleRead();
+  void handleData(const char *buf, size_t len);
+  void takeOutput(OutputQueue &dst);
+  // 继续处理因输出积压暂停的流水线请求
+  void resumeInput();
+  bool inputPaused();
+  bool shouldClose();
   void handleWrite();
-  void handleError(int fd, int err_num, std::string short_msg);
+  // extra_headers为附加的头部行(含\r\n)，如405响应的Allow
+  void handleError(int err_num, std::string short_msg, const std::string &extra_headers = std::string());
+  // 线程池过载时拒绝连接：不再处理请求，回复预先生成的503后关闭
+  void rejectOverload();
   void handleConn();
+  // 分块传输编码的响应：beginChunked发送状态行和响应头(header为其余各行)，writeChunk逐块追加响应体，endChunked结束
+  void beginChunked(int conn_header, const std::string &status, const std::string &header);
+  void writeChunk(const char *data, size_t len);
+  void writeChunk(std::string &&data);
+  void endChunked();
+  // 内置路由的处理函数：登录表单、静态文件，返回ANALYSIS_*
+  int serveLogin();
+  int serveStatic();
+  // 生成带Content-Length的完整响应，status如"200 OK"
+  void sendResponse(const std::string &status, const std::string &content_type, std::string &&content);
+  // 路由参数的值，没有该参数时返回空串
+  std::string routeParam(const RouteMatch &match, const char *name) const;
+  // 生成CONN_HEADER_*对应的Connection响应头
+  static std::string connectionHeader(int conn_header);
+  // 文件修改时间的HTTP日期格式，用作Last-Modified
+  static std::string httpDate(time_t t);
+  // 由inode、大小和修改时间生成ETag，weak为true时生成弱校验ETag(W/前缀)
+  static std::string makeETag(const struct stat &sbuf, bool weak = false);
+  // 按MIME类型和文件名决定Cache-Control策略
+  static std::string cacheControl(const std::string &mime, const std::string &path);
 
   void enableRead();
   void enableWrite();
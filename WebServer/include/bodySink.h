@@ -0,0 +1,56 @@
+#ifndef BODYSINK_H
+#define BODYSINK_H
+#include <atomic>
+#include <string>
+#include <sys/types.h>
+
+// 请求体的存放位置：小请求体放在内存中，大请求体随数据到达写入临时文件
+// 每个请求在内存中的请求体不超过memory_threshold，所有连接合计不超过memory_budget
+// 预算用完时即使是小请求体也写入临时文件，并发上传时内存占用有上限
+// 临时文件创建后即不可见(O_TMPFILE或创建后立即unlink)，关闭描述符后由内核回收
+class BodySink
+{
+private:
+    std::string data; /* 内存中的请求体 */
+    size_t length;    /* 已写入的总字节数 */
+    size_t reserved;  /* 在全局内存预算中占用的字节数 */
+    int fd;           /* 临时文件，-1表示请求体在内存中 */
+
+    static size_t max_size;
+    static size_t memory_threshold;
+    static size_t memory_budget;
+    static std::string spool_dir;
+    static std::atomic<size_t> memory_in_use;
+
+    BodySink(const BodySink &);
+    BodySink &operator=(const BodySink &);
+    bool reserve(size_t len);
+    int spill();
+    int writeFile(const char *buf, size_t len);
+
+public:
+    BodySink();
+    ~BodySink();
+    // _max_size：单个请求体的最大长度；_memory_threshold：单个请求体在内存中的最大长度
+    // _memory_budget：所有请求体合计在内存中的最大长度；_spool_dir：临时文件所在目录
+    static void sink_init(size_t _max_size, size_t _memory_threshold, size_t _memory_budget, const std::string &_spool_dir);
+    static size_t maxSize();
+    // 当前所有请求体在内存中占用的字节数
+    static size_t memoryInUse();
+
+    // 开始接收新的请求体，expected为Content-Length，长度未知(分块传输编码)时为0
+    // 已知超过内存阈值时直接写入临时文件
+    int begin(size_t expected);
+    // 追加请求体数据，写临时文件失败时返回-1
+    int append(const char *buf, size_t len);
+    // 释放内存预算并关闭临时文件，准备接收下一个请求体
+    void clear();
+    size_t size() const;
+    bool inMemory() const;
+    // 请求体在内存中时的内容
+    const std::string &memory() const;
+    // 请求体在临时文件中时的描述符，可用pread读取
+    int fileFd() const;
+};
+
+#endif
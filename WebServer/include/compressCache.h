@@ -0,0 +1,128 @@
+#ifndef COMPRESSCACHE_H
+#define COMPRESSCACHE_H
+#include "outputQueue.h"
+#include "HttpRequestData.h"
+#include "../base/mutexLock.hpp"
+#include <atomic>
+#include <deque>
+#include <list>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <sys/stat.h>
+
+// 内容编码(Content-Encoding)
+const int ENCODING_IDENTITY = 0;
+const int ENCODING_GZIP = 1;
+const int ENCODING_BR = 2;
+const int ENCODING_NUM = 3;
+
+// 压缩结果合计的字节预算
+const size_t COMPRESS_CACHE_BUDGET = 16 * 1024 * 1024;
+// 动态压缩的文件大小范围：太小的文件压缩没有收益，太大的文件压缩耗时过长，都直接发送原文件
+const size_t COMPRESS_MIN_FILE = 256;
+const size_t COMPRESS_MAX_FILE = 1024 * 1024;
+// 每个文件版本只压缩一次，在后台线程中进行，可以使用较高的压缩级别
+const int COMPRESS_GZIP_LEVEL = 9;
+const int COMPRESS_BROTLI_QUALITY = 9;
+// 排队等待压缩的文件版本数上限，超过时直接发送原文件，之后的请求再尝试
+const size_t COMPRESS_MAX_JOBS = 64;
+
+// 文件的一种压缩表示：预压缩的旁路文件(.gz/.br)或动态压缩的结果
+struct CompressedVariant
+{
+    int encoding;
+    SP_Buffer body;   // 动态压缩的结果
+    SP_File file;     // 预压缩的旁路文件
+    size_t size;      // 压缩后的字节数，即Content-Length
+    std::string etag; // 压缩表示与原文件的内容不同，使用自己的ETag
+};
+
+// 压缩表示槽的状态
+const int VARIANT_UNKNOWN = 0; // 尚未查找
+const int VARIANT_PENDING = 1; // 正在查找或等待后台压缩，这期间发送原文件
+const int VARIANT_READY = 2;   // 已确定，variant为空表示发送原文件
+
+// 一个文件版本的一种编码的压缩表示，由静态文件缓存项持有，确定后不再改变
+// 只有把state从VARIANT_UNKNOWN改为VARIANT_PENDING的线程写variant和响应头，state为VARIANT_READY之后读取不需要加锁
+struct VariantSlot
+{
+    std::atomic<int> state;
+    std::shared_ptr<const CompressedVariant> variant;
+    SP_Buffer headers[CONN_HEADER_NUM];      // 压缩表示的200响应头，下标为CONN_HEADER_*
+    SP_Buffer not_modified[CONN_HEADER_NUM]; // 304响应头
+    const std::string *mime;                 // 以下两项属于持有本槽的缓存项，用于生成响应头
+    const std::string *validators;           // ETag之后的Last-Modified、Cache-Control等
+    VariantSlot() : state(VARIANT_UNKNOWN), mime(NULL), validators(NULL) {}
+};
+
+// 压缩表示缓存(单例，静态成员)
+// 优先使用与文件放在一起且不比它旧的预压缩文件(path.br、path.gz)，由打开文件缓存打开
+// 没有时由后台线程压缩一次，结果以文件标识(设备、inode、大小、修改时间)和编码为键缓存，文件变化后键随之改变
+// 压缩完成之前的请求直接发送原文件，IO线程不读文件也不压缩，同一个键只压缩一次
+class CompressCache
+{
+public:
+    typedef std::shared_ptr<const CompressedVariant> SP_Variant;
+
+private:
+    // 等待后台压缩的文件版本
+    struct Job
+    {
+        std::string key;
+        struct stat sbuf;
+        int encoding;
+        SP_Buffer body; // 静态文件缓存中的内容，为空时从file读入
+        SP_File file;
+        std::shared_ptr<VariantSlot> slot; // 压缩完成后填入的槽，可以为空
+    };
+    // lookup的结果
+    enum LookupResult
+    {
+        LOOKUP_DONE,   // 结果已确定，可能为空(不值得压缩)
+        LOOKUP_QUEUED, // 已交给后台线程压缩
+        LOOKUP_RETRY   // 其他请求正在压缩或排队的太多，之后再试
+    };
+
+    typedef std::list<std::pair<std::string, SP_Variant>> VariantList;
+    static MutexLock lock;
+    static VariantList lru; /* 表头为最近使用 */
+    static std::unordered_map<std::string, VariantList::iterator> index;
+    static std::unordered_set<std::string> pending; /* 排队或正在压缩的键 */
+    static size_t bytes;
+    static std::deque<Job> jobs; /* 由job_lock保护 */
+    static pthread_mutex_t job_lock;
+    static pthread_cond_t job_cond;
+    static bool started;         /* 后台压缩线程已启动 */
+
+    static std::string makeKey(const struct stat &sbuf, int encoding);
+    static SP_Variant findSidecar(const std::string &path, const struct stat &sbuf, int encoding, unsigned long version);
+    static SP_Buffer compress(const std::string &data, int encoding);
+    static void insert(const std::string &key, const SP_Variant &variant);
+    static void publish(VariantSlot &slot, const SP_Variant &variant);
+    static LookupResult lookup(const std::string &path, const struct stat &sbuf, int encoding, const SP_Buffer &body,
+                               const SP_File &file, const std::shared_ptr<VariantSlot> &slot, unsigned long version,
+                               SP_Variant &variant);
+    static void runJob(const Job &job);
+    static void *compress_thread(void *args);
+
+public:
+    // 启动后台压缩线程，失败时返回-1，之后只使用预压缩文件
+    static int cache_init();
+    // 编码在Content-Encoding中的名称
+    static const char *encodingName(int encoding);
+    // 文本类的MIME类型才值得压缩，图片、音视频等本身已经压缩过
+    static bool compressible(const std::string &mime);
+    // 返回文件的encoding编码表示，原文件内容取自body(静态文件缓存)或file
+    // 不值得压缩、尚未压缩完成或压缩失败时返回空，调用者发送原文件；第一次请求时交给后台线程压缩
+    static SP_Variant get(const std::string &path, const struct stat &sbuf, int encoding,
+                          const SP_Buffer &body, const SP_File &file, unsigned long version);
+    // 静态文件缓存项的encoding编码表示，slot属于该缓存项，body为缓存项的内容
+    // 每个缓存项只查找一次，之后直接返回slot中的结果，不加锁、不分配内存、不访问文件系统
+    static SP_Variant get(const std::string &path, const struct stat &sbuf, int encoding,
+                          const SP_Buffer &body, const std::shared_ptr<VariantSlot> &slot, unsigned long version);
+};
+
+#endif
@@ -2,36 +2,73 @@
 #define EVENTPOLL
 #include "HttpRequestData.h"
 #include "timer.h"
+#include "taskQueue.h"
+#include "../base/mutexLock.hpp"
 #include <sys/types.h>
 #include <sys/epoll.h>
-#include <unordered_map>
 #include <vector>
 #include <memory>
+#include <string>
+#include <utility>
 
+// 一个Epoll对象就是一个事件循环(Reactor)，拥有自己的epoll fd、连接表和定时器
 class Epoll
 {
 public:
     typedef std::shared_ptr<RequestData> SP_ReqData;
 private:
     // epoll返回事件
-    static epoll_event *events;
-    // 存放fd与request对应关系的哈希表
-    static std::unordered_map<int, SP_ReqData> fd2req;
-    static int epoll_fd;
+    epoll_event *events;
+    // 连接槽：generation在fd每次注册和删除时递增，随事件一起带回，用来识别fd复用后的过期事件
+    struct ConnSlot
+    {
+        SP_ReqData request;
+        unsigned int generation;
+        __uint32_t events; // 当前注册的事件
+        ConnSlot() : generation(0), events(0) {}
+    };
+    // 以fd为下标的连接表，epoll_init时按RLIMIT_NOFILE预分配，之后不再扩容
+    // 线程池模式下epoll_mod/epoll_update/epoll_del也在工作线程中调用：fd以EPOLLONESHOT注册，
+    // 事件触发后在重新注册之前不会再次就绪，这期间只有处理该连接的线程访问它的槽，不需要加锁
+    std::vector<ConnSlot> slots;
+    int epoll_fd;
     static const std::string PATH;
 
-    static TimerManager timer_manager;
+    TimerManager timer_manager;
+
+    // true: 在本线程内直接处理就绪的请求(one loop per thread)
+    // false: 交给线程池处理
+    bool handle_inline;
+    // 本轮就绪的请求，每轮事件循环复用
+    std::vector<SP_ReqData> ready_reqs;
+    // 交给线程池的一批任务，每轮事件循环复用
+    std::vector<ThreadPoolTask> task_batch;
+    // 用于唤醒本事件循环的eventfd
+    int wakeup_fd;
+    // 其他线程(acceptor)投递过来、尚未注册的新连接<fd, IP>
+    MutexLock pending_lock;
+    std::vector<std::pair<int, std::string>> pending_conns;
+
+    void handleWakeup();
+    void registerConnection(int accept_fd, const std::string &ip, const std::string path);
 
 public:
-    static int epoll_init(int maxevents, int listen_num);
-    static int epoll_add(int fd, SP_ReqData request, __uint32_t events);
-    static int epoll_mod(int fd, SP_ReqData request, __uint32_t events);
-    static int epoll_del(int fd, __uint32_t events = (EPOLLIN | EPOLLET | EPOLLONESHOT));
-    static int my_epoll_wait(int listen_fd, int max_events, int timeout);
-    static void acceptConnection(int listen_fd, int epoll_fd, const std::string path);
-    static std::vector<SP_ReqData> getEventsRequest(int listen_fd, int events_num, const std::string path);
+    Epoll();
+    ~Epoll();
+    int epoll_init(int maxevents, int listen_num, bool _handle_inline = false);
+    int epoll_add(int fd, SP_ReqData request, __uint32_t events);
+    int epoll_mod(int fd, __uint32_t events);
+    int epoll_update(int fd, __uint32_t events);
+    int epoll_del(int fd, __uint32_t events = (EPOLLIN | EPOLLET | EPOLLONESHOT));
+    int my_epoll_wait(int listen_fd, int max_events, int timeout);
+    void acceptConnection(int listen_fd, const std::string path);
+    void getEventsRequest(int listen_fd, int events_num, const std::string path);
+    // 跨线程投递一个已accept的连接，由本事件循环所在线程完成注册
+    void queueConnection(int accept_fd, const std::string &ip);
 
-    static void add_timer(SP_ReqData request_data, int timeout);
+    void add_timer(SP_ReqData request_data, int timeout);
+    // 连接是否固定在本事件循环所在线程中处理(持久注册，不使用EPOLLONESHOT)
+    bool isPinned();
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,33 @@
+#ifndef HEADERSCAN_H
+#define HEADERSCAN_H
+
+// 请求头解析用的分隔符扫描(单例，静态成员)
+// 一次比较16(SSE4.2 pcmpestri)或32(AVX2 比较+movemask)个字节，找出解析器需要处理的第一个字节
+// 启动时按CPU支持的指令集选择实现，都不支持或不是x86时使用查表的逐字节实现，三种实现结果相同
+class HeaderScan
+{
+private:
+    typedef const char *(*ScanFunc)(const char *p, const char *end);
+    static ScanFunc key_scan;
+    static ScanFunc value_scan;
+    static const char *impl_name;
+
+    static ScanFunc selectKeyScan();
+    static ScanFunc selectValueScan();
+
+public:
+    // 从p开始查找请求头名称的结束：第一个':'、空白、控制字符或DEL，没有时返回end
+    static const char *scanKey(const char *p, const char *end)
+    {
+        return key_scan(p, end);
+    }
+    // 从p开始查找请求头的值的结束：第一个除'\t'以外的控制字符(包括'\r'、'\n')或DEL，没有时返回end
+    static const char *scanValue(const char *p, const char *end)
+    {
+        return value_scan(p, end);
+    }
+    // 所使用的实现："avx2"、"sse4.2"或"scalar"
+    static const char *implName();
+};
+
+#endif
@@ -0,0 +1,31 @@
+#ifndef IOSTATS_H
+#define IOSTATS_H
+#include <atomic>
+
+// 系统调用次数与完成请求数统计，用于比较epoll与io_uring两种IO后端每个请求的系统调用开销
+// 各线程先累加到线程局部计数器，再由flush()批量合并到全局计数器，避免每次系统调用都竞争同一缓存行
+class IoStats
+{
+private:
+    static thread_local unsigned long local_syscalls;
+    static thread_local unsigned long local_requests;
+    static std::atomic<unsigned long> syscalls;
+    static std::atomic<unsigned long> requests;
+    static unsigned long last_requests; /* 上次report时的请求数，只在report线程中使用 */
+
+public:
+    static void addSyscall(unsigned long n = 1)
+    {
+        local_syscalls += n;
+    }
+    static void addRequest()
+    {
+        ++local_requests;
+    }
+    // 把本线程的计数合并到全局，在每轮事件循环或每个任务结束时调用
+    static void flush();
+    // 有新请求时把累计的系统调用数/请求数写入日志
+    static void report(const char *backend);
+};
+
+#endif
@@ -0,0 +1,73 @@
+#ifndef MULTIPARTPARSER_H
+#define MULTIPARTPARSER_H
+#include "HttpRequestData.h"
+#include "bodySink.h"
+#include <memory>
+#include <string>
+#include <vector>
+
+// feed的返回值
+const int MULTIPART_OK = 0;
+const int MULTIPART_ERROR = -1;     // 格式错误
+const int MULTIPART_TOO_LARGE = -2; // 普通字段合计过长或部分过多
+const int MULTIPART_IO_ERROR = -3;  // 文件内容写临时文件失败
+
+// boundary的最大长度(RFC 2046)
+const size_t MULTIPART_MAX_BOUNDARY = 70;
+// 每个部分的头部(各行合计)的最大字节数
+const size_t MULTIPART_MAX_HEADER = 8192;
+// 普通字段的名称、值等合计的最大字节数
+const size_t MULTIPART_MAX_FIELDS = 64 * 1024;
+// 一个请求最多的部分个数
+const size_t MULTIPART_MAX_PARTS = 64;
+
+// 表单中的一个部分，各StrSpan是在MultipartParser::fieldData()中的位置
+struct MultipartPart
+{
+    StrSpan name;
+    StrSpan filename;
+    StrSpan content_type;
+    StrSpan value;                  // 普通字段的值
+    bool is_file;                   // Content-Disposition带filename参数
+    std::shared_ptr<BodySink> file; // 文件部分的内容，随数据到达写入，大文件在临时文件中
+};
+
+// multipart/form-data请求体的增量解析器：请求体随到随解析，不需要先收齐
+// 在数据中查找分隔符"\r\n--boundary"，可能跨两次到达的部分(分隔符的开头、不完整的头部行)留到下次
+// 普通字段复制到一块连续的内存中，以下标表示；文件部分写入各自的BodySink，内存占用与上传文件的大小无关
+class MultipartParser
+{
+private:
+    std::string delimiter; /* "\r\n--" + boundary */
+    std::string carry;     /* 上次未能处理的数据 */
+    std::string fields;    /* 普通字段的名称、值，文件部分的文件名等 */
+    std::vector<MultipartPart> parts;
+    int state;
+    size_t header_bytes; /* 当前部分的头部已读的字节数 */
+
+    MultipartParser(const MultipartParser &);
+    MultipartParser &operator=(const MultipartParser &);
+    long process(const char *data, size_t len, int &err);
+    int parsePartHeader(const char *line, const char *end);
+    int beginPartData();
+    int appendData(const char *data, size_t len);
+    int store(const std::string &str, StrSpan &span);
+
+public:
+    MultipartParser();
+    // Content-Type的值是否为multipart/form-data
+    static bool isMultipart(const char *content_type, size_t len);
+    // 从Content-Type的值中取出boundary，没有或不合法时返回-1
+    int init(const char *content_type, size_t len);
+    // 输入请求体的下一段数据，返回MULTIPART_*
+    int feed(const char *data, size_t len);
+    // 已读到结束分隔符"--boundary--"
+    bool finished() const;
+    const std::vector<MultipartPart> &getParts() const;
+    // 按名称查找部分，同名时返回第一个，没有时返回NULL
+    const MultipartPart *find(const char *name) const;
+    const std::string &fieldData() const;
+    std::string spanString(const StrSpan &span) const;
+};
+
+#endif
@@ -0,0 +1,62 @@
+#ifndef OPENFILECACHE_H
+#define OPENFILECACHE_H
+#include "outputQueue.h"
+#include "../base/mutexLock.hpp"
+#include <list>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <sys/stat.h>
+
+// 缓存分片数
+const int OPEN_FILE_CACHE_SHARDS = 8;
+
+// 打开的文件及其元数据，err不为0表示文件不可用(不存在或不是普通文件)
+struct OpenFileInfo
+{
+    int err;
+    SP_File file;          // 已打开的文件，多个响应共享，最后一个引用释放时关闭
+    struct stat sbuf;      // 打开时fstat得到的信息
+    std::string mime;      // 按扩展名确定的MIME类型
+    size_t valid_time;     // 有效期截止时间点(毫秒)，过期后重新stat校验
+    unsigned long version; // 取得信息时的外部版本号
+};
+
+// 打开文件缓存(单例，静态成员)，类似nginx的open_file_cache
+// 规范化路径 -> 已打开的fd、大小、修改时间、MIME类型；不存在的文件同样缓存(负缓存)
+// 有效期内直接使用缓存的fd，不调用stat/open；过期后stat一次，文件未变则继续使用原fd
+// 调用者可以传入外部版本号(如静态文件缓存的inotify失效计数)，版本变化时提前校验
+// 项数有上限，按LRU淘汰，防止缓存的fd耗尽描述符
+class OpenFileCache
+{
+public:
+    typedef std::shared_ptr<const OpenFileInfo> SP_Info;
+
+private:
+    typedef std::list<std::pair<std::string, SP_Info>> InfoList;
+    struct Shard
+    {
+        MutexLock lock;
+        InfoList lru; // 表头为最近使用
+        std::unordered_map<std::string, InfoList::iterator> index;
+    };
+    static Shard shards[OPEN_FILE_CACHE_SHARDS];
+    static size_t max_entries; /* 每个分片的最大项数，0表示不缓存 */
+    static int valid_ms;       /* 有效期(毫秒) */
+
+    static SP_Info openFile(const std::string &path, unsigned long version);
+    static void insert(Shard &shard, const std::string &path, const SP_Info &info);
+
+public:
+    // _max_entries：最多缓存的文件数；_valid_ms：有效期(毫秒)
+    static void cache_init(size_t _max_entries, int _valid_ms);
+    // 返回path对应的文件信息，有效期内且version未变时不产生系统调用
+    static SP_Info get(const std::string &path, unsigned long version = 0);
+    // 路径规范化：合并重复的'/'，去掉"."，按字面消去".."(不越过根目录)
+    static std::string normalizePath(const std::string &path);
+    // path是否已经是规范形式，是则不必调用normalizePath重新拼接
+    static bool isNormalized(const std::string &path);
+};
+
+#endif
@@ -0,0 +1,156 @@
+#ifndef OUTPUTQUEUE_H
+#define OUTPUTQUEUE_H
+#include <deque>
+#include <memory>
+#include <new>
+#include <string>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+// 一次sendmsg最多提交的段数
+const int OUTPUT_MAX_IOV = 64;
+
+// 打开的只读文件，最后一个引用释放时关闭描述符
+class FileHandle
+{
+private:
+    int fd;
+    FileHandle(const FileHandle &);
+    FileHandle &operator=(const FileHandle &);
+
+public:
+    explicit FileHandle(int _fd);
+    ~FileHandle();
+    int get() const;
+};
+typedef std::shared_ptr<FileHandle> SP_File;
+// 多个连接共享的只读数据(如缓存的静态文件)，放入队列时不复制
+typedef std::shared_ptr<const std::string> SP_Buffer;
+
+// 每个线程缓存的已释放内存块数
+const int BLOCK_CACHE_SIZE = 8;
+
+// deque按固定大小的块存放元素，当作FIFO使用时队尾每跨过一个块就分配一块、队首同时释放一块
+// 释放的块放入线程本地缓存，长连接上的请求不再反复调用malloc/free；块可能在另一个线程释放，进入那个线程的缓存
+template <typename T>
+struct BlockCacheAllocator
+{
+    typedef T value_type;
+
+    struct Cache
+    {
+        T *blocks[BLOCK_CACHE_SIZE];
+        size_t sizes[BLOCK_CACHE_SIZE];
+        int count;
+        Cache() : count(0) {}
+        ~Cache()
+        {
+            while (count > 0)
+                free(blocks[--count]);
+        }
+    };
+    static Cache &cache()
+    {
+        static thread_local Cache local_cache;
+        return local_cache;
+    }
+
+    BlockCacheAllocator() {}
+    template <typename U>
+    BlockCacheAllocator(const BlockCacheAllocator<U> &) {}
+
+    T *allocate(size_t n)
+    {
+        Cache &c = cache();
+        for (int i = c.count - 1; i >= 0; --i)
+        {
+            if (c.sizes[i] == n)
+            {
+                T *p = c.blocks[i];
+                --c.count;
+                c.blocks[i] = c.blocks[c.count];
+                c.sizes[i] = c.sizes[c.count];
+                return p;
+            }
+        }
+        void *p = malloc(n * sizeof(T));
+        if (p == NULL)
+            throw std::bad_alloc();
+        return static_cast<T *>(p);
+    }
+    void deallocate(T *p, size_t n)
+    {
+        Cache &c = cache();
+        if (c.count < BLOCK_CACHE_SIZE)
+        {
+            c.blocks[c.count] = p;
+            c.sizes[c.count] = n;
+            ++c.count;
+            return;
+        }
+        free(p);
+    }
+};
+
+template <typename T, typename U>
+bool operator==(const BlockCacheAllocator<T> &, const BlockCacheAllocator<U> &)
+{
+    return true;
+}
+
+template <typename T, typename U>
+bool operator!=(const BlockCacheAllocator<T> &, const BlockCacheAllocator<U> &)
+{
+    return false;
+}
+
+// 连接的输出队列：一个响应由若干段组成(响应头、响应体、文件区间)，各段直接移入队列，不再拼接成一个大字符串
+// 内存段用sendmsg一次写出多段，文件段用sendfile直接从页缓存发送，不经过用户态
+// 写不完的部分留在队列中，等可写(EPOLLOUT)时再继续，不在写线程中空转
+// deque在两端增删时不移动已有元素，段的数据地址在发送完之前保持不变，可以交给io_uring异步发送
+class OutputQueue
+{
+private:
+    struct Segment
+    {
+        std::string data;  // 内存段的数据
+        SP_Buffer shared;  // 共享内存段的数据，不为空时代替data
+        SP_File file;      // 文件段的文件，为空表示内存段
+        off_t start;       // 文件段在文件中、共享内存段在共享数据中的起始位置
+        size_t length;     // 本段总字节数
+        size_t offset;     // 本段已发送的字节数
+    };
+    typedef std::deque<Segment, BlockCacheAllocator<Segment>> SegmentDeque;
+    SegmentDeque segments;
+    size_t bytes; // 队列中尚未发送的总字节数
+
+public:
+    OutputQueue();
+    // 追加一段数据，data的内容被移入队列
+    void append(std::string &&data);
+    void append(const char *data, size_t len);
+    // 追加一段共享数据，只增加引用计数
+    void append(const SP_Buffer &buf);
+    // 追加共享数据中[start, start + len)的部分
+    void append(const SP_Buffer &buf, size_t start, size_t len);
+    // 追加文件中[file_offset, file_offset + len)的区间
+    void append(const SP_File &file, off_t file_offset, size_t len);
+    // 把other中的所有段按顺序移到本队列末尾
+    void splice(OutputQueue &other);
+    // 用队首连续的内存段(最多max_iov段)填充iov，返回填充的段数，遇到文件段停止
+    int fillIovec(struct iovec *iov, int max_iov) const;
+    // 把队首内存段之后第一个文件段中的最多max_bytes字节读入内存段，供只能发送内存数据的调用者(io_uring)使用
+    // 会移动队列中的段，不能在发送进行中调用；返回读入的字节数，读文件出错返回-1
+    ssize_t loadFile(size_t max_bytes);
+    // 丢弃已发送的n个字节
+    void consume(size_t n);
+    // 非阻塞地尽量写出队列中的数据，返回写出的字节数，连接出错返回-1
+    // 内核发送缓冲区满(EAGAIN)时立即返回，剩余数据等待下一次可写事件
+    ssize_t flush(int fd);
+    size_t size() const;
+    bool empty() const;
+    void clear();
+};
+
+#endif
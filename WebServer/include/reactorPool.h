@@ -0,0 +1,45 @@
+#ifndef REACTORPOOL_H
+#define REACTORPOOL_H
+#include "epoll.h"
+#include "uring.h"
+#include <pthread.h>
+#include <vector>
+
+#ifndef EPOLLEXCLUSIVE
+#define EPOLLEXCLUSIVE (1u << 28)
+#endif
+
+// 多Reactor模式下的监听方式
+const int LISTEN_ACCEPTOR = 0;  // 主线程accept，按轮询方式把连接分发给IO线程
+const int LISTEN_REUSEPORT = 1; // 每个IO线程一个SO_REUSEPORT监听描述符，由内核按哈希分配连接
+const int LISTEN_EXCLUSIVE = 2; // 所有IO线程共享一个监听描述符，以EPOLLEXCLUSIVE注册，每次只唤醒部分线程
+
+// 多Reactor(one loop per thread)：每个IO线程拥有一个独立的Epoll
+// 新连接由主线程分发或由IO线程自己accept，连接的整个生命周期都留在同一个线程中
+class ReactorPool
+{
+private:
+    static std::vector<Epoll *> loops;     /* 每个IO线程的事件循环 */
+    static std::vector<UringLoop *> urings; /* io_uring后端时每个IO线程的事件循环 */
+    static std::vector<pthread_t> threads; /* IO线程tid数组 */
+    static std::vector<int> listen_fds;    /* 每个IO线程自己监听的描述符，-1表示不监听 */
+    static int next;                       /* 下一个分配连接的事件循环下标 */
+    static int max_events;                 /* 每次epoll_wait返回的最大事件数 */
+    static volatile int shutdown;          /* 标志位，true或false */
+
+    static void *reactor_thread(void *args);
+    static void *uring_thread(void *args);
+
+public:
+    static int reactor_create(int thread_num, int maxevents, int listen_num,
+                              const std::vector<int> &_listen_fds, int listen_mode);
+    // io_uring后端：每个IO线程一个UringLoop，各自在自己的SO_REUSEPORT监听描述符上multishot accept
+    // 内核不支持时返回-1且不启动任何线程
+    static int uring_create(int thread_num, unsigned entries, const std::vector<int> &_listen_fds);
+    static int reactor_destroy();
+    static int reactor_num();
+    // 轮询选择一个事件循环，仅在acceptor线程中调用
+    static Epoll *getNextLoop();
+};
+
+#endif
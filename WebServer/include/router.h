@@ -0,0 +1,91 @@
+#ifndef ROUTER_H
+#define ROUTER_H
+#include "HttpRequestData.h"
+#include <string>
+#include <vector>
+
+// 路由的匹配方式
+const int ROUTE_EXACT = 0;  // 路径与模式完全匹配
+const int ROUTE_PREFIX = 1; // 路径以模式开头(按'/'分段比较，"/a"匹配"/a"、"/a/b"，不匹配"/ab")
+
+// match的返回值
+const int ROUTE_FOUND = 0;
+const int ROUTE_NOT_FOUND = -1;
+const int ROUTE_METHOD_NOT_ALLOWED = -2; // 路径有路由，但不接受该请求方式
+
+// 一个路由最多的参数个数
+const int MAX_ROUTE_PARAMS = 8;
+// 请求方式的个数，METHOD_*作下标
+const int ROUTE_METHOD_NUM = 3;
+
+struct RouteMatch;
+typedef int (*RouteHandler)(RequestData &request, const RouteMatch &match);
+
+// 匹配结果，values与rest是在传给match的路径中的位置
+struct RouteMatch
+{
+    RouteHandler handler;
+    int param_count;
+    const char *names[MAX_ROUTE_PARAMS]; // 参数名，模式中":id"的"id"
+    StrSpan values[MAX_ROUTE_PARAMS];
+    StrSpan rest;                        // 前缀路由中前缀之后的部分
+    unsigned int allowed;                // 路径上有路由的请求方式，第METHOD_*位，用于405响应的Allow头
+};
+
+// 内置路由表的一项
+struct RouteDef
+{
+    int method;
+    const char *pattern; // 以'/'分段，以':'开始的段为参数，匹配任意一段，如"/api/user/:id"
+    int type;            // ROUTE_*
+    RouteHandler handler;
+};
+
+// 路由表(单例，静态成员)：启动时用addRoute注册，compile把注册的路由编译为按路径分段的前缀树
+// 编译后每个节点的子节点在数组中连续并按段排序，匹配时每一段只是一次二分查找，与路由个数基本无关
+// 同一层静态段优先于参数段，匹配失败时不回溯；多个前缀路由都匹配时取最长的一个
+// compile之后只读，IO线程之间不需要加锁
+class Router
+{
+private:
+    // 注册阶段的节点
+    struct BuildNode
+    {
+        std::string segment;
+        std::vector<int> children; /* 静态段 */
+        int param_child;
+        std::string param_name;
+        RouteHandler exact[ROUTE_METHOD_NUM];
+        RouteHandler prefix[ROUTE_METHOD_NUM];
+    };
+    // 编译后的节点，子节点为nodes[first_child, first_child + child_count)，param_child为-1表示没有参数段
+    struct Node
+    {
+        unsigned int seg_off;
+        unsigned int seg_len;
+        unsigned int first_child;
+        unsigned int child_count;
+        int param_child;
+        const char *param_name;
+        RouteHandler exact[ROUTE_METHOD_NUM];
+        RouteHandler prefix[ROUTE_METHOD_NUM];
+    };
+    static std::vector<BuildNode> building;
+    static std::vector<Node> nodes;
+    static std::string segments; /* 各节点的段 */
+
+    static int newBuildNode(const std::string &segment);
+    static int findChild(const Node &node, const char *seg, size_t len);
+
+public:
+    // 注册路由，pattern必须以'/'开始，重复注册时后注册的覆盖先注册的；参数过多或格式错误返回-1
+    static int addRoute(int method, const char *pattern, int type, RouteHandler handler);
+    // 编译已注册的路由，在IO线程启动之前调用
+    static void compile();
+    // 查找method和path(不含查询串)对应的路由，返回ROUTE_*
+    static int match(int method, const char *path, size_t len, RouteMatch &result);
+    // 请求方式的名称，如"GET"
+    static const char *methodName(int method);
+};
+
+#endif
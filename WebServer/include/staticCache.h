@@ -0,0 +1,89 @@
+#ifndef STATICCACHE_H
+#define STATICCACHE_H
+#include "HttpRequestData.h"
+#include "outputQueue.h"
+#include "openFileCache.h"
+#include "compressCache.h"
+#include "../base/mutexLock.hpp"
+#include <atomic>
+#include <list>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include <pthread.h>
+#include <sys/stat.h>
+
+// 缓存分片数，按路径哈希选择分片，减少IO线程之间的锁竞争
+const int STATIC_CACHE_SHARDS = 16;
+// 所有分片合计的字节预算
+const size_t STATIC_CACHE_BUDGET = 32 * 1024 * 1024;
+// 只缓存不超过该大小的文件，大文件仍由sendfile发送
+const size_t STATIC_CACHE_MAX_FILE = 256 * 1024;
+
+// 缓存的静态文件：按Connection头的每种形式预先生成的完整响应头，以及文件内容
+struct StaticEntry
+{
+    SP_Buffer headers[CONN_HEADER_NUM];      // 200响应头，下标为CONN_HEADER_*
+    SP_Buffer not_modified[CONN_HEADER_NUM]; // 304响应头
+    SP_Buffer body;
+    struct stat sbuf;                        // 读入时的文件信息，用于范围请求等需要重新生成响应头的情况
+    std::string mime;
+    std::string etag;
+    std::string real_path;                   // 文件的绝对路径，inotify事件据此使缓存失效
+    std::string variant_validators;          // 验证头中ETag之后的部分，压缩表示的响应头与原文件共用
+    // 各编码的压缩表示，下标为ENCODING_*，由CompressCache在第一次请求时确定，随缓存项一起失效
+    mutable VariantSlot variants[ENCODING_NUM];
+};
+
+// 静态文件缓存(单例，静态成员)：分片的LRU，按字节预算淘汰
+// 只缓存被监视目录中的文件，目录中的文件被修改、删除或移动时由inotify线程使对应的缓存项失效
+// 命中时直接把缓存项的响应头和内容放入输出队列，不产生任何文件系统调用
+class StaticCache
+{
+public:
+    typedef std::shared_ptr<const StaticEntry> SP_Entry;
+
+private:
+    typedef std::list<std::pair<std::string, SP_Entry>> EntryList;
+    struct Shard
+    {
+        MutexLock lock;
+        EntryList lru; // 表头为最近使用的缓存项
+        std::unordered_map<std::string, EntryList::iterator> index;
+        size_t bytes;
+        Shard() : bytes(0) {}
+    };
+    static Shard shards[STATIC_CACHE_SHARDS];
+    static std::unordered_map<int, std::string> watches; /* inotify监视描述符 -> 目录的绝对路径 */
+    static int inotify_fd;
+    static std::atomic<bool> enabled;
+    static std::atomic<unsigned long> version; /* 每次失效加1，用来发现读文件期间发生的修改 */
+    static pthread_t watcher;
+
+    static Shard &getShard(const std::string &path);
+    static size_t entrySize(const SP_Entry &entry);
+    static void invalidate(const std::string &real_path);
+    static void invalidateAll();
+    static void *watch_thread(void *args);
+    static bool isWatched(const std::string &dir);
+
+public:
+    // 监视dirs中的目录并启用缓存，inotify不可用时返回-1，缓存保持关闭
+    static int cache_init(const std::vector<std::string> &dirs);
+    // 命中返回缓存项，未命中返回空
+    static SP_Entry get(const std::string &path);
+    // path是否为被监视的目录之一(静态文件目录)
+    static bool isStaticDir(const std::string &path);
+    // 当前版本，在打开文件之前获取，随后传给put
+    static unsigned long getVersion();
+    // 从打开文件缓存取得的文件读入内容生成缓存项，content_header为Content-Type、Content-Length等及结束空行
+    // validator_header为ETag、Last-Modified、Cache-Control，用于生成304响应头
+    // 文件不在被监视的目录中、过大或读取失败时返回空；读取期间目录发生变化时返回的缓存项只用于本次响应
+    static SP_Entry put(const std::string &path, const OpenFileCache::SP_Info &info,
+                        const std::string &content_header, const std::string &validator_header,
+                        unsigned long _version);
+};
+
+#endif
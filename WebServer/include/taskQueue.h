@@ -0,0 +1,154 @@
+#ifndef TASKQUEUE_H
+#define TASKQUEUE_H
+#include <stddef.h>
+#include <atomic>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// 线程池任务：可调用对象放在对象内部的定长缓冲区中，只能移动，构造、移动和执行都不分配内存
+// 代替std::function + shared_ptr参数，出队入队时只移动，不复制，也不增减引用计数
+class ThreadPoolTask
+{
+public:
+    static const size_t STORAGE_SIZE = 40; /* 可调用对象的最大字节数，够放函数指针加两个shared_ptr */
+
+    ThreadPoolTask() : ops(NULL)
+    {
+    }
+    template <typename F, typename = typename std::enable_if<!std::is_same<typename std::decay<F>::type, ThreadPoolTask>::value>::type>
+    explicit ThreadPoolTask(F &&f) : ops(NULL)
+    {
+        typedef typename std::decay<F>::type T;
+        static_assert(sizeof(T) <= STORAGE_SIZE && alignof(T) <= alignof(void *), "callable too large for ThreadPoolTask");
+        new (&storage) T(std::forward<F>(f));
+        ops = &operations<T>;
+    }
+    ThreadPoolTask(ThreadPoolTask &&other) : ops(NULL)
+    {
+        moveFrom(other);
+    }
+    ThreadPoolTask &operator=(ThreadPoolTask &&other)
+    {
+        if (this != &other)
+        {
+            reset();
+            moveFrom(other);
+        }
+        return *this;
+    }
+    ~ThreadPoolTask()
+    {
+        reset();
+    }
+    // 执行任务，执行后仍需reset或析构才释放可调用对象持有的资源
+    void operator()()
+    {
+        ops(OP_RUN, &storage, NULL);
+    }
+    // 不执行任务而是取消：可调用对象有cancel()成员时调用它(如回复错误)，没有时什么也不做
+    void cancel()
+    {
+        ops(OP_CANCEL, &storage, NULL);
+    }
+    explicit operator bool() const
+    {
+        return ops != NULL;
+    }
+    void reset()
+    {
+        if (ops != NULL)
+        {
+            ops(OP_DESTROY, &storage, NULL);
+            ops = NULL;
+        }
+    }
+
+private:
+    enum
+    {
+        OP_RUN,
+        OP_CANCEL,
+        OP_MOVE,   /* 从other移动构造到self，并析构other */
+        OP_DESTROY
+    };
+    typedef void (*Operations)(int op, void *self, void *other);
+
+    template <typename T>
+    static void operations(int op, void *self, void *other)
+    {
+        T *obj = static_cast<T *>(self);
+        if (op == OP_RUN)
+            (*obj)();
+        else if (op == OP_CANCEL)
+            cancelOf(obj, 0);
+        else if (op == OP_MOVE)
+        {
+            new (self) T(std::move(*static_cast<T *>(other)));
+            static_cast<T *>(other)->~T();
+        }
+        else
+            obj->~T();
+    }
+    template <typename T>
+    static auto cancelOf(T *obj, int) -> decltype(obj->cancel(), void())
+    {
+        obj->cancel();
+    }
+    template <typename T>
+    static void cancelOf(T *, long)
+    {
+    }
+    void moveFrom(ThreadPoolTask &other)
+    {
+        if (other.ops != NULL)
+        {
+            other.ops(OP_MOVE, &storage, &other.storage);
+            ops = other.ops;
+            other.ops = NULL;
+        }
+    }
+
+    ThreadPoolTask(const ThreadPoolTask &);
+    ThreadPoolTask &operator=(const ThreadPoolTask &);
+
+    Operations ops;
+    typename std::aligned_storage<STORAGE_SIZE, alignof(void *)>::type storage;
+};
+
+// 有界多生产者多消费者无锁环形队列(Vyukov)：每个单元带序号，生产者和消费者各自用CAS占用位置
+// 序号等于位置时单元可写，等于位置+1时可读，读完后置为位置+容量供下一轮使用；入队出队都不加锁不分配内存
+class TaskQueue
+{
+private:
+    struct Cell
+    {
+        std::atomic<size_t> sequence;
+        ThreadPoolTask task;
+    };
+    std::vector<Cell> cells;
+    size_t mask;
+    char pad0[64];
+    std::atomic<size_t> enqueue_pos; /* 生产者与消费者的位置放在不同的缓存行 */
+    char pad1[64];
+    std::atomic<size_t> dequeue_pos;
+    char pad2[64];
+
+    TaskQueue(const TaskQueue &);
+    TaskQueue &operator=(const TaskQueue &);
+
+public:
+    TaskQueue();
+    // 容量向上取整为2的幂，在使用之前调用一次
+    void init(size_t capacity);
+    // 成功时从task移走并返回true，队列满时返回false，task不变
+    bool push(ThreadPoolTask &task);
+    // 用一次CAS放入tasks[0, n)中尽可能多的连续几个，返回放入的个数，放入的任务被移走
+    size_t pushBatch(ThreadPoolTask *tasks, size_t n);
+    // 队列空时返回false
+    bool pop(ThreadPoolTask &task);
+    size_t capacity() const;
+};
+
+#endif
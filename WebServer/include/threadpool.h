@@ -1,33 +1,57 @@
 #ifndef __THREADPOOL_H_
 #define __THREADPOOL_H_
 #include <pthread.h>
-#include <functional>
+#include <atomic>
 #include <memory>
 #include <vector>
+#include "taskQueue.h"
 
 // 错误类型
 const int THREADPOOL_INVALID = -1;
 const int THREADPOOL_LOCK_FAILURE = -2;
 const int THREADPOOL_SHUTDOWN = -3;
 const int THREADPOOL_THREAD_FAILURE = -4;
+const int THREADPOOL_QUEUE_FULL = -5; // threadpool_try_add：任务队列已满，任务未被取走
+const int THREADPOOL_REJECTED = -6;   // 任务队列已满，按OVERLOAD_REJECT取消了任务
 
-struct ThreadPoolTask
+// 任务队列满时threadpool_add的处理方式
+const int OVERLOAD_BLOCK = 0;       // 阻塞等待队列有空位
+const int OVERLOAD_REJECT = 1;      // 取消新任务，请求直接回复503
+const int OVERLOAD_INLINE = 2;      // 在添加任务的线程中直接执行新任务
+const int OVERLOAD_SHED_OLDEST = 3; // 取消全局队列中等待最久的任务，为新任务腾出位置
+
+// 工作线程各自的任务队列：本线程从队尾取(后进先出)，其他线程从队头窃取(先进先出)
+// 定长的环形数组，满了以后放入全局队列，入队出队不分配内存
+struct ThreadPoolWorker
 {
-    std::function<void(std::shared_ptr<void>)> fun;   // functional代替函数指针
-    std::shared_ptr<void> args;  // functional的参数
+    pthread_mutex_t lock;             /* 保护任务队列、alive与notified */
+    pthread_cond_t wakeup;            /* 空闲时等待在自己的条件变量上，只会被单独唤醒 */
+    std::vector<ThreadPoolTask> tasks;
+    int head;                         /* 队头下标 */
+    std::atomic<int> size;            /* 任务个数，窃取时不加锁先判断 */
+    std::atomic<unsigned long> completed;       /* 本槽位的线程处理完的任务数 */
+    std::atomic<unsigned long long> service_ns; /* 本槽位的线程处理任务的总耗时(纳秒) */
+    bool alive;                       /* 槽位上有线程，可以接收任务 */
+    bool notified;                    /* 已被唤醒，防止丢失唤醒 */
+    bool idle;                        /* 在空闲列表中，由ThreadPool::idle_lock保护 */
+    char pad[64];                     /* 与相邻槽位不共享缓存行 */
 };
 
 // 任务处理函数
 void myHandler(std::shared_ptr<void> req);
+// 过载时被取消的任务的处理函数
+void myReject(std::shared_ptr<void> req);
 
 /* 描述线程池相关信息 */
+// 添加任务时优先交给空闲线程并只唤醒这些线程；工作线程添加的任务放入自己的队列；
+// 其余(epoll线程添加的)轮流放入各线程的队列，都放不下时放入全局的无锁队列
+// 工作线程依次从自己的队列、全局队列取任务，都为空时从其他线程的队列窃取
 class ThreadPool
 {
 private:
-    static pthread_mutex_t lock;           /* 用于锁住本结构体 */
-    static pthread_mutex_t thread_counter; /* 记录忙状态线程个数de琐 -- busy_thr_num */
+    static pthread_mutex_t lock;           /* 用于锁住线程个数等管理信息 */
     static pthread_cond_t queue_not_full;  /* 当任务队列满时，添加任务的线程阻塞，等待此条件变量 */
-    static pthread_cond_t queue_not_empty; /* 任务队列里不为空时，通知等待任务的线程 */
+    static pthread_mutex_t idle_lock;      /* 保护idle_workers */
 
     static std::vector<pthread_t> threads;  /* 存放线程池中每个线程的tid数组 */
     static pthread_t adjust_tid; /* 存管理线程tid */
@@ -35,23 +59,80 @@ private:
     static int min_thr_num;       /* 线程池最小线程数 */
     static int max_thr_num;       /* 线程池最大线程数 */
     static int live_thr_num;      /* 当前存活线程个数 */
-    static int busy_thr_num;      /* 忙状态线程个数 */
-    static int wait_exit_thr_num; /* 要销毁的线程个数 */
+    static std::atomic<int> busy_thr_num; /* 忙状态线程个数 */
+    static std::atomic<int> wait_exit_thr_num; /* 要销毁的线程个数，由lock保护，没有任务可做的线程先不加锁检查 */
 
-    static std::vector<ThreadPoolTask> queue;  /* 任务队列 */
-    static int queue_front;               /* task_queue队头下标 */
-    static int queue_rear;                /* task_queue队尾下标 */
-    static int queue_size;                /* task_queue队中实际任务数 */
-    static int queue_max_size;            /* task_queue队列可容纳任务数上限 */
+    static TaskQueue queue;                       /* 全局任务队列 */
+    static std::vector<ThreadPoolWorker> workers; /* 与threads一一对应 */
+    static std::vector<int> idle_workers;         /* 等待任务的线程下标，后进先出 */
+    static std::atomic<int> idle_num;             /* idle_workers的长度，添加任务时不加锁判断 */
+    static std::atomic<int> queue_size;           /* 各队列中的任务总数(含已占位置的) */
+    static std::atomic<unsigned> next_worker;     /* 轮流放入的下一个队列 */
+    static std::atomic<int> worker_span;          /* 有线程的槽位的最大下标+1，轮流放入与窃取只扫描这个范围，由lock保护修改 */
+    static int queue_max_size;                    /* 任务总数上限 */
 
     static int shutdown; /* 标志位，线程池使用状态，true或false */
+
+    static int overload_policy;                         /* OVERLOAD_* */
+    static std::atomic<unsigned long> overload_blocked; /* 各种过载处理的次数 */
+    static std::atomic<unsigned long> overload_rejected;
+    static std::atomic<unsigned long> overload_inline;
+    static std::atomic<unsigned long> overload_shed;
+    static unsigned long last_overloads; /* 上次report时的过载次数，只在report线程中使用 */
+
+    static std::atomic<unsigned long> arrivals; /* 放入队列的任务数 */
+    /* 管理线程的测量值与决策，由lock保护 */
+    static int target_thr_num;                  /* 需要的线程数 */
+    static double arrival_rate;                 /* 任务到达速率(个/秒)，指数平均 */
+    static double service_time;                 /* 任务的平均处理时间(秒)，指数平均 */
+    static double queue_wait;                   /* 由Little定律估计的排队时间(秒) */
+    static unsigned long grow_times;            /* 增加、减少线程的次数 */
+    static unsigned long shrink_times;
+    static unsigned long threads_added;         /* 创建、退出的线程个数 */
+    static unsigned long threads_retired;
+    static unsigned long last_report_arrivals;  /* 上次report时的任务数，只在report线程中使用 */
+
+    static bool pushLocal(int index, ThreadPoolTask &task);
+    static bool reserveSlot();
+    static int waitSlot();
+    static void enqueue(ThreadPoolTask &task);
+    static void dispatch(ThreadPoolTask *tasks, int count);
+    static bool popLocal(int index, int k, ThreadPoolTask &task);
+    static bool stealTask(int index, ThreadPoolTask &task);
+    static bool takeTask(int index, ThreadPoolTask &task);
+    static void releaseSlot();
+    static void notifyWorker(int index);
+    static void popIdle(int n, std::vector<int> &picked);
+    static int wakeIdle(int n);
+    static void updateSpan();
+    static void pushIdle(int index);
+    static void removeIdle(int index);
+    static bool tryExit(int index);
+    static void runTask(ThreadPoolTask &task);
+    static void sumWorkerStats(unsigned long &completed, unsigned long long &service_ns);
+    static int addThreads(int add);
 public:
-    static int threadpool_create(int min_thr_num, int max_thr_num, int queue_max_size);
-    static int threadpool_add(std::shared_ptr<void> args, std::function<void(std::shared_ptr<void>)> fun = myHandler);
+    static int threadpool_create(int min_thr_num, int max_thr_num, int queue_max_size, int overload_policy = OVERLOAD_BLOCK);
+    // 添加任务，队列满时按overload_policy处理；fun(args)执行任务，任务被取消时改为调用reject(args)
+    static int threadpool_add(std::shared_ptr<void> args, void (*fun)(std::shared_ptr<void>) = myHandler,
+                              void (*reject)(std::shared_ptr<void>) = myReject);
+    static int threadpool_add(ThreadPoolTask &&task);
+    // 批量添加任务：一次占用位置、一次入队，只唤醒与新任务个数相同的空闲线程，放不下的任务逐个按overload_policy处理
+    // 返回被取消的任务个数，线程池关闭等错误时返回负数，未处理的任务留在tasks中
+    static int threadpool_add_batch(ThreadPoolTask *tasks, int n);
+    // 生成调用fun(args)的任务，任务被取消时改为调用reject(args)
+    static ThreadPoolTask threadpool_task(std::shared_ptr<void> args, void (*fun)(std::shared_ptr<void>) = myHandler,
+                                          void (*reject)(std::shared_ptr<void>) = myReject);
+    // 不阻塞地添加任务，队列满时返回THREADPOOL_QUEUE_FULL，task不变，由调用者处理
+    static int threadpool_try_add(ThreadPoolTask &&task);
+    // 把线程数控制器的状态与决策、各种过载处理的次数写入日志
+    static void threadpool_report();
     static int threadpool_destroy();
     static int threadpool_free();
     static int threadpool_all_threadnum();
     static int threadpool_busy_threadnum();
+    // 管理线程最近一次算出的需要的线程数
+    static int threadpool_target_threadnum();
     static void *threadpool_thread(void *threadpool);
     static void *adjust_thread(void *threadpool);
     static int is_thread_alive(pthread_t tid);
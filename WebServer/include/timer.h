@@ -16,18 +16,28 @@ public:
     typedef std::shared_ptr<RequestData> SP_ReqData;
 private:
     bool deleted;
+    // 连接实际的过期时间
     size_t expired_time;
+    // 节点在小根堆中的排序键，入堆时取expired_time，在堆中期间保持不变
+    size_t queued_time;
+    // 节点是否在小根堆中
+    bool queued;
     SP_ReqData request_data;
 
 public:
     TimerNode(SP_ReqData _request_data, int timeout);
     ~TimerNode();
     void update(int timeout);
+    void rearm(SP_ReqData _request_data, int timeout);
     bool isvalid();
+    void expire();
     void clearReq();
     void setDeleted();
     bool isDeleted() const;
     size_t getExpTime() const;
+    void setQueued(bool _queued);
+    bool isQueued() const;
+    size_t getQueuedTime() const;
 };
 
 // 计时器比较规则(小根堆)
@@ -35,7 +45,7 @@ struct timerCmp
 {
     bool operator()(std::shared_ptr<TimerNode> &a, std::shared_ptr<TimerNode> &b) const
     {
-        return a->getExpTime() > b->getExpTime();
+        return a->getQueuedTime() > b->getQueuedTime();
     }
 };
 
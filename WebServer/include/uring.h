@@ -0,0 +1,114 @@
+#ifndef URING_H
+#define URING_H
+#include "HttpRequestData.h"
+#include <linux/io_uring.h>
+#include <sys/socket.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+// IO后端
+const int IO_BACKEND_EPOLL = 0;
+const int IO_BACKEND_URING = 1;
+
+// user_data高8位为操作类型，低32位为fd
+const unsigned long long URING_OP_ACCEPT = 1;
+const unsigned long long URING_OP_RECV = 2;
+const unsigned long long URING_OP_SEND = 3;
+const unsigned long long URING_OP_TIMEOUT = 4;
+const unsigned long long URING_OP_CANCEL = 5;
+
+// io_uring事件循环，与Epoll并列的另一种IO后端
+// 多次触发(multishot)accept：一个SQE持续产生新连接
+// 多次触发recv + 内核提供缓冲区(provided buffer ring)：不需要为每个连接预先准备读缓冲区
+// 发送请求在一轮完成事件处理完后批量提交，一次io_uring_enter完成提交与等待
+class UringLoop
+{
+public:
+    typedef std::shared_ptr<RequestData> SP_ReqData;
+
+private:
+    // 已提交给内核、尚未发送完的数据及sendmsg参数，发送完成前不能修改
+    // 单独在堆上分配，连接表扩容时地址保持不变
+    struct SendBuffer
+    {
+        OutputQueue queue;
+        struct msghdr msg;
+        struct iovec iov[OUTPUT_MAX_IOV];
+    };
+    struct Conn
+    {
+        SP_ReqData req;
+        std::unique_ptr<SendBuffer> sending;
+        bool recv_armed;      // multishot recv是否仍在进行
+        bool recv_paused;     // 待发送的数据超过高水位，已取消recv，发出后再重新提交
+        bool send_inflight;   // 是否有未完成的send
+        bool closing;         // 已调用shutdown，等待所有请求完成后释放
+        bool close_after_send; // 发送完剩余数据后关闭
+        size_t expired_time;  // 空闲超时时间点(毫秒)
+    };
+
+    int ring_fd;
+    // 提交队列
+    void *sq_ptr;
+    size_t sq_len;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned sq_entries;
+    unsigned sq_local_tail;
+    struct io_uring_sqe *sqes;
+    size_t sqes_len;
+    // 完成队列
+    void *cq_ptr;
+    size_t cq_len;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    // 内核提供的接收缓冲区
+    struct io_uring_buf_ring *buf_ring;
+    size_t buf_ring_len;
+    char *buf_base;
+    unsigned buf_count;
+    unsigned buf_size;
+    unsigned short buf_tail;
+
+    int listen_fd;
+    struct __kernel_timespec tick;
+    // 以fd为下标的连接表
+    std::vector<Conn> conns;
+    // 本轮产生了待发送数据的连接
+    std::vector<int> pending_send;
+
+    struct io_uring_sqe *getSqe();
+    int submitAndWait(unsigned wait_nr);
+    void prepAccept();
+    void prepRecv(int fd);
+    void prepSend(int fd);
+    void prepTimeout();
+    void prepCancelRecv(int fd);
+    int probeRecvMultishot();
+    void recycleBuffer(unsigned short bid);
+
+    void handleAccept(struct io_uring_cqe *cqe);
+    void handleRecv(int fd, struct io_uring_cqe *cqe);
+    void handleSend(int fd, struct io_uring_cqe *cqe);
+    void handleTimeout();
+    void closeConn(int fd);
+    void releaseConn(int fd);
+    void flushSends();
+    void updateRecv(int fd);
+
+public:
+    UringLoop();
+    ~UringLoop();
+    // entries：提交队列长度；_listen_fd：本循环accept的监听描述符
+    int uring_init(unsigned entries, int _listen_fd);
+    // 提交本轮产生的请求，等待并处理完成事件
+    int uring_wait();
+};
+
+#endif
@@ -4,7 +4,8 @@
 #include <string>
 
 ssize_t readn(int fd, void *buff, size_t n);
-ssize_t readn(int fd, std::string &inBuffer);
+// 读到EAGAIN或对端关闭为止，最多读limit字节
+ssize_t readn(int fd, std::string &inBuffer, size_t limit = (size_t)-1);
 ssize_t writen(int fd, void *buff, size_t n);
 ssize_t writen(int fd, std::string &sbuff);
 void handle_for_sigpipe();
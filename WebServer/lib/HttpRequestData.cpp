@@ -5,6 +5,16 @@
 #include "connectionPool.h"
 #include "sql.h"
 #include "log.h"
+#include "ioStats.h"
+#include "staticCache.h"
+#include "openFileCache.h"
+#include "compressCache.h"
+#include "headerScan.h"
+#include "multipartParser.h"
+#include "router.h"
+#include <algorithm>
+#include <atomic>
+#include <dirent.h>
 
 // #include <opencv/cv.h>
 // #include <opencv2/core/core.hpp>
@@ -14,70 +24,209 @@
 
 CLogFile logfile;
 
-// 静态成员类外初始化
-pthread_once_t MimeType::once_control = PTHREAD_ONCE_INIT;
-std::unordered_map<std::string, std::string> MimeType::mime;
-
-// 定义请求的格式
-void MimeType::init()
-{
-    mime[".html"] = "text/html";
-    mime[".avi"] = "video/x-msvideo";
-    mime[".bmp"] = "image/bmp";
-    mime[".c"] = "text/plain";
-    mime[".doc"] = "application/msword";
-    mime[".gif"] = "image/gif";
-    mime[".gz"] = "application/x-gzip";
-    mime[".htm"] = "text/html";
-    mime[".css"] = "text/css";
-    mime[".js"] = "text/javascript";
-    mime[".xml"] = "text/xml";
-    mime[".ico"] = "application/x-ico";
-    mime[".jpg"] = "image/jpeg";
-    mime[".png"] = "image/png";
-    mime[".txt"] = "text/plain";
-    mime[".mp3"] = "audio/mp3";
-    mime["default"] = "text/html";
-}
-
-std::string MimeType::getMime(const std::string &suffix)
-{
-    // 本函数使用初值为PTHREAD_ONCE_INIT的once_control变量保证init函数在本进程执行序列中仅执行一次
-    pthread_once(&once_control, MimeType::init);
-    if (mime.find(suffix) == mime.end())
-        return mime["default"];
-    else
-        return mime[suffix];
+// 内置的类型
+static const char *BUILTIN_MIME[][2] = {
+    {".html", "text/html"},
+    {".avi", "video/x-msvideo"},
+    {".bmp", "image/bmp"},
+    {".c", "text/plain"},
+    {".doc", "application/msword"},
+    {".gif", "image/gif"},
+    {".gz", "application/x-gzip"},
+    {".htm", "text/html"},
+    {".css", "text/css"},
+    {".js", "text/javascript"},
+    {".xml", "text/xml"},
+    {".ico", "application/x-ico"},
+    {".jpg", "image/jpeg"},
+    {".png", "image/png"},
+    {".txt", "text/plain"},
+    {".mp3", "audio/mp3"},
+};
+
+static std::vector<std::pair<std::string, std::string>> builtinMime()
+{
+    std::vector<std::pair<std::string, std::string>> entries;
+    for (size_t i = 0; i < sizeof(BUILTIN_MIME) / sizeof(BUILTIN_MIME[0]); ++i)
+        entries.push_back(std::make_pair(BUILTIN_MIME[i][0], BUILTIN_MIME[i][1]));
+    return entries;
+}
+
+// 静态成员类外初始化，内置的表在静态初始化阶段构造，load之前也可以查找
+std::vector<MimeType::Slot> MimeType::slots;
+std::vector<unsigned int> MimeType::seeds;
+std::string MimeType::default_type = "text/html";
+bool MimeType::ready = MimeType::build(builtinMime());
+
+// FNV-1a，按小写计算
+unsigned long long MimeType::hash(const char *suffix, size_t len)
+{
+    unsigned long long h = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; ++i)
+    {
+        h ^= (unsigned char)tolower((unsigned char)suffix[i]);
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+// 桶的位移与哈希值混合后决定槽，槽数是2的幂
+size_t MimeType::slotOf(unsigned long long h, unsigned int seed)
+{
+    h ^= seed * 0x9e3779b97f4a7c15ULL;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h & (slots.size() - 1);
+}
+
+// entries中同一扩展名出现多次时以后出现的为准
+bool MimeType::build(const std::vector<std::pair<std::string, std::string>> &entries)
+{
+    std::unordered_map<std::string, std::string> unique;
+    for (size_t i = 0; i < entries.size(); ++i)
+    {
+        std::string suffix = entries[i].first;
+        std::transform(suffix.begin(), suffix.end(), suffix.begin(), ::tolower);
+        unique[suffix] = entries[i].second;
+    }
+    std::vector<std::pair<std::string, std::string>> items(unique.begin(), unique.end());
+    // 平均每桶2项，槽数为项数的2倍以上，找不到位移时槽数加倍重试
+    size_t bucket_num = 1;
+    while (bucket_num * 2 < items.size())
+        bucket_num *= 2;
+    size_t slot_num = 1;
+    while (slot_num < items.size() * 2)
+        slot_num *= 2;
+    std::vector<unsigned long long> hashes(items.size());
+    std::vector<std::vector<size_t>> buckets(bucket_num);
+    for (size_t i = 0; i < items.size(); ++i)
+    {
+        hashes[i] = hash(items[i].first.data(), items[i].first.size());
+        buckets[hashes[i] & (bucket_num - 1)].push_back(i);
+    }
+    // 先安排项多的桶
+    std::vector<size_t> order(bucket_num);
+    for (size_t i = 0; i < bucket_num; ++i)
+        order[i] = i;
+    std::sort(order.begin(), order.end(), [&buckets](size_t x, size_t y) { return buckets[x].size() > buckets[y].size(); });
+    while (true)
+    {
+        slots.assign(slot_num, Slot());
+        seeds.assign(bucket_num, 0);
+        bool ok = true;
+        for (size_t b = 0; ok && b < bucket_num; ++b)
+        {
+            const std::vector<size_t> &bucket = buckets[order[b]];
+            if (bucket.empty())
+                break;
+            ok = false;
+            for (unsigned int seed = 0; !ok && seed < 4096; ++seed)
+            {
+                std::vector<size_t> taken;
+                for (size_t k = 0; k < bucket.size(); ++k)
+                {
+                    size_t slot = slotOf(hashes[bucket[k]], seed);
+                    if (!slots[slot].suffix.empty() || std::find(taken.begin(), taken.end(), slot) != taken.end())
+                        break;
+                    taken.push_back(slot);
+                }
+                if (taken.size() != bucket.size())
+                    continue;
+                for (size_t k = 0; k < bucket.size(); ++k)
+                {
+                    slots[taken[k]].suffix = items[bucket[k]].first;
+                    slots[taken[k]].type = items[bucket[k]].second;
+                }
+                seeds[order[b]] = seed;
+                ok = true;
+            }
+        }
+        if (ok)
+            return true;
+        slot_num *= 2;
+    }
+}
+
+int MimeType::load(const char *path)
+{
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL)
+        return -1;
+    std::vector<std::pair<std::string, std::string>> entries = builtinMime();
+    char line[1024];
+    while (fgets(line, sizeof(line), fp) != NULL)
+    {
+        char *comment = strchr(line, '#');
+        if (comment != NULL)
+            *comment = '\0';
+        char *save = NULL;
+        char *type = strtok_r(line, " \t\r\n", &save);
+        if (type == NULL)
+            continue;
+        for (char *ext = strtok_r(NULL, " \t\r\n;", &save); ext != NULL; ext = strtok_r(NULL, " \t\r\n;", &save))
+            entries.push_back(std::make_pair(std::string(".") + ext, std::string(type)));
+    }
+    fclose(fp);
+    build(entries);
+    return 0;
+}
+
+const std::string &MimeType::getMime(const char *suffix, size_t len)
+{
+    unsigned long long h = hash(suffix, len);
+    const Slot &slot = slots[slotOf(h, seeds[h & (seeds.size() - 1)])];
+    if (len > 0 && slot.suffix.size() == len && strncasecmp(slot.suffix.data(), suffix, len) == 0)
+        return slot.type;
+    return default_type;
+}
+
+const std::string &MimeType::getMime(const std::string &suffix)
+{
+    return getMime(suffix.data(), suffix.size());
+}
+
+size_t MimeType::size()
+{
+    size_t n = 0;
+    for (size_t i = 0; i < slots.size(); ++i)
+        n += !slots[i].suffix.empty();
+    return n;
 }
 
 // 监听描述符构造函数
-RequestData::RequestData() : now_read_pos(0),
+RequestData::RequestData() : againTimes(0),
+                             loop(NULL),
+                             isError(false),
+                             input_paused(false),
+                             now_read_pos(0),
                              state(STATE_PARSE_URI),
-                             h_state(h_start),
                              keep_alive(true),
+                             body_framing(BODY_NONE),
+                             chunked_output(false),
                              isAbleRead(true),
-                             isAbleWrite(false),
-                             isError(false),
-                             events(0),
-                             againTimes(0)
+                             isAbleWrite(false)
 {
+    memset(&request, 0, sizeof(request));
 }
 
 // 连接描述符构造函数
-RequestData::RequestData(int _epollfd, int _fd, std::string addr_IP, std::string _path) : now_read_pos(0),
-                                                                                          state(STATE_PARSE_URI),
-                                                                                          h_state(h_start),
-                                                                                          keep_alive(true),
-                                                                                          againTimes(0),
+RequestData::RequestData(Epoll *_loop, int _fd, std::string addr_IP, std::string _path) : againTimes(0),
                                                                                           path(_path),
                                                                                           fd(_fd),
                                                                                           IP(addr_IP),
-                                                                                          epollfd(_epollfd),
+                                                                                          loop(_loop),
+                                                                                          isError(false),
+                                                                                          input_paused(false),
+                                                                                          now_read_pos(0),
+                                                                                          state(STATE_PARSE_URI),
+                                                                                          keep_alive(true),
+                                                                                          body_framing(BODY_NONE),
+                                                                                          chunked_output(false),
                                                                                           isAbleRead(true),
-                                                                                          isAbleWrite(false),
-                                                                                          events(0),
-                                                                                          isError(false)
+                                                                                          isAbleWrite(false)
 {
+    memset(&request, 0, sizeof(request));
 }
 
 // 析构函数
@@ -104,86 +253,58 @@ void RequestData::linkTimer(std::shared_ptr<TimerNode> mtimer)
     timer = mtimer;
 }
 
+// 获取计时节点，还未计时时为空
+std::shared_ptr<TimerNode> RequestData::getTimer()
+{
+    return timer;
+}
+
 // 获取fd
 int RequestData::getFd()
 {
     return fd;
 }
 
+// 获取所属的事件循环
+Epoll *RequestData::getLoop()
+{
+    return loop;
+}
+
 // 设置fd
 void RequestData::setFd(int _fd)
 {
     fd = _fd;
 }
 
-// 重置requestData
+// 重置requestData，准备解析下一个请求；inBuffer中now_read_pos之后可能已有流水线发来的后续请求，保留
 void RequestData::reset()
 {
-    inBuffer.clear();
     againTimes = 0;
     file_name.clear();
     path.clear();
-    now_read_pos = 0;
     state = STATE_PARSE_URI;
-    h_state = h_start;
-    headers.clear();
+    body_framing = BODY_NONE;
+    body.clear();
+    multipart.reset();
+    request.header_count = 0;
     keep_alive = true;
-    // weak_ptr：use_count()返回与weak_ptr共享的shared_ptr数量
-    // expired()若use_count()为0返回true，对象已死
-    // lock()若expired()为true返回一个空的shared_ptr，否则返回一个指向对象的shared_ptr
-    if (timer.lock())
-    {
-        std::shared_ptr<TimerNode> my_timer(timer.lock());
-        my_timer->clearReq();
-        timer.reset();
-    }
+    seperateTimer();
 }
 
+// 停止计时，节点保留下来，处理完请求后重新计时时复用
+// 分发请求前已在事件循环线程中分离，这里再次调用时节点已是删除状态，不再写入
 void RequestData::seperateTimer()
 {
-    if (timer.lock())
-    {
-        std::shared_ptr<TimerNode> my_timer(timer.lock());
-        my_timer->clearReq();
-        // timer制空
-        timer.reset();
-    }
+    if (timer && !timer->isDeleted())
+        timer->clearReq();
 }
 
-// 事件处理函数
-void RequestData::handleRead()
+// 对inBuffer中已收到的数据推进解析状态机，两种IO后端共用
+void RequestData::parseRequest()
 {
-    // 此处循环保证边沿触发一次性读取完，continue来保证读取完
-    // while (true)
     do
     {
-        // readn函数保证一次全部读取完
-        int read_num = readn(fd, inBuffer);
-        if (read_num < 0)
-        {
-            // perror("1");
-            isError = true;
-            handleError(fd, 400, "Bad Request");
-            break;
-        }
-        else if (read_num == 0)
-        {
-            // 非阻塞模式第一次没有读到，或者对端连接已断开会返回0
-            // 有请求出现但是读不到数据，可能是Request Aborted，或者来自网络的数据没有达到等原因
-            // perror("read_num == 0");
-            // 非阻塞模式第一次没有读到
-            if (errno == EAGAIN)
-            {
-                if (againTimes > AGAIN_MAX_TIMES)
-                    isError = true;
-                else
-                    ++againTimes;
-            }
-            else if (errno != 0)
-                isError = true;
-            break;
-        }
-
         if (state == STATE_PARSE_URI)
         {
             int flag = this->parse_URI();
@@ -194,8 +315,8 @@ void RequestData::handleRead()
             }
             else if (flag == PARSE_URI_ERROR)
             {
-                handleError(fd, 400, "Bad Request");
-                isError = true;
+                handleError(400, "Bad Request");
+                state = STATE_FINISH;
                 break;
             }
             else
@@ -211,12 +332,20 @@ void RequestData::handleRead()
             }
             else if (flag == PARSE_HEADER_ERROR)
             {
-                handleError(fd, 400, "Bad Request");
-                isError = true;
+                handleError(400, "Bad Request");
+                state = STATE_FINISH;
+                break;
+            }
+            // 一般POST请求在空行后带请求数据；GET请求一般不带请求数据，带了也要收完，否则会被当成下一个请求
+            std::string short_msg;
+            int err_num = initBody(short_msg);
+            if (err_num != 0)
+            {
+                handleError(err_num, short_msg);
+                state = STATE_FINISH;
                 break;
             }
-            // 一般POST请求在空行后带请求数据；GET请求不带请求数据，携带在URI中
-            if (method == METHOD_POST)
+            if (body_framing != BODY_NONE)
             {
                 state = STATE_RECV_BODY;
             }
@@ -228,362 +357,652 @@ void RequestData::handleRead()
         // POST请求
         if (state == STATE_RECV_BODY)
         {
-            int content_length = -1;
-            if (headers.find("Content-Length") != headers.end())
-            {
-                content_length = stoi(headers["Content-Length"]);
-            }
-            else
-            {
-                handleError(fd, 400, "Bad Request: Lack of argument (Content-Length)");
-                isError = true;
-                break;
-            }
+            int flag = this->parse_Body();
             // 数据部分本次未读完
-            if (inBuffer.size() < content_length)
+            if (flag == PARSE_BODY_AGAIN)
                 // continue;
                 break;
-            state = STATE_ANALYSIS;
-        }
-        if (state == STATE_ANALYSIS)
-        {
-            int flag = this->analysisRequest();
-            if (flag < 0)
+            else if (flag == PARSE_BODY_TOO_LARGE)
             {
-                isError = true;
+                handleError(413, "Payload Too Large");
+                state = STATE_FINISH;
                 break;
             }
-            else if (flag == ANALYSIS_SUCCESS)
+            else if (flag == PARSE_BODY_IO_ERROR)
             {
-
+                handleError(500, "Internal Server Error");
                 state = STATE_FINISH;
                 break;
             }
-            else
+            else if (flag == PARSE_BODY_FORM_ERROR)
             {
-                isError = true;
+                handleError(400, "Bad Request: Invalid multipart body");
+                state = STATE_FINISH;
+                break;
+            }
+            else if (flag == PARSE_BODY_ERROR)
+            {
+                handleError(400, "Bad Request: Invalid chunked body");
+                state = STATE_FINISH;
                 break;
             }
+            state = STATE_ANALYSIS;
+        }
+        if (state == STATE_ANALYSIS)
+        {
+            int flag = this->analysisRequest();
+            if (flag == ANALYSIS_SUCCESS)
+                IoStats::addRequest();
+            else
+                keep_alive = false;
+            // 出错时错误响应已放入输出队列，发送完后关闭连接
+            state = STATE_FINISH;
+            break;
         }
     } while (false);
+}
 
+// 由io_uring后端调用：数据已由内核接收到buf中，不再需要read
+void RequestData::handleData(const char *buf, size_t len)
+{
+    inBuffer.append(buf, len);
+    processInput();
     if (isError)
     {
         MutexLockGuard_LOG();
         logfile.Write("客户端(%s)HTTP解析错误!\n", IP.c_str());
-        // delete this;
-        Epoll::epoll_del(fd);
-        return;
     }
-    if (outBuffer.size() > 0)
-        events |= EPOLLOUT;
-    // 加入epoll继续
-    if (state == STATE_FINISH)
+}
+
+// 依次处理inBuffer中所有完整的请求(HTTP/1.1流水线)，响应按请求顺序追加到输出队列，发送时合并到同一次sendmsg
+// 积压的响应超过高水位时暂停，其余请求留在缓冲区中，输出发出一部分后由resumeInput继续处理
+void RequestData::processInput()
+{
+    // 暂停期间不处理新的请求，由resumeInput清除标志后继续
+    if (input_paused)
+        return;
+    while (true)
     {
-        if (keep_alive)
+        parseRequest();
+        // 从PARSE_HEADER_AGAIN或PARSE_URI_AGAIN或请求体未收完跳出表示没有读到预期的内容，等待继续读
+        if (isError || state != STATE_FINISH)
+            break;
+        // 出错或短连接：之后的请求不再处理，发送完响应后关闭连接
+        if (!keep_alive)
+            break;
         {
             MutexLockGuard_LOG();
             logfile.Write("客户端(%s)HTTP解析成功!\n", IP.c_str());
-            this->reset();
-            events |= EPOLLIN;
         }
-        else
+        this->reset();
+        if (now_read_pos == inBuffer.size())
+            break;
+        if (outQueue.size() >= OUTPUT_HIGH_WATER_MARK)
         {
-            // delete this;
-            return;
+            input_paused = true;
+            break;
         }
     }
-    // 从PARSE_HEADER_AGAIN或PARSE_URI_AGAIN或inBuffer.size() < content_length跳出
-    // 表示没有读到预期的内容，重新读
-    else
+    // 已处理完的请求从缓冲区前部移除；正在接收的请求不移动，其中已记录的下标仍然有效
+    if (state == STATE_PARSE_URI && now_read_pos > 0)
     {
-        events |= EPOLLIN;
+        inBuffer.erase(0, now_read_pos);
+        now_read_pos = 0;
     }
 }
 
-void RequestData::handleWrite()
+void RequestData::resumeInput()
 {
-    if (!isError)
+    if (!input_paused)
+        return;
+    input_paused = false;
+    processInput();
+}
+
+bool RequestData::inputPaused()
+{
+    return input_paused;
+}
+
+// 取出待发送的数据，追加到dst末尾
+void RequestData::takeOutput(OutputQueue &dst)
+{
+    dst.splice(outQueue);
+}
+
+// 出错或短连接处理完毕，发送完剩余数据后应关闭连接
+bool RequestData::shouldClose()
+{
+    return isError || (state == STATE_FINISH && !keep_alive);
+}
+
+// 事件处理函数
+void RequestData::handleRead()
+{
+    // 此处循环保证边沿触发一次性读取完，continue来保证读取完
+    // 每次最多读INPUT_READ_BATCH字节，处理后再继续读，上传的请求体随读随转存
+    bool first = true;
+    while (true)
     {
-        if (writen(fd, outBuffer) < 0)
+        // 先清零errno，读到0字节时据此区分对端关闭(errno为0)与暂无数据(EAGAIN)
+        errno = 0;
+        int read_num = readn(fd, inBuffer, INPUT_READ_BATCH);
+        if (read_num < 0)
         {
-            // perror("writen");
-            events = 0;
+            // 读出错说明连接已不可用，不再发送错误响应
             isError = true;
-            Epoll::epoll_del(fd, (EPOLLOUT | EPOLLET | EPOLLONESHOT));
+            break;
+        }
+        else if (read_num == 0)
+        {
+            // 上一批恰好读满，数据已经读完(EAGAIN)；errno为0说明对端已关闭，与第一次读到0时一样处理
+            if (!first)
+            {
+                if (errno != EAGAIN)
+                    isError = true;
+                break;
+            }
+            // 非阻塞模式第一次没有读到，或者对端连接已断开会返回0
+            // 有请求出现但是读不到数据，可能是Request Aborted，或者来自网络的数据没有达到等原因
+            // perror("read_num == 0");
+            // 非阻塞模式第一次没有读到
+            if (errno == EAGAIN)
+            {
+                if (againTimes > AGAIN_MAX_TIMES)
+                    isError = true;
+                else
+                    ++againTimes;
+            }
+            else
+                isError = true;
+            break;
         }
-        else if (outBuffer.size() > 0)
-            events |= EPOLLOUT;
+
+        processInput();
+        // 输出积压时不再读取，剩下的数据留在套接字中，等输出发出后再读
+        if ((size_t)read_num < INPUT_READ_BATCH || isError || input_paused)
+            break;
+        first = false;
+    }
+
+    if (isError)
+    {
+        MutexLockGuard_LOG();
+        logfile.Write("客户端(%s)HTTP解析错误!\n", IP.c_str());
+        // delete this;
+        loop->epoll_del(fd);
+        return;
     }
+    // 响应已放入输出队列，由handleConn发送并决定之后关注的事件
 }
 
-void RequestData::handleConn()
+// 非阻塞地发送输出队列，写不完的部分留待下一次EPOLLOUT
+void RequestData::handleWrite()
 {
     if (!isError)
     {
-        if (events != 0)
-        {
-            // 一定要先加时间信息，否则可能会出现刚加进去，下个in触发来了，然后分离失败后，又加入队列，最后超时被删，然后正在线程中进行的任务出错，double free错误。
-            // 新增时间信息
-            int timeout = 2000;
-            if (keep_alive)
-                timeout = 5 * 60 * 1000; // 超时时间为5分钟
-            isAbleRead = false;
-            isAbleWrite = false;
-            // 新增时间信息
-            // pthread_mutex_lock(&qlock);
-            // 使用shared_from_this()函数，不是用this，因为这样会造成2个非共享的share_ptr指向同一个对象，
-            // 未增加引用计数导对象被析构两次
-            Epoll::add_timer(shared_from_this(), timeout);
-            if ((events & EPOLLIN) && (events & EPOLLOUT))
-            {
-                events = __uint32_t(0);
-                events |= EPOLLOUT;
-            }
-            events |= (EPOLLET | EPOLLONESHOT);
-            __uint32_t _events = events;
-            events = 0;
-            if (Epoll::epoll_mod(fd, shared_from_this(), _events) < 0)
-            {
-                // 返回错误处理
-                MutexLockGuard_LOG();
-                logfile.Write("epoll mod failed\n");
-            }
-        }
-        else if (keep_alive) // 正常处理完写
-        {
-            events |= (EPOLLIN | EPOLLET | EPOLLONESHOT);
-            int timeout = 5 * 60 * 1000;
-            isAbleRead = false;
-            isAbleWrite = false;
-            Epoll::add_timer(shared_from_this(), timeout);
-            __uint32_t _events = events;
-            events = 0;
-            if (Epoll::epoll_mod(fd, shared_from_this(), _events) < 0)
-            {
-                // 返回错误处理
-                MutexLockGuard_LOG();
-                logfile.Write("epoll mod failed\n");
-            }
-        }
-        else
+        if (outQueue.flush(fd) < 0)
         {
-            Epoll::epoll_del(fd, (EPOLLOUT | EPOLLET | EPOLLONESHOT));
+            isError = true;
+            loop->epoll_del(fd);
         }
     }
 }
 
-// 解析URI：确定属性filename,HTTPversion,method
-int RequestData::parse_URI()
+void RequestData::handleConn()
 {
-    // str引用inBuffer，改变str就是改变inBuffer
-    std::string &str = inBuffer;
-    // 读到完整的请求行再开始解析请求
-    int pos = str.find('\r', now_read_pos);
-    // 没有找到说明此次读取请求头包含不完全
-    if (pos < 0)
+    if (isError)
+        return;
+    // 直接尝试发送，大多数响应一次即可写完，不必等待EPOLLOUT
+    if (!outQueue.empty())
     {
-        return PARSE_URI_AGAIN;
+        handleWrite();
+        if (isError)
+            return;
     }
-    // 去掉请求行所占的空间，节省空间
-    std::string request_line = str.substr(0, pos);
-    if (str.size() > pos + 1)
-        str = str.substr(pos + 1);
-    else
-        str.clear();
-    // Method
-    pos = request_line.find("GET");
-    if (pos < 0)
+    // 流水线中因输出积压暂停的请求：已发出的数据使积压降到高水位以下后继续处理并发送
+    bool was_paused = input_paused;
+    while (input_paused && outQueue.size() < OUTPUT_HIGH_WATER_MARK)
     {
-        pos = request_line.find("POST");
-        if (pos < 0)
-        {
-            return PARSE_URI_ERROR;
-        }
-        else
-        {
-            method = METHOD_POST;
-        }
+        resumeInput();
+        handleWrite();
+        if (isError)
+            return;
     }
-    else
+    // 短连接且数据已全部发出
+    if (outQueue.empty() && !keep_alive)
     {
-        method = METHOD_GET;
+        loop->epoll_del(fd);
+        return;
     }
-    // filename
-    pos = request_line.find("/", pos);
-    if (pos < 0)
+    // 一定要先加时间信息，否则可能会出现刚加进去，下个in触发来了，然后分离失败后，又加入队列，最后超时被删，然后正在线程中进行的任务出错，double free错误。
+    isAbleRead = false;
+    isAbleWrite = false;
+    // 使用shared_from_this()函数，不是用this，因为这样会造成2个非共享的share_ptr指向同一个对象，
+    // 未增加引用计数导对象被析构两次
+    loop->add_timer(shared_from_this(), keep_alive ? 5 * 60 * 1000 : 2000);
+    int ret;
+    if (loop->isPinned())
     {
-        return PARSE_URI_ERROR;
+        // 连接固定在所属IO线程：整个生命周期保持边沿触发注册，不再使用EPOLLONESHOT
+        // 只有关注的事件发生变化时才调用epoll_ctl；积压超过高水位时暂停读取，等数据发出后再恢复
+        __uint32_t interest = EPOLLET | EPOLLRDHUP;
+        if (outQueue.size() < OUTPUT_HIGH_WATER_MARK)
+            interest |= EPOLLIN;
+        if (!outQueue.empty())
+            interest |= EPOLLOUT;
+        // 暂停时读取提前停止，套接字中可能还有数据：即使关注的事件不变也重新MOD，让边沿触发重新检查可读
+        ret = was_paused ? loop->epoll_mod(fd, interest) : loop->epoll_update(fd, interest);
     }
     else
     {
-        int _pos = request_line.find(' ', pos);
-        if (_pos < 0)
-            return PARSE_URI_ERROR;
-        else
-        {
-            if (_pos - pos > 1)
-            {
-                file_name = request_line.substr(pos, _pos - pos);
-                int __pos = file_name.find('?');
-                if (__pos >= 0)
-                {
-                    file_name = file_name.substr(0, __pos);
-                }
-            }
-            else
-                file_name = "../doc/hello.html";
-        }
-        pos = _pos;
-    }
-    // cout << "file_name: ----------" << file_name << endl;
-    //  HTTP 版本号
-    pos = request_line.find("/", pos);
-    if (pos < 0)
-    {
-        return PARSE_URI_ERROR;
+        // 交给线程池处理时每次重新激活EPOLLONESHOT，有未发完的数据时只等待可写，暂不读取新请求
+        __uint32_t interest = outQueue.empty() ? EPOLLIN : EPOLLOUT;
+        ret = loop->epoll_mod(fd, interest | EPOLLET | EPOLLONESHOT);
     }
-    else
+    if (ret < 0)
     {
-        if (request_line.size() - pos <= 3)
-        {
-            return PARSE_URI_ERROR;
-        }
-        else
-        {
-            std::string ver = request_line.substr(pos + 1, 3);
-            if (ver == "1.0")
-            {
-                HTTPversion = HTTP_10;
-            }
-            else if (ver == "1.1")
-            {
-                HTTPversion = HTTP_11;
-            }
-            else
-                return PARSE_URI_ERROR;
-        }
+        // 返回错误处理
+        MutexLockGuard_LOG();
+        logfile.Write("epoll mod failed\n");
     }
-    return PARSE_URI_SUCCESS;
 }
 
-// 解析请求头
-int RequestData::parse_Headers()
+// inBuffer中[b, e)对应的StrSpan
+static StrSpan makeSpan(const char *base, const char *b, const char *e)
 {
-    std::string &str = inBuffer;
-    int key_start = -1, key_end = -1, value_start = -1, value_end = -1;
-    int now_read_line_begin = 0;
-    bool notFinish = true;
-    for (int i = 0; i < str.size() && notFinish; ++i)
-    {
-        switch (h_state)
-        {
-        case h_start:
-        {
-            if (str[i] == '\n' || str[i] == '\r')
-                break;
-            h_state = h_key;
-            key_start = i;
-            now_read_line_begin = i;
-            break;
-        }
-        case h_key:
-        {
-            if (str[i] == ':')
-            {
-                key_end = i;
-                if (key_end - key_start <= 0)
-                    return PARSE_HEADER_ERROR;
-                h_state = h_colon;
-            }
-            else if (str[i] == '\n' || str[i] == '\r')
+    StrSpan span;
+    span.off = b - base;
+    span.len = e - b;
+    return span;
+}
+
+// 解析请求行"方法 目标 版本"：确定属性filename,HTTPversion,method
+// 只记录各部分在inBuffer中的位置，已解析的内容保留在缓冲区中，不再截取、复制
+int RequestData::parse_URI()
+{
+    const char *buf = inBuffer.data();
+    const char *end = buf + inBuffer.size();
+    const char *begin = buf + now_read_pos;
+    // 忽略请求行之前的空行
+    while (begin < end && (*begin == '\r' || *begin == '\n'))
+        ++begin;
+    now_read_pos = begin - buf;
+    // 读到完整的请求行再开始解析请求
+    const char *eol = (const char *)memchr(begin, '\n', end - begin);
+    // 没有找到说明此次读取请求行包含不完全
+    if (eol == NULL)
+        return (size_t)(end - begin) > MAX_HEADER_SIZE ? PARSE_URI_ERROR : PARSE_URI_AGAIN;
+    const char *line_end = (eol > begin && eol[-1] == '\r') ? eol - 1 : eol;
+    now_read_pos = eol + 1 - buf;
+    const char *sp1 = (const char *)memchr(begin, ' ', line_end - begin);
+    if (sp1 == NULL)
+        return PARSE_URI_ERROR;
+    const char *sp2 = (const char *)memchr(sp1 + 1, ' ', line_end - sp1 - 1);
+    if (sp2 == NULL)
+        return PARSE_URI_ERROR;
+    request.method = makeSpan(buf, begin, sp1);
+    request.target = makeSpan(buf, sp1 + 1, sp2);
+    request.version = makeSpan(buf, sp2 + 1, line_end);
+    request.header_count = 0;
+    // Method
+    if (spanEquals(request.method, "GET"))
+        method = METHOD_GET;
+    else if (spanEquals(request.method, "POST"))
+        method = METHOD_POST;
+    else
+        return PARSE_URI_ERROR;
+    // filename
+    const char *target = sp1 + 1;
+    if (request.target.len == 0 || target[0] != '/')
+        return PARSE_URI_ERROR;
+    if (request.target.len > 1)
+    {
+        const char *query = (const char *)memchr(target, '?', request.target.len);
+        file_name.assign(target, query ? query - target : request.target.len);
+    }
+    else
+        file_name = "../doc/hello.html";
+    //  HTTP 版本号
+    if (spanEquals(request.version, "HTTP/1.1"))
+        HTTPversion = HTTP_11;
+    else if (spanEquals(request.version, "HTTP/1.0"))
+        HTTPversion = HTTP_10;
+    else
+        return PARSE_URI_ERROR;
+    return PARSE_URI_SUCCESS;
+}
+
+// 解析请求头：逐行记录键和值的位置，数据不完整时停在未完整的行首，下次从该行继续
+// 键和值的结束位置由HeaderScan一次扫描多个字节得到，扫描同时拒绝键中的空白和控制字符、值中的控制字符
+int RequestData::parse_Headers()
+{
+    const char *buf = inBuffer.data();
+    const char *end = buf + inBuffer.size();
+    while (true)
+    {
+        const char *begin = buf + now_read_pos;
+        if (begin < end && (*begin == '\r' || *begin == '\n'))
+        {
+            // 空行，请求头结束，要么后面还有请求体，要么刚好读完
+            if (*begin == '\r' && begin + 1 == end)
+                break;
+            if (*begin == '\r' && begin[1] != '\n')
                 return PARSE_HEADER_ERROR;
+            now_read_pos += (*begin == '\r') ? 2 : 1;
+            return PARSE_HEADER_SUCCESS;
+        }
+        if (request.header_count == MAX_HEADERS)
+            return PARSE_HEADER_ERROR;
+        // 键以':'结束，键为空或在':'之前遇到其他分隔符都是错误
+        const char *colon = HeaderScan::scanKey(begin, end);
+        if (colon == end)
+            break;
+        if (*colon != ':' || colon == begin)
+            return PARSE_HEADER_ERROR;
+        const char *value = colon + 1;
+        while (value < end && (*value == ' ' || *value == '\t'))
+            ++value;
+        const char *line_end = HeaderScan::scanValue(value, end);
+        if (line_end == end)
             break;
+        const char *eol = line_end;
+        if (*eol == '\r')
+        {
+            if (eol + 1 == end)
+                break;
+            ++eol;
         }
-        case h_colon:
+        // 值中出现了'\n'以外的控制字符，或'\r'后面不是'\n'
+        if (*eol != '\n')
+            return PARSE_HEADER_ERROR;
+        // 去掉值末尾的空白
+        const char *value_end = line_end;
+        while (value_end > value && (value_end[-1] == ' ' || value_end[-1] == '\t'))
+            --value_end;
+        if (value == value_end || (size_t)(value_end - value) > MAX_HEADER_VALUE)
+            return PARSE_HEADER_ERROR;
+        now_read_pos = eol + 1 - buf;
+        if (now_read_pos - request.method.off > MAX_HEADER_SIZE)
+            return PARSE_HEADER_ERROR;
+        HeaderSpan &header = request.headers[request.header_count++];
+        header.key = makeSpan(buf, begin, colon);
+        header.value = makeSpan(buf, value, value_end);
+    }
+    // 没读完头
+    return inBuffer.size() - request.method.off > MAX_HEADER_SIZE ? PARSE_HEADER_ERROR : PARSE_HEADER_AGAIN;
+}
+
+// 根据请求头确定请求体的接收方式：Content-Length或分块传输编码(Transfer-Encoding: chunked)
+// 成功返回0，否则返回错误响应的状态码，short_msg为错误说明
+int RequestData::initBody(std::string &short_msg)
+{
+    const HeaderSpan *encoding = findHeader("Transfer-Encoding");
+    const HeaderSpan *length = findHeader("Content-Length");
+    body_framing = BODY_NONE;
+    if (encoding != NULL)
+    {
+        // 两者同时出现时无法确定请求体在哪里结束，中间代理可能与本服务器理解不同(请求走私)
+        if (length != NULL)
         {
-            if (str[i] == ' ')
-            {
-                h_state = h_spaces_after_colon;
-            }
-            else
-                return PARSE_HEADER_ERROR;
-            break;
+            short_msg = "Bad Request: Both Content-Length and Transfer-Encoding";
+            return 400;
         }
-        case h_spaces_after_colon:
+        // 只支持chunked一种传输编码
+        if (encoding->value.len != 7 || strncasecmp(inBuffer.data() + encoding->value.off, "chunked", 7) != 0)
         {
-            h_state = h_value;
-            value_start = i;
-            break;
+            short_msg = "Not Implemented";
+            return 501;
         }
-        case h_value:
+        body_framing = BODY_CHUNKED;
+        chunk_state = CHUNK_SIZE;
+        chunk_left = 0;
+        return beginBody(0, short_msg);
+    }
+    if (length == NULL)
+    {
+        if (method != METHOD_POST)
+            return 0;
+        short_msg = "Bad Request: Lack of argument (Content-Length)";
+        return 400;
+    }
+    // 只接受十进制数字，超过9位时一定超过最大长度，不再累加，避免溢出
+    const char *digits = inBuffer.data() + length->value.off;
+    size_t content_length = 0;
+    bool valid = true;
+    for (unsigned int i = 0; valid && i < length->value.len; ++i)
+    {
+        valid = isdigit((unsigned char)digits[i]);
+        if (i < 9)
+            content_length = content_length * 10 + (digits[i] - '0');
+    }
+    if (!valid)
+    {
+        short_msg = "Bad Request: Invalid Content-Length";
+        return 400;
+    }
+    // 长度已知，超过上限时不必接收
+    if (length->value.len > 9 || content_length > BodySink::maxSize())
+    {
+        short_msg = "Payload Too Large";
+        return 413;
+    }
+    if (content_length == 0)
+        return 0;
+    body_framing = BODY_LENGTH;
+    body_length = content_length;
+    return beginBody(content_length, short_msg);
+}
+
+// 准备接收请求体，expected为Content-Length，分块编码时为0
+// multipart/form-data的请求体边收边解析，文件部分写入各自的BodySink，其余请求体整体放入body
+int RequestData::beginBody(size_t expected, std::string &short_msg)
+{
+    body_received = 0;
+    const HeaderSpan *type = findHeader("Content-Type");
+    if (method == METHOD_POST && type != NULL &&
+        MultipartParser::isMultipart(inBuffer.data() + type->value.off, type->value.len))
+    {
+        multipart.reset(new MultipartParser());
+        if (multipart->init(inBuffer.data() + type->value.off, type->value.len) < 0)
         {
-            if (str[i] == '\r')
-            {
-                h_state = h_CR;
-                value_end = i;
-                if (value_end - value_start <= 0)
-                    return PARSE_HEADER_ERROR;
-            }
-            else if (i - value_start > 255)
-                return PARSE_HEADER_ERROR;
-            break;
+            short_msg = "Bad Request: Invalid multipart boundary";
+            return 400;
         }
-        case h_CR:
+        return 0;
+    }
+    if (body.begin(expected) < 0)
+    {
+        short_msg = "Internal Server Error";
+        return 500;
+    }
+    return 0;
+}
+
+// 接收请求体：已收到的部分随时写入body并从inBuffer中移除，缓冲区中只保留请求头和尚未处理的数据
+// 请求头在now_read_pos之前，移除其后的内容不影响已记录的下标
+int RequestData::parse_Body()
+{
+    int ret = PARSE_BODY_SUCCESS;
+    if (body_framing == BODY_LENGTH)
+    {
+        size_t n = std::min(body_length - body_received, inBuffer.size() - now_read_pos);
+        if (n > 0)
         {
-            if (str[i] == '\n')
-            {
-                h_state = h_LF;
-                std::string key(str.begin() + key_start, str.begin() + key_end);
-                std::string value(str.begin() + value_start, str.begin() + value_end);
-                headers[key] = value;
-                now_read_line_begin = i;
-            }
-            else
-                return PARSE_HEADER_ERROR;
-            break;
+            ret = storeBody(inBuffer.data() + now_read_pos, n);
+            inBuffer.erase(now_read_pos, n);
         }
-        case h_LF:
+        if (ret == PARSE_BODY_SUCCESS && body_received < body_length)
+            ret = PARSE_BODY_AGAIN;
+    }
+    else
+    {
+        size_t start = now_read_pos;
+        ret = decodeChunks();
+        // 已解码的块(包括块大小行)移除，未收完的行留待下次继续
+        inBuffer.erase(start, now_read_pos - start);
+        now_read_pos = start;
+    }
+    // 请求体已收完，multipart/form-data必须以结束分隔符结尾
+    if (ret == PARSE_BODY_SUCCESS && multipart && !multipart->finished())
+        ret = PARSE_BODY_FORM_ERROR;
+    return ret;
+}
+
+// 收到的一段请求体：multipart/form-data交给解析器，其他写入body
+int RequestData::storeBody(const char *data, size_t len)
+{
+    body_received += len;
+    if (!multipart)
+        return body.append(data, len) < 0 ? PARSE_BODY_IO_ERROR : PARSE_BODY_SUCCESS;
+    int ret = multipart->feed(data, len);
+    if (ret == MULTIPART_TOO_LARGE)
+        return PARSE_BODY_TOO_LARGE;
+    if (ret == MULTIPART_IO_ERROR)
+        return PARSE_BODY_IO_ERROR;
+    return ret == MULTIPART_OK ? PARSE_BODY_SUCCESS : PARSE_BODY_FORM_ERROR;
+}
+
+// 分块传输编码：随数据到达增量解码，块数据写入body，now_read_pos移到已处理的位置
+int RequestData::decodeChunks()
+{
+    const char *buf = inBuffer.data();
+    const char *end = buf + inBuffer.size();
+    while (chunk_state != CHUNK_DONE)
+    {
+        if (chunk_state == CHUNK_DATA)
         {
-            if (str[i] == '\r')
-            {
-                h_state = h_end_CR;
-            }
-            else
-            {
-                key_start = i;
-                h_state = h_key;
-            }
-            break;
+            size_t n = std::min(chunk_left, inBuffer.size() - now_read_pos);
+            if (n == 0)
+                return PARSE_BODY_AGAIN;
+            int ret = storeBody(buf + now_read_pos, n);
+            if (ret != PARSE_BODY_SUCCESS)
+                return ret;
+            now_read_pos += n;
+            chunk_left -= n;
+            if (chunk_left == 0)
+                chunk_state = CHUNK_DATA_END;
+            continue;
+        }
+        // 其余部分都以行为单位：块大小行、块数据后的CRLF、最后一块之后的trailer
+        const char *line = buf + now_read_pos;
+        const char *eol = (const char *)memchr(line, '\n', end - line);
+        if (eol == NULL)
+            return (size_t)(end - line) > MAX_HEADER_SIZE ? PARSE_BODY_ERROR : PARSE_BODY_AGAIN;
+        const char *line_end = (eol > line && eol[-1] == '\r') ? eol - 1 : eol;
+        now_read_pos = eol + 1 - buf;
+        if (chunk_state == CHUNK_DATA_END)
+        {
+            if (line_end != line)
+                return PARSE_BODY_ERROR;
+            chunk_state = CHUNK_SIZE;
         }
-        case h_end_CR:
+        else if (chunk_state == CHUNK_SIZE)
         {
-            if (str[i] == '\n')
+            // 块大小为十六进制，之后可以有以';'开始的块扩展，忽略
+            size_t len = 0;
+            const char *p = line;
+            for (; p < line_end && isxdigit((unsigned char)*p); ++p)
             {
-                h_state = h_end_LF;
+                if (p - line >= 8)
+                    return PARSE_BODY_ERROR;
+                len = len * 16 + (isdigit((unsigned char)*p) ? *p - '0' : (tolower((unsigned char)*p) - 'a' + 10));
             }
+            if (p == line || (p < line_end && *p != ';' && *p != ' ' && *p != '\t'))
+                return PARSE_BODY_ERROR;
+            if (len == 0)
+                chunk_state = CHUNK_TRAILER;
             else
-                return PARSE_HEADER_ERROR;
-            break;
-        }
-        // 要么后面还有请求体，要么刚好读完空行\n
-        case h_end_LF:
-        {
-            notFinish = false;
-            key_start = i;
-            now_read_line_begin = i;
-            break;
-        }
+            {
+                if (body_received + len > BodySink::maxSize())
+                    return PARSE_BODY_TOO_LARGE;
+                chunk_left = len;
+                chunk_state = CHUNK_DATA;
+            }
         }
+        // trailer中的字段忽略，空行结束
+        else if (line_end == line)
+            chunk_state = CHUNK_DONE;
     }
-    if (h_state == h_end_LF)
+    return PARSE_BODY_SUCCESS;
+}
+
+// 开始一个分块传输编码的响应：响应体长度未知，之后由writeChunk边生成边放入输出队列，endChunked结束
+// HTTP/1.0客户端不支持分块编码，改为不带长度的响应体，发送完后关闭连接表示结束
+void RequestData::beginChunked(int conn_header, const std::string &status, const std::string &header)
+{
+    chunked_output = (HTTPversion == HTTP_11);
+    std::string head = "HTTP/1.1 " + status + "\r\n";
+    if (chunked_output)
     {
-        str = str.substr(now_read_line_begin);
-        return PARSE_HEADER_SUCCESS;
+        head += connectionHeader(conn_header);
+        head += "Transfer-Encoding: chunked\r\n";
     }
-    // 没读完头
-    str = str.substr(now_read_line_begin);
-    return PARSE_HEADER_AGAIN;
+    else
+    {
+        keep_alive = false;
+        head += connectionHeader(CONN_HEADER_CLOSE);
+    }
+    head += header + "\r\n";
+    outQueue.append(std::move(head));
+}
+
+void RequestData::writeChunk(const char *data, size_t len)
+{
+    writeChunk(std::string(data, len));
+}
+
+void RequestData::writeChunk(std::string &&data)
+{
+    // 长度为0的块表示响应结束，由endChunked发送
+    if (data.empty() || isError)
+        return;
+    if (chunked_output)
+    {
+        char size_line[32];
+        int n = snprintf(size_line, sizeof(size_line), "%lx\r\n", (unsigned long)data.size());
+        outQueue.append(size_line, n);
+        outQueue.append(std::move(data));
+        outQueue.append("\r\n", 2);
+    }
+    else
+        outQueue.append(std::move(data));
+    // epoll后端积压超过高水位时先发出一部分，客户端不必等整个响应生成完才收到第一个字节
+    // io_uring后端的输出由事件循环统一提交，只能先放在队列中
+    if (loop != NULL && outQueue.size() >= OUTPUT_HIGH_WATER_MARK)
+        handleWrite();
+}
+
+void RequestData::endChunked()
+{
+    if (chunked_output)
+        outQueue.append("0\r\n\r\n", 5);
+    chunked_output = false;
+}
+
+// 按名称查找请求头，不区分大小写，同名的请求头取最后一个
+const HeaderSpan *RequestData::findHeader(const char *name) const
+{
+    size_t len = strlen(name);
+    for (int i = request.header_count - 1; i >= 0; --i)
+    {
+        const StrSpan &key = request.headers[i].key;
+        if (key.len == len && strncasecmp(inBuffer.data() + key.off, name, len) == 0)
+            return &request.headers[i];
+    }
+    return NULL;
+}
+
+// span的内容是否等于str(区分大小写)
+bool RequestData::spanEquals(const StrSpan &span, const char *str) const
+{
+    size_t len = strlen(str);
+    return span.len == len && memcmp(inBuffer.data() + span.off, str, len) == 0;
+}
+
+std::string RequestData::spanString(const StrSpan &span) const
+{
+    return std::string(inBuffer, span.off, span.len);
 }
 
 // HTTP响应
@@ -610,149 +1029,675 @@ int RequestData::analysisRequest()
     // \r\n(响应头信息后面还有一个单独的'\r\n'不能省略)
     // <!DOCTYPE html><html lang=“en”> …</html>  // 响应给客户端的数据
     
-    if (method == METHOD_POST)
+    // 按请求方式和路径(不含查询串)查找路由，由注册的处理函数生成响应
+    const char *target = inBuffer.data() + request.target.off;
+    const char *query = (const char *)memchr(target, '?', request.target.len);
+    RouteMatch route;
+    int ret = Router::match(method, target, query ? query - target : request.target.len, route);
+    if (ret == ROUTE_METHOD_NOT_ALLOWED)
     {
-        // get inBuffer
-        std::string header;
-        header += std::string("HTTP/1.1 200 OK\r\n");
-        // 如果收到的 Connection: keep-alive
-        // 浏览器发送的HTTP报文默认是keep-alive，所以可能会省略Connection: keep-alive，所以构造函数默认keep-alive为true
-        if (headers.find("Connection") != headers.end())
+        // 405响应必须用Allow列出该路径接受的请求方式
+        std::string allow;
+        for (int m = 1; m < ROUTE_METHOD_NUM; ++m)
         {
-            if (headers["Connection"] == "keep-alive")
-            {
-                header += "Connection: keep-alive\r\n";
-                header += "Keep-Alive: timeout=" + to_string(5 * 60 * 1000) + "\r\n";
-            }
-            else
-            {
-                keep_alive = false;
-                header += "Connection: close\r\n";
-            }
+            if (!(route.allowed & (1u << m)))
+                continue;
+            if (!allow.empty())
+                allow += ", ";
+            allow += Router::methodName(m);
+        }
+        handleError(405, "Method Not Allowed", "Allow: " + allow + "\r\n");
+        return ANALYSIS_ERROR;
+    }
+    if (ret != ROUTE_FOUND)
+    {
+        handleError(404, "Not Found!");
+        return ANALYSIS_ERROR;
+    }
+    return route.handler(*this, route);
+}
+
+// 登录：表单中的用户名、密码与数据库中的比较
+int RequestData::serveLogin()
+{
+    /*std::string send_content = "I have receiced this.";
+    header += "Content-Length:" + to_string(send_content.size()) + "\r\n\r\n";
+    outBuffer += header + send_content;
+    cout << "content size ==" << content.size() << endl;
+    保存发送方数据到vector
+    vector<char> data(content.begin(), content.end());
+    // opencv函数：将vector中内容读到Mat矩阵中
+    Mat test = imdecode(data, CV_LOAD_IMAGE_ANYDEPTH | CV_LOAD_IMAGE_ANYCOLOR);
+    // 保存到指定的文件receive.bmp
+    imwrite("receive.bmp", test);*/
+
+    // Content-Type: application/x-www-form-urlencoded 参数通过"&"拼接
+    // Content-Type: multipart/form-data 参数通过----拼接，已在接收请求体时由MultipartParser解析
+    // 将post请求数据保存到数据库
+    // url编码的表单只在请求体留在内存中且不超过LOGIN_FORM_MAX_SIZE时处理，写入临时文件的大请求体不再整个读回内存
+    if (!multipart && (!body.inMemory() || body.size() > LOGIN_FORM_MAX_SIZE))
+    {
+        handleError(413, "Payload Too Large");
+        return ANALYSIS_ERROR;
+    }
+    // 创建数据库连接池
+    shared_ptr<MysqlConn> conn = ConnectionPool::getConnection();
+    // 创建事务
+    conn->transaction();
+    // 获取键值
+    std::string username, password;
+    bool has_form = false;
+    if (multipart)
+    {
+        const MultipartPart *user = multipart->find("username");
+        const MultipartPart *pass = multipart->find("password");
+        if (user != NULL && pass != NULL && !user->is_file && !pass->is_file)
+        {
+            username = multipart->spanString(user->value);
+            password = multipart->spanString(pass->value);
+            has_form = true;
         }
-        header += std::string("Content-Type: application/json; charset=UTF-8\r\n");
-        /*std::string send_content = "I have receiced this.";
-        header += "Content-Length:" + to_string(send_content.size()) + "\r\n\r\n";
-        outBuffer += header + send_content;
-        cout << "content size ==" << content.size() << endl;
-        保存发送方数据到vector
-        vector<char> data(content.begin(), content.end());
-        // opencv函数：将vector中内容读到Mat矩阵中
-        Mat test = imdecode(data, CV_LOAD_IMAGE_ANYDEPTH | CV_LOAD_IMAGE_ANYCOLOR);
-        // 保存到指定的文件receive.bmp
-        imwrite("receive.bmp", test);*/
-
-        // Content-Type: application/x-www-form-urlencoded 参数通过"&"拼接
-        // Content-Type: multipart/form-data 参数通过----拼接
-        // 将post请求数据保存到数据库
-        // 创建数据库连接池
-        shared_ptr<MysqlConn> conn = ConnectionPool::getConnection();
-        // 创建事务
-        conn->transaction();
-        // 获取键值
-        int index = inBuffer.find("&", 0);
-        std::string responseBody = "";
+    }
+    else
+    {
+        const std::string &content = body.memory();
+        int index = content.find("&", 0);
         if (index >= 0)
         {
-            std::string usernameStr = inBuffer.substr(0, index);
-            std::string username = usernameStr.substr(usernameStr.find('=') + 1);
-            std::string passwordStr = inBuffer.substr(index + 1);
-            std::string password = passwordStr.substr(passwordStr.find('=') + 1);
-            std::string querySql = "select * from user;";
-            if (conn->query(querySql))
+            std::string usernameStr = content.substr(0, index);
+            username = usernameStr.substr(usernameStr.find('=') + 1);
+            std::string passwordStr = content.substr(index + 1);
+            password = passwordStr.substr(passwordStr.find('=') + 1);
+            has_form = true;
+        }
+    }
+    std::string responseBody = "";
+    if (has_form)
+    {
+        std::string querySql = "select * from user;";
+        if (conn->query(querySql))
+        {
+            conn->commit();
+            if (conn->getRes())
             {
-                conn->commit();
-                if (conn->getRes())
+                // 用户名密码不正确或不存在，返回错误响应
+                if (conn->getValue(1) != username || conn->getValue(2) != password)
                 {
-                    // 用户名密码不正确或不存在，返回错误响应
-                    if (conn->getValue(1) != username || conn->getValue(2) != password)
-                    {
-                        // 创建响应体
-                        responseBody = "{\"success\": false, \"message\": \"Login error\"}";
-                        header += "Content-Length: " + std::to_string(responseBody.size()) + "\r\n";
-                    }
-                    else
-                    {
-                        // 创建响应体
-                        responseBody = "{\"success\": true, \"message\": \"Login successful\"}";
-                        header += "Content-Length: " + std::to_string(responseBody.size()) + "\r\n";
-                    }
+                    // 创建响应体
+                    responseBody = "{\"success\": false, \"message\": \"Login error\"}";
+                }
+                else
+                {
+                    // 创建响应体
+                    responseBody = "{\"success\": true, \"message\": \"Login successful\"}";
                 }
-            }
-            else
-            {
-                conn->rollback();
             }
         }
-        header += "\r\n";
-        outBuffer += header + responseBody;
-        int length = stoi(headers["Content-Length"]);
-        inBuffer = inBuffer.substr(length);
+        else
+        {
+            conn->rollback();
+        }
+    }
+    sendResponse("200 OK", "application/json; charset=UTF-8", std::move(responseBody));
+    return ANALYSIS_SUCCESS;
+}
+
+// 静态文件：file_name对应的文件
+int RequestData::serveStatic()
+{
+    int conn_header = parseConnection();
+    // 规范化后的路径作为两级缓存的键，"/a//b"与"/a/./b"命中同一项
+    if (!OpenFileCache::isNormalized(file_name))
+        file_name = OpenFileCache::normalizePath(file_name);
+    // 缓存版本要在打开文件之前取得，读文件期间文件被修改时不会把旧内容放入缓存
+    unsigned long cache_version = StaticCache::getVersion();
+    // 缓存命中时直接使用预先生成的响应头和文件内容，不访问文件系统
+    StaticCache::SP_Entry entry = StaticCache::get(file_name);
+    OpenFileCache::SP_Info info;
+    std::string content_header, validator_header;
+    if (!entry)
+    {
+        // 打开文件缓存有效期内不调用stat/open，不存在的文件同样被缓存
+        // 被监视目录中有文件变化时缓存版本改变，打开文件缓存随之重新校验
+        info = OpenFileCache::get(file_name, cache_version);
+        // 静态文件目录本身返回目录列表，其他目录与不存在的文件一样返回404
+        if (info->err == EISDIR && StaticCache::isStaticDir(file_name))
+            return serveDirectory(conn_header);
+        if (info->err != 0)
+        {
+            handleError(404, "Not Found!");
+            return ANALYSIS_ERROR;
+        }
+        validator_header = validatorHeader(makeETag(info->sbuf), info->sbuf, info->mime);
+        content_header += "Content-type: " + info->mime + "; charset=UTF-8" + "\r\n";
+        content_header += "Accept-Ranges: bytes\r\n";
+        content_header += "Content-Length: " + std::to_string(info->sbuf.st_size) + "\r\n";
+        content_header += validator_header;
+        // 头部结束
+        content_header += "\r\n";
+        entry = StaticCache::put(file_name, info, content_header, validator_header, cache_version);
+    }
+    const struct stat &sbuf = entry ? entry->sbuf : info->sbuf;
+    const std::string &mime = entry ? entry->mime : info->mime;
+    // 内容协商：客户端接受压缩时发送预压缩文件或缓存的压缩结果，范围请求总是针对原文件
+    if (CompressCache::compressible(mime) && findHeader("Range") == NULL)
+    {
+        int encoding = parseAcceptEncoding();
+        CompressCache::SP_Variant variant;
+        const VariantSlot *slot = NULL;
+        // 缓存项中记录了各编码的压缩表示和响应头，只在第一次请求时查找；槽与缓存项共用引用计数
+        if (encoding != ENCODING_IDENTITY && entry)
+        {
+            slot = &entry->variants[encoding];
+            variant = CompressCache::get(file_name, sbuf, encoding, entry->body,
+                                         std::shared_ptr<VariantSlot>(entry, &entry->variants[encoding]), cache_version);
+        }
+        else if (encoding != ENCODING_IDENTITY)
+            variant = CompressCache::get(file_name, sbuf, encoding, SP_Buffer(), info->file, cache_version);
+        if (variant)
+        {
+            handleVariant(conn_header, variant, sbuf, mime, slot);
+            return ANALYSIS_SUCCESS;
+        }
+    }
+    // 条件请求命中时只发送响应头，不发送文件内容；缓存命中时使用缓存项中生成好的ETag
+    std::string etag = entry ? std::string() : makeETag(sbuf);
+    if (notModified(entry ? entry->etag : etag, sbuf))
+    {
+        if (entry)
+            outQueue.append(entry->not_modified[conn_header]);
+        else
+            outQueue.append("HTTP/1.1 304 Not Modified\r\n" + connectionHeader(conn_header) + validator_header + "\r\n");
         return ANALYSIS_SUCCESS;
     }
-    else if (method == METHOD_GET)
+    // 范围请求只把请求的区间放入输出队列，不读取其余部分
+    std::vector<std::pair<off_t, off_t>> ranges;
+    int range_state = parseRange(sbuf, ranges);
+    if (range_state != RANGE_NONE)
     {
-        std::string header;
-        header += std::string("HTTP/1.1 200 OK\r\n");
-        // 如果收到的 Connection: keep-alive
-        // 浏览器发送的HTTP报文默认是keep-alive，所以可能会省略Connection: keep-alive，所以构造函数默认keep-alive为true
-        if (headers.find("Connection") != headers.end())
+        if (entry)
+            handleRange(conn_header, range_state, ranges, entry->sbuf, entry->mime, entry->body, SP_File());
+        else
+            handleRange(conn_header, range_state, ranges, info->sbuf, info->mime, SP_Buffer(), info->file);
+        return ANALYSIS_SUCCESS;
+    }
+    if (entry)
+    {
+        outQueue.append(entry->headers[conn_header]);
+        outQueue.append(entry->body);
+    }
+    else
+    {
+        // 大文件或不可缓存的文件：响应体只记录文件区间，发送时由sendfile从页缓存直接发出
+        // 文件随最后一个引用(打开文件缓存或正在发送的响应)一起关闭
+        outQueue.append("HTTP/1.1 200 OK\r\n" + connectionHeader(conn_header) + content_header);
+        outQueue.append(info->file, 0, info->sbuf.st_size);
+    }
+    return ANALYSIS_SUCCESS;
+}
+
+// 文件名中的HTML特殊字符转义后才能放入页面
+static std::string htmlEscape(const std::string &str)
+{
+    std::string result;
+    for (size_t i = 0; i < str.size(); ++i)
+    {
+        switch (str[i])
         {
-            if (headers["Connection"] == "keep-alive")
-            {
-                header += "Connection: keep-alive\r\n";
-                header += "Keep-Alive: timeout=" + to_string(5 * 60 * 1000) + "\r\n";
-            }
-            else
+        case '&':
+            result += "&amp;";
+            break;
+        case '<':
+            result += "&lt;";
+            break;
+        case '>':
+            result += "&gt;";
+            break;
+        case '"':
+            result += "&quot;";
+            break;
+        default:
+            result += str[i];
+        }
+    }
+    return result;
+}
+
+// 目录列表：边读目录边生成页面，总长度事先未知，用分块传输编码发送
+// 目录项很多时writeChunk在积压超过高水位后先发出一部分，不必等整个页面生成完
+int RequestData::serveDirectory(int conn_header)
+{
+    DIR *dir = opendir(file_name.c_str());
+    if (dir == NULL)
+    {
+        handleError(404, "Not Found!");
+        return ANALYSIS_ERROR;
+    }
+    std::string base = htmlEscape(file_name);
+    if (base.back() != '/')
+        base += '/';
+    beginChunked(conn_header, "200 OK", "Content-type: text/html; charset=UTF-8\r\nCache-Control: no-cache\r\n");
+    std::string page = "<html><head><title>Index of " + base + "</title></head>";
+    page += "<body bgcolor=\"ffffff\"><h1>Index of " + base + "</h1><hr><pre>\n";
+    struct dirent *ent;
+    while (!isError && (ent = readdir(dir)) != NULL)
+    {
+        if (strcmp(ent->d_name, ".") == 0)
+            continue;
+        std::string name = htmlEscape(ent->d_name);
+        if (ent->d_type == DT_DIR)
+            name += '/';
+        page += "<a href=\"" + base + name + "\">" + name + "</a>\n";
+        if (page.size() >= DIRECTORY_CHUNK_SIZE)
+        {
+            writeChunk(std::move(page));
+            page.clear();
+        }
+    }
+    closedir(dir);
+    page += "</pre><hr><em> WH's Web Server</em>\n</body></html>";
+    writeChunk(std::move(page));
+    endChunked();
+    return ANALYSIS_SUCCESS;
+}
+
+void RequestData::sendResponse(const std::string &status, const std::string &content_type, std::string &&content)
+{
+    std::string header = "HTTP/1.1 " + status + "\r\n";
+    header += connectionHeader(parseConnection());
+    header += "Content-Type: " + content_type + "\r\n";
+    header += "Content-Length: " + std::to_string(content.size()) + "\r\n\r\n";
+    outQueue.append(std::move(header));
+    outQueue.append(std::move(content));
+}
+
+// 参数的位置相对于请求目标的开头
+std::string RequestData::routeParam(const RouteMatch &match, const char *name) const
+{
+    for (int i = 0; i < match.param_count; ++i)
+    {
+        if (strcmp(match.names[i], name) == 0)
+            return inBuffer.substr(request.target.off + match.values[i].off, match.values[i].len);
+    }
+    return std::string();
+}
+
+// 根据请求的Connection头决定是否保持连接，返回响应中Connection头的形式
+// 浏览器发送的HTTP报文默认是keep-alive，所以可能会省略Connection: keep-alive，所以构造函数默认keep-alive为true
+int RequestData::parseConnection()
+{
+    const HeaderSpan *header = findHeader("Connection");
+    if (header == NULL)
+        return CONN_HEADER_NONE;
+    if (header->value.len == 10 && strncasecmp(inBuffer.data() + header->value.off, "keep-alive", 10) == 0)
+        return CONN_HEADER_KEEP_ALIVE;
+    keep_alive = false;
+    return CONN_HEADER_CLOSE;
+}
+
+std::string RequestData::connectionHeader(int conn_header)
+{
+    if (conn_header == CONN_HEADER_KEEP_ALIVE)
+        return "Connection: keep-alive\r\nKeep-Alive: timeout=" + to_string(5 * 60 * 1000) + "\r\n";
+    if (conn_header == CONN_HEADER_CLOSE)
+        return "Connection: close\r\n";
+    return "";
+}
+
+std::string RequestData::httpDate(time_t t)
+{
+    struct tm tm;
+    char buf[64];
+    gmtime_r(&t, &tm);
+    strftime(buf, sizeof(buf), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    return buf;
+}
+
+std::string RequestData::makeETag(const struct stat &sbuf, bool weak)
+{
+    char buf[80];
+    snprintf(buf, sizeof(buf), "%s\"%lx-%lx-%lx\"", weak ? "W/" : "", (unsigned long)sbuf.st_ino,
+             (unsigned long)sbuf.st_size, (unsigned long)sbuf.st_mtime);
+    return buf;
+}
+
+// 各类MIME的缓存策略，按前缀匹配，靠前的优先
+static const struct
+{
+    const char *mime_prefix;
+    const char *policy;
+} CACHE_POLICIES[] = {
+    {"text/html", "no-cache"}, // 页面每次都向服务器校验，配合304只传响应头
+    {"text/css", "public, max-age=86400"},
+    {"text/javascript", "public, max-age=86400"},
+    {"image/", "public, max-age=604800"},
+    {"audio/", "public, max-age=604800"},
+    {"video/", "public, max-age=604800"},
+};
+// 文件名中带版本号的样式表和脚本(如jquery-3.1.0.min.js)内容永不改变，浏览器不必再来校验
+static const char *IMMUTABLE_POLICY = "public, max-age=31536000, immutable";
+
+// 文件名中是否带有"-数字.数字"形式的版本号
+static bool isVersionedName(const std::string &path)
+{
+    size_t base = path.rfind('/');
+    base = (base == std::string::npos) ? 0 : base + 1;
+    for (size_t i = path.find('-', base); i != std::string::npos; i = path.find('-', i + 1))
+    {
+        size_t j = i + 1;
+        while (j < path.size() && isdigit((unsigned char)path[j]))
+            ++j;
+        if (j > i + 1 && j + 1 < path.size() && path[j] == '.' && isdigit((unsigned char)path[j + 1]))
+            return true;
+    }
+    return false;
+}
+
+std::string RequestData::cacheControl(const std::string &mime, const std::string &path)
+{
+    if ((mime == "text/css" || mime == "text/javascript") && isVersionedName(path))
+        return IMMUTABLE_POLICY;
+    for (size_t i = 0; i < sizeof(CACHE_POLICIES) / sizeof(CACHE_POLICIES[0]); ++i)
+    {
+        if (mime.compare(0, strlen(CACHE_POLICIES[i].mime_prefix), CACHE_POLICIES[i].mime_prefix) == 0)
+            return CACHE_POLICIES[i].policy;
+    }
+    return "no-cache";
+}
+
+// 200、206、304响应共用的校验信息与缓存策略头，etag为所发送的表示(原文件或压缩表示)的ETag
+// 可压缩的类型按Accept-Encoding发送不同的表示，需要Vary告诉中间缓存分别保存
+std::string RequestData::validatorHeader(const std::string &etag, const struct stat &sbuf, const std::string &mime)
+{
+    std::string header;
+    header += "ETag: " + etag + "\r\n";
+    header += "Last-Modified: " + httpDate(sbuf.st_mtime) + "\r\n";
+    header += "Cache-Control: " + cacheControl(mime, file_name) + "\r\n";
+    if (CompressCache::compressible(mime))
+        header += "Vary: Accept-Encoding\r\n";
+    return header;
+}
+
+// 按Accept-Encoding选择压缩编码，q值相同时优先br(压缩率更高)，q=0表示不接受
+int RequestData::parseAcceptEncoding()
+{
+    const HeaderSpan *header = findHeader("Accept-Encoding");
+    if (header == NULL)
+        return ENCODING_IDENTITY;
+    // 直接在接收缓冲区上逐项解析，不复制请求头
+    const char *pos = inBuffer.data() + header->value.off;
+    const char *end = pos + header->value.len;
+    double q_gzip = -1, q_br = -1, q_any = -1;
+    while (pos < end)
+    {
+        const char *item_end = (const char *)memchr(pos, ',', end - pos);
+        if (item_end == NULL)
+            item_end = end;
+        const char *semi = (const char *)memchr(pos, ';', item_end - pos);
+        const char *coding = pos;
+        const char *coding_end = semi ? semi : item_end;
+        pos = item_end + 1;
+        while (coding < coding_end && (*coding == ' ' || *coding == '\t'))
+            ++coding;
+        while (coding_end > coding && (coding_end[-1] == ' ' || coding_end[-1] == '\t'))
+            --coding_end;
+        size_t len = coding_end - coding;
+        if (len == 0)
+            continue;
+        double q = 1;
+        for (const char *p = semi; p != NULL && p + 1 < item_end; ++p)
+        {
+            if (p[0] == 'q' && p[1] == '=')
             {
-                keep_alive = false;
-                header += "Connection: close\r\n";
+                q = strtod(p + 2, NULL);
+                break;
             }
         }
-        int dot_pos = file_name.find('.');
-        std::string filetype;
-        if (dot_pos < 0)
-            filetype = MimeType::getMime("default");
-        else
-            filetype = MimeType::getMime(file_name.substr(dot_pos));
-        // 此结构体描述文件的信息
-        struct stat sbuf;
-        // stat函数获取文件信息保存到sbuf中
-        if (stat(file_name.c_str(), &sbuf) < 0)
-        {
-            header.clear();
-            handleError(fd, 404, "Not Found!");
-            return ANALYSIS_ERROR;
-        }
+        if (len == 2 && strncasecmp(coding, "br", 2) == 0)
+            q_br = q;
+        else if ((len == 4 && strncasecmp(coding, "gzip", 4) == 0) || (len == 6 && strncasecmp(coding, "x-gzip", 6) == 0))
+            q_gzip = q;
+        else if (len == 1 && *coding == '*')
+            q_any = q;
+    }
+    // 没有单独列出的编码使用"*"的q值
+    if (q_br < 0)
+        q_br = q_any;
+    if (q_gzip < 0)
+        q_gzip = q_any;
+    if (q_br > 0 && q_br >= q_gzip)
+        return ENCODING_BR;
+    if (q_gzip > 0)
+        return ENCODING_GZIP;
+    return ENCODING_IDENTITY;
+}
 
-        header += "Content-type: " + filetype + "; charset=UTF-8" + "\r\n";
-        header += "Content-Length: " + std::to_string(sbuf.st_size) + "\r\n";
-        // 头部结束
+// 发送压缩表示：条件请求按压缩表示自己的ETag判断，响应体是缓存的压缩结果或预压缩文件
+void RequestData::handleVariant(int conn_header, const std::shared_ptr<const CompressedVariant> &variant,
+                                const struct stat &sbuf, const std::string &mime, const VariantSlot *slot)
+{
+    bool not_modified = notModified(variant->etag, sbuf);
+    if (slot != NULL)
+    {
+        // 静态文件缓存项的槽中有预先生成的响应头
+        outQueue.append(not_modified ? slot->not_modified[conn_header] : slot->headers[conn_header]);
+        if (not_modified)
+            return;
+    }
+    else if (not_modified)
+    {
+        std::string header;
+        header += "HTTP/1.1 304 Not Modified\r\n" + connectionHeader(conn_header);
+        header += validatorHeader(variant->etag, sbuf, mime) + "\r\n";
+        outQueue.append(std::move(header));
+        return;
+    }
+    else
+    {
+        std::string header;
+        header += "HTTP/1.1 200 OK\r\n" + connectionHeader(conn_header);
+        header += "Content-type: " + mime + "; charset=UTF-8" + "\r\n";
+        header += std::string("Content-Encoding: ") + CompressCache::encodingName(variant->encoding) + "\r\n";
+        header += "Content-Length: " + std::to_string(variant->size) + "\r\n";
+        header += validatorHeader(variant->etag, sbuf, mime);
         header += "\r\n";
-        outBuffer += header;
-        // 打开文件，O_RDONLY只读打开
-        int src_fd = open(file_name.c_str(), O_RDONLY, 0);
-        // mmap函数类似于read与write，只不过减少了用户态到核心态的拷贝，直接映射到核心态
-        // 映射区域起始地址NULL(自动分配)；大小(一般为4KB整数倍)；映射区域自己权限(PROT_READ)可读权限;
-        // 映射标志位(MAP_PRIVATE)对映射区的写入操作只反映到缓存区中不会真正写入到文件；文件描述符；偏移量
-        // 返回映射起始地址
-        char *src_addr = static_cast<char *>(mmap(NULL, sbuf.st_size, PROT_READ, MAP_PRIVATE, src_fd, 0));
-        close(src_fd);
-
-        outBuffer += src_addr;
-        // 删除映射
-        munmap(src_addr, sbuf.st_size);
-        return ANALYSIS_SUCCESS;
+        outQueue.append(std::move(header));
     }
+    if (variant->body)
+        outQueue.append(variant->body);
     else
-        return ANALYSIS_ERROR;
+        outQueue.append(variant->file, 0, variant->size);
 }
 
-// 处理文件GET：URI请求错误
-void RequestData::handleError(int fd, int err_num, std::string short_msg)
+// 条件请求：If-None-Match中有与etag匹配的ETag(弱比较)，或没有If-None-Match且文件在If-Modified-Since之后未修改
+bool RequestData::notModified(const std::string &etag, const struct stat &sbuf)
+{
+    const HeaderSpan *header = findHeader("If-None-Match");
+    if (header != NULL)
+    {
+        std::string list = spanString(header->value);
+        // 弱比较：去掉W/前缀后比较引号内的值
+        size_t pos = 0;
+        while (pos < list.size())
+        {
+            size_t end = list.find(',', pos);
+            if (end == std::string::npos)
+                end = list.size();
+            size_t begin = list.find_first_not_of(" \t", pos);
+            pos = end + 1;
+            if (begin == std::string::npos || begin >= end)
+                continue;
+            size_t last = list.find_last_not_of(" \t", end - 1);
+            std::string tag = list.substr(begin, last - begin + 1);
+            if (tag == "*")
+                return true;
+            if (tag.compare(0, 2, "W/") == 0)
+                tag = tag.substr(2);
+            if (tag == etag)
+                return true;
+        }
+        return false;
+    }
+    header = findHeader("If-Modified-Since");
+    if (header == NULL)
+        return false;
+    // 浏览器一般原样带回Last-Modified，先按字符串比较
+    std::string since = spanString(header->value);
+    if (since == httpDate(sbuf.st_mtime))
+        return true;
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    const char *end = strptime(since.c_str(), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    if (end == NULL || *end != '\0')
+        return false;
+    return sbuf.st_mtime <= timegm(&tm);
+}
+
+// 解析Range头，可满足的区间[first, last]按请求顺序放入ranges
+// 单位不是bytes、格式错误、区间过多或If-Range与当前文件不匹配时返回RANGE_NONE，按普通请求处理
+int RequestData::parseRange(const struct stat &sbuf, std::vector<std::pair<off_t, off_t>> &ranges)
+{
+    const HeaderSpan *range = findHeader("Range");
+    if (range == NULL)
+        return RANGE_NONE;
+    // If-Range不匹配说明客户端已有的部分内容已经过期，返回完整内容
+    const HeaderSpan *if_range = findHeader("If-Range");
+    if (if_range != NULL)
+    {
+        std::string validator = spanString(if_range->value);
+        // ETag只做强比较，弱ETag(W/前缀)永远不匹配
+        if (validator[0] == '"' || validator.compare(0, 2, "W/") == 0)
+        {
+            if (validator != makeETag(sbuf))
+                return RANGE_NONE;
+        }
+        else if (validator != httpDate(sbuf.st_mtime))
+            return RANGE_NONE;
+    }
+    std::string spec = spanString(range->value);
+    if (strncasecmp(spec.c_str(), "bytes=", 6) != 0)
+        return RANGE_NONE;
+    off_t size = sbuf.st_size;
+    int count = 0;
+    size_t pos = 6;
+    while (pos <= spec.size())
+    {
+        size_t end = spec.find(',', pos);
+        if (end == std::string::npos)
+            end = spec.size();
+        size_t begin = spec.find_first_not_of(" \t", pos);
+        pos = end + 1;
+        // 允许空元素，如"bytes=0-1,,5-6"
+        if (begin == std::string::npos || begin >= end)
+            continue;
+        size_t last_char = spec.find_last_not_of(" \t", end - 1);
+        std::string item = spec.substr(begin, last_char - begin + 1);
+        if (++count > MAX_RANGES)
+            return RANGE_NONE;
+        size_t dash = item.find('-');
+        if (dash == std::string::npos)
+            return RANGE_NONE;
+        std::string first_str = item.substr(0, dash);
+        std::string last_str = item.substr(dash + 1);
+        // 只接受十进制数字，长度限制保证不会溢出
+        if ((first_str.empty() && last_str.empty()) || first_str.size() > 18 || last_str.size() > 18 ||
+            first_str.find_first_not_of("0123456789") != std::string::npos ||
+            last_str.find_first_not_of("0123456789") != std::string::npos)
+            return RANGE_NONE;
+        off_t first, last;
+        if (first_str.empty())
+        {
+            // 后缀区间"-N"：最后N个字节
+            off_t suffix = strtoll(last_str.c_str(), NULL, 10);
+            if (suffix == 0 || size == 0)
+                continue;
+            first = suffix >= size ? 0 : size - suffix;
+            last = size - 1;
+        }
+        else
+        {
+            first = strtoll(first_str.c_str(), NULL, 10);
+            last = last_str.empty() ? size - 1 : strtoll(last_str.c_str(), NULL, 10);
+            if (last < first && !last_str.empty())
+                return RANGE_NONE;
+            if (first >= size)
+                continue;
+            if (last >= size)
+                last = size - 1;
+        }
+        ranges.push_back(std::make_pair(first, last));
+    }
+    if (count == 0)
+        return RANGE_NONE;
+    return ranges.empty() ? RANGE_UNSATISFIABLE : RANGE_OK;
+}
+
+// 生成206/416响应，响应体直接引用缓存的内容(body)或文件(file)中的区间
+// 多个区间时使用multipart/byteranges，每个区间前有分隔行和自己的Content-Type、Content-Range
+void RequestData::handleRange(int conn_header, int range_state, const std::vector<std::pair<off_t, off_t>> &ranges,
+                              const struct stat &sbuf, const std::string &mime, const SP_Buffer &body, const SP_File &file)
+{
+    std::string size_str = std::to_string(sbuf.st_size);
+    std::string header;
+    if (range_state == RANGE_UNSATISFIABLE)
+    {
+        header += "HTTP/1.1 416 Range Not Satisfiable\r\n" + connectionHeader(conn_header);
+        header += "Content-Range: bytes */" + size_str + "\r\n";
+        header += "Content-Length: 0\r\n\r\n";
+        outQueue.append(std::move(header));
+        return;
+    }
+    header += "HTTP/1.1 206 Partial Content\r\n" + connectionHeader(conn_header);
+    header += "Accept-Ranges: bytes\r\n";
+    header += validatorHeader(makeETag(sbuf), sbuf, mime);
+    if (ranges.size() == 1)
+    {
+        off_t first = ranges[0].first, last = ranges[0].second;
+        header += "Content-type: " + mime + "; charset=UTF-8" + "\r\n";
+        header += "Content-Range: bytes " + std::to_string(first) + "-" + std::to_string(last) + "/" + size_str + "\r\n";
+        header += "Content-Length: " + std::to_string(last - first + 1) + "\r\n\r\n";
+        outQueue.append(std::move(header));
+        if (body)
+            outQueue.append(body, first, last - first + 1);
+        else
+            outQueue.append(file, first, last - first + 1);
+        return;
+    }
+    // 分隔串取自一个递增的计数，长度固定，与文件内容冲突的可能性可以忽略
+    static std::atomic<unsigned long> boundary_seq(0);
+    char boundary[32];
+    snprintf(boundary, sizeof(boundary), "%020lu", ++boundary_seq);
+    std::vector<std::string> parts;
+    size_t content_length = 0;
+    for (size_t i = 0; i < ranges.size(); ++i)
+    {
+        std::string part;
+        part += std::string("\r\n--") + boundary + "\r\n";
+        part += "Content-type: " + mime + "; charset=UTF-8" + "\r\n";
+        part += "Content-Range: bytes " + std::to_string(ranges[i].first) + "-" + std::to_string(ranges[i].second) + "/" + size_str + "\r\n\r\n";
+        content_length += part.size() + (ranges[i].second - ranges[i].first + 1);
+        parts.push_back(part);
+    }
+    std::string tail = std::string("\r\n--") + boundary + "--\r\n";
+    content_length += tail.size();
+    header += std::string("Content-type: multipart/byteranges; boundary=") + boundary + "\r\n";
+    header += "Content-Length: " + std::to_string(content_length) + "\r\n\r\n";
+    outQueue.append(std::move(header));
+    for (size_t i = 0; i < ranges.size(); ++i)
+    {
+        outQueue.append(std::move(parts[i]));
+        if (body)
+            outQueue.append(body, ranges[i].first, ranges[i].second - ranges[i].first + 1);
+        else
+            outQueue.append(file, ranges[i].first, ranges[i].second - ranges[i].first + 1);
+    }
+    outQueue.append(std::move(tail));
+}
+
+// 生成错误响应放入输出队列，发送完后关闭连接
+void RequestData::handleError(int err_num, std::string short_msg, const std::string &extra_headers)
 {
     short_msg = " " + short_msg;
-    char send_buff[MAX_BUFF];
     std::string body_buff, header_buff;
     body_buff += "<html><title>出错了！</title>";
     body_buff += "<body bgcolor=\"ffffff\">";
@@ -762,13 +1707,43 @@ void RequestData::handleError(int fd, int err_num, std::string short_msg)
     header_buff += "HTTP/1.1 " + std::to_string(err_num) + short_msg + "\r\n";
     header_buff += "Content-type: text/html\r\n";
     header_buff += "Connection: close\r\n";
+    header_buff += extra_headers;
     header_buff += "Content-Length: " + std::to_string(body_buff.size()) + "\r\n";
     header_buff += "\r\n";
-    // 错误处理不考虑writen不完的情况
-    sprintf(send_buff, "%s", header_buff.c_str());
-    writen(fd, send_buff, strlen(send_buff));
-    sprintf(send_buff, "%s", body_buff.c_str());
-    writen(fd, send_buff, strlen(send_buff));
+    outQueue.append(std::move(header_buff));
+    outQueue.append(std::move(body_buff));
+    keep_alive = false;
+    MutexLockGuard_LOG();
+    logfile.Write("客户端(%s)请求出错:%d%s\n", IP.c_str(), err_num, short_msg.c_str());
+}
+
+void RequestData::rejectOverload()
+{
+    // 过载时不再拼接响应，也不逐条写日志，次数由ThreadPool::threadpool_report统计
+    static const char RESPONSE[] = "HTTP/1.1 503 Service Unavailable\r\n"
+                                   "Content-type: text/plain\r\n"
+                                   "Connection: close\r\n"
+                                   "Retry-After: 1\r\n"
+                                   "Content-Length: 20\r\n"
+                                   "\r\n"
+                                   "Service Unavailable\n";
+    // 正在发送响应的连接不能再插入503，直接关闭
+    if (outQueue.empty())
+    {
+        // 先读走已到达的请求，关闭有未读数据的套接字会发送RST，客户端可能收不到响应
+        char buf[4096];
+        for (int i = 0; i < 16; ++i)
+        {
+            IoStats::addSyscall();
+            if (recv(fd, buf, sizeof(buf), MSG_DONTWAIT) < (ssize_t)sizeof(buf))
+                break;
+        }
+        IoStats::addSyscall();
+        send(fd, RESPONSE, sizeof(RESPONSE) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+    }
+    isError = true;
+    keep_alive = false;
+    loop->epoll_del(fd);
 }
 
 void RequestData::enableRead()
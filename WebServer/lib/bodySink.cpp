@@ -0,0 +1,164 @@
+#include "bodySink.h"
+#include "ioStats.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+size_t BodySink::max_size = 64 * 1024 * 1024;
+size_t BodySink::memory_threshold = 64 * 1024;
+size_t BodySink::memory_budget = 16 * 1024 * 1024;
+std::string BodySink::spool_dir = "/tmp";
+std::atomic<size_t> BodySink::memory_in_use(0);
+
+BodySink::BodySink() : length(0), reserved(0), fd(-1)
+{
+}
+
+BodySink::~BodySink()
+{
+    clear();
+}
+
+void BodySink::sink_init(size_t _max_size, size_t _memory_threshold, size_t _memory_budget, const std::string &_spool_dir)
+{
+    max_size = _max_size;
+    memory_threshold = _memory_threshold;
+    memory_budget = _memory_budget;
+    spool_dir = _spool_dir;
+}
+
+size_t BodySink::maxSize()
+{
+    return max_size;
+}
+
+size_t BodySink::memoryInUse()
+{
+    return memory_in_use.load(std::memory_order_relaxed);
+}
+
+// 从全局预算中再占用len字节，超出预算时不占用，返回false
+bool BodySink::reserve(size_t len)
+{
+    size_t used = memory_in_use.fetch_add(len);
+    if (used + len > memory_budget)
+    {
+        memory_in_use.fetch_sub(len);
+        return false;
+    }
+    reserved += len;
+    return true;
+}
+
+// 创建临时文件并把内存中已有的内容写入，之后的数据都直接写文件
+int BodySink::spill()
+{
+#ifdef O_TMPFILE
+    IoStats::addSyscall();
+    fd = open(spool_dir.c_str(), O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+#endif
+    // 文件系统不支持O_TMPFILE时创建普通文件后立即删除
+    if (fd < 0)
+    {
+        std::string name = spool_dir + "/webserver-body-XXXXXX";
+        IoStats::addSyscall(2);
+        fd = mkostemp(&name[0], O_CLOEXEC);
+        if (fd < 0)
+            return -1;
+        unlink(name.c_str());
+    }
+    if (!data.empty() && writeFile(data.data(), data.size()) < 0)
+        return -1;
+    std::string().swap(data);
+    memory_in_use.fetch_sub(reserved);
+    reserved = 0;
+    return 0;
+}
+
+int BodySink::writeFile(const char *buf, size_t len)
+{
+    while (len > 0)
+    {
+        IoStats::addSyscall();
+        ssize_t n = write(fd, buf, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int BodySink::begin(size_t expected)
+{
+    clear();
+    if (expected == 0)
+        return 0;
+    // 长度已知时一次占用全部预算并分配好内存，之后追加不再扩容
+    if (expected <= memory_threshold && reserve(expected))
+    {
+        data.reserve(expected);
+        return 0;
+    }
+    return spill();
+}
+
+int BodySink::append(const char *buf, size_t len)
+{
+    if (fd < 0)
+    {
+        size_t need = length + len > reserved ? length + len - reserved : 0;
+        if (length + len <= memory_threshold && (need == 0 || reserve(need)))
+        {
+            data.append(buf, len);
+            length += len;
+            return 0;
+        }
+        if (spill() < 0)
+            return -1;
+    }
+    if (writeFile(buf, len) < 0)
+        return -1;
+    length += len;
+    return 0;
+}
+
+void BodySink::clear()
+{
+    if (reserved > 0)
+    {
+        memory_in_use.fetch_sub(reserved);
+        reserved = 0;
+    }
+    if (fd >= 0)
+    {
+        IoStats::addSyscall();
+        close(fd);
+        fd = -1;
+    }
+    std::string().swap(data);
+    length = 0;
+}
+
+size_t BodySink::size() const
+{
+    return length;
+}
+
+bool BodySink::inMemory() const
+{
+    return fd < 0;
+}
+
+const std::string &BodySink::memory() const
+{
+    return data;
+}
+
+int BodySink::fileFd() const
+{
+    return fd;
+}
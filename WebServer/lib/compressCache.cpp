@@ -0,0 +1,301 @@
+#include "compressCache.h"
+#include "HttpRequestData.h"
+#include "openFileCache.h"
+#include "ioStats.h"
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+#include <brotli/encode.h>
+
+MutexLock CompressCache::lock;
+CompressCache::VariantList CompressCache::lru;
+std::unordered_map<std::string, CompressCache::VariantList::iterator> CompressCache::index;
+std::unordered_set<std::string> CompressCache::pending;
+size_t CompressCache::bytes = 0;
+std::deque<CompressCache::Job> CompressCache::jobs;
+pthread_mutex_t CompressCache::job_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t CompressCache::job_cond = PTHREAD_COND_INITIALIZER;
+bool CompressCache::started = false;
+
+// 可压缩的MIME类型，按前缀匹配
+static const char *COMPRESSIBLE_TYPES[] = {
+    "text/",
+    "application/javascript",
+    "application/json",
+    "application/xml",
+    "image/svg+xml",
+};
+
+int CompressCache::cache_init()
+{
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, compress_thread, NULL) != 0)
+        return -1;
+    pthread_detach(tid);
+    started = true;
+    return 0;
+}
+
+const char *CompressCache::encodingName(int encoding)
+{
+    if (encoding == ENCODING_GZIP)
+        return "gzip";
+    if (encoding == ENCODING_BR)
+        return "br";
+    return "identity";
+}
+
+bool CompressCache::compressible(const std::string &mime)
+{
+    for (size_t i = 0; i < sizeof(COMPRESSIBLE_TYPES) / sizeof(COMPRESSIBLE_TYPES[0]); ++i)
+    {
+        if (mime.compare(0, strlen(COMPRESSIBLE_TYPES[i]), COMPRESSIBLE_TYPES[i]) == 0)
+            return true;
+    }
+    return false;
+}
+
+std::string CompressCache::makeKey(const struct stat &sbuf, int encoding)
+{
+    char buf[128];
+    snprintf(buf, sizeof(buf), "%lx:%lx:%lx:%lx.%lx:%d", (unsigned long)sbuf.st_dev, (unsigned long)sbuf.st_ino,
+             (unsigned long)sbuf.st_size, (unsigned long)sbuf.st_mtim.tv_sec, (unsigned long)sbuf.st_mtim.tv_nsec,
+             encoding);
+    return buf;
+}
+
+// 预压缩文件：path.br或path.gz，比原文件旧时说明原文件修改后没有重新生成，不使用
+CompressCache::SP_Variant CompressCache::findSidecar(const std::string &path, const struct stat &sbuf, int encoding,
+                                                     unsigned long version)
+{
+    OpenFileCache::SP_Info info = OpenFileCache::get(path + (encoding == ENCODING_BR ? ".br" : ".gz"), version);
+    if (info->err != 0 || info->sbuf.st_mtime < sbuf.st_mtime)
+        return SP_Variant();
+    std::shared_ptr<CompressedVariant> variant(new CompressedVariant());
+    variant->encoding = encoding;
+    variant->file = info->file;
+    variant->size = info->sbuf.st_size;
+    variant->etag = RequestData::makeETag(info->sbuf);
+    return variant;
+}
+
+SP_Buffer CompressCache::compress(const std::string &data, int encoding)
+{
+    std::string out;
+    if (encoding == ENCODING_GZIP)
+    {
+        z_stream zs;
+        memset(&zs, 0, sizeof(zs));
+        // windowBits加16生成gzip格式而不是zlib格式
+        if (deflateInit2(&zs, COMPRESS_GZIP_LEVEL, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY) != Z_OK)
+            return SP_Buffer();
+        out.resize(deflateBound(&zs, data.size()));
+        zs.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data.data()));
+        zs.avail_in = data.size();
+        zs.next_out = reinterpret_cast<Bytef *>(&out[0]);
+        zs.avail_out = out.size();
+        int ret = deflate(&zs, Z_FINISH);
+        size_t total = zs.total_out;
+        deflateEnd(&zs);
+        if (ret != Z_STREAM_END)
+            return SP_Buffer();
+        out.resize(total);
+    }
+    else if (encoding == ENCODING_BR)
+    {
+        size_t total = BrotliEncoderMaxCompressedSize(data.size());
+        if (total == 0)
+            return SP_Buffer();
+        out.resize(total);
+        if (!BrotliEncoderCompress(COMPRESS_BROTLI_QUALITY, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_TEXT, data.size(),
+                                   reinterpret_cast<const uint8_t *>(data.data()), &total,
+                                   reinterpret_cast<uint8_t *>(&out[0])))
+            return SP_Buffer();
+        out.resize(total);
+    }
+    else
+        return SP_Buffer();
+    std::shared_ptr<std::string> buf(new std::string());
+    buf->swap(out);
+    return buf;
+}
+
+void CompressCache::insert(const std::string &key, const SP_Variant &variant)
+{
+    MutexLockGuard guard(lock);
+    pending.erase(key);
+    if (index.find(key) != index.end())
+        return;
+    lru.push_front(std::make_pair(key, variant));
+    index[key] = lru.begin();
+    bytes += key.size() + variant->size;
+    while (bytes > COMPRESS_CACHE_BUDGET && lru.size() > 1)
+    {
+        bytes -= lru.back().first.size() + lru.back().second->size;
+        index.erase(lru.back().first);
+        lru.pop_back();
+    }
+}
+
+// 记录槽的结果并生成压缩表示的响应头，之后其他线程才能看到VARIANT_READY
+void CompressCache::publish(VariantSlot &slot, const SP_Variant &variant)
+{
+    if (variant)
+    {
+        std::string content = "Content-type: " + *slot.mime + "; charset=UTF-8\r\n";
+        content += std::string("Content-Encoding: ") + encodingName(variant->encoding) + "\r\n";
+        content += "Content-Length: " + std::to_string(variant->size) + "\r\n";
+        std::string validators = "ETag: " + variant->etag + "\r\n" + *slot.validators + "\r\n";
+        for (int i = 0; i < CONN_HEADER_NUM; ++i)
+        {
+            slot.headers[i].reset(new std::string("HTTP/1.1 200 OK\r\n" + RequestData::connectionHeader(i) + content + validators));
+            slot.not_modified[i].reset(new std::string("HTTP/1.1 304 Not Modified\r\n" + RequestData::connectionHeader(i) + validators));
+        }
+    }
+    slot.variant = variant;
+    slot.state.store(VARIANT_READY, std::memory_order_release);
+}
+
+CompressCache::LookupResult CompressCache::lookup(const std::string &path, const struct stat &sbuf, int encoding,
+                                                 const SP_Buffer &body, const SP_File &file,
+                                                 const std::shared_ptr<VariantSlot> &slot, unsigned long version,
+                                                 SP_Variant &variant)
+{
+    variant = findSidecar(path, sbuf, encoding, version);
+    if (variant)
+        return LOOKUP_DONE;
+    if ((size_t)sbuf.st_size < COMPRESS_MIN_FILE || (size_t)sbuf.st_size > COMPRESS_MAX_FILE)
+        return LOOKUP_DONE;
+
+    std::string key = makeKey(sbuf, encoding);
+    {
+        MutexLockGuard guard(lock);
+        std::unordered_map<std::string, VariantList::iterator>::iterator it = index.find(key);
+        if (it != index.end())
+        {
+            lru.splice(lru.begin(), lru, it->second);
+            // 记录了压缩无收益的结果，不再尝试
+            if (it->second->second->body)
+                variant = it->second->second;
+            return LOOKUP_DONE;
+        }
+        // 没有后台线程时只使用预压缩文件
+        if (!started)
+            return LOOKUP_DONE;
+        if (pending.size() >= COMPRESS_MAX_JOBS || !pending.insert(key).second)
+            return LOOKUP_RETRY;
+    }
+
+    Job job;
+    job.key = key;
+    job.sbuf = sbuf;
+    job.encoding = encoding;
+    job.body = body;
+    job.file = file;
+    job.slot = slot;
+    pthread_mutex_lock(&job_lock);
+    jobs.push_back(job);
+    pthread_cond_signal(&job_cond);
+    pthread_mutex_unlock(&job_lock);
+    return LOOKUP_QUEUED;
+}
+
+CompressCache::SP_Variant CompressCache::get(const std::string &path, const struct stat &sbuf, int encoding,
+                                             const SP_Buffer &body, const SP_File &file, unsigned long version)
+{
+    SP_Variant variant;
+    if (encoding != ENCODING_IDENTITY)
+        lookup(path, sbuf, encoding, body, file, std::shared_ptr<VariantSlot>(), version, variant);
+    return variant;
+}
+
+CompressCache::SP_Variant CompressCache::get(const std::string &path, const struct stat &sbuf, int encoding,
+                                             const SP_Buffer &body, const std::shared_ptr<VariantSlot> &slot,
+                                             unsigned long version)
+{
+    int state = slot->state.load(std::memory_order_acquire);
+    if (state == VARIANT_READY)
+        return slot->variant;
+    // 其他请求正在查找或等待后台压缩，这期间发送原文件
+    if (state != VARIANT_UNKNOWN || !slot->state.compare_exchange_strong(state, VARIANT_PENDING))
+        return SP_Variant();
+    SP_Variant variant;
+    switch (lookup(path, sbuf, encoding, body, SP_File(), slot, version, variant))
+    {
+    case LOOKUP_DONE:
+        publish(*slot, variant);
+        return variant;
+    case LOOKUP_QUEUED:
+        // 后台线程压缩完成后填入slot
+        return SP_Variant();
+    default:
+        slot->state.store(VARIANT_UNKNOWN, std::memory_order_release);
+        return SP_Variant();
+    }
+}
+
+// 后台压缩线程：依次读入并压缩排队的文件版本，结果放入缓存
+void *CompressCache::compress_thread(void *)
+{
+    while (true)
+    {
+        pthread_mutex_lock(&job_lock);
+        while (jobs.empty())
+            pthread_cond_wait(&job_cond, &job_lock);
+        Job job = jobs.front();
+        jobs.pop_front();
+        pthread_mutex_unlock(&job_lock);
+        runJob(job);
+    }
+    return NULL;
+}
+
+void CompressCache::runJob(const Job &job)
+{
+    const std::string &key = job.key;
+    const struct stat &sbuf = job.sbuf;
+    const SP_Buffer &body = job.body;
+    int encoding = job.encoding;
+    // 静态文件缓存中有内容时直接压缩缓存的内容，否则从文件读入
+    std::string data;
+    if (!body)
+    {
+        data.resize(sbuf.st_size);
+        size_t nread = 0;
+        while (nread < data.size())
+        {
+            IoStats::addSyscall();
+            ssize_t n = pread(job.file->get(), &data[nread], data.size() - nread, nread);
+            if (n < 0 && errno == EINTR)
+                continue;
+            // 文件在读取期间被截断或出错，不缓存，之后的请求重新尝试
+            if (n <= 0)
+            {
+                MutexLockGuard guard(lock);
+                pending.erase(key);
+                if (job.slot)
+                    job.slot->state.store(VARIANT_UNKNOWN, std::memory_order_release);
+                return;
+            }
+            nread += n;
+        }
+    }
+    std::shared_ptr<CompressedVariant> variant(new CompressedVariant());
+    variant->encoding = encoding;
+    variant->size = 0;
+    const std::string &source = body ? *body : data;
+    SP_Buffer compressed = compress(source, encoding);
+    // 压缩后不比原文件小时同样缓存，body为空表示发送原文件
+    if (compressed && compressed->size() < source.size())
+    {
+        variant->body = compressed;
+        variant->size = compressed->size();
+        variant->etag = RequestData::makeETag(sbuf);
+        variant->etag.insert(variant->etag.size() - 1, encoding == ENCODING_BR ? "-br" : "-gz");
+    }
+    insert(key, variant);
+    if (job.slot)
+        publish(*job.slot, variant->body ? SP_Variant(variant) : SP_Variant());
+}
@@ -3,62 +3,111 @@
 #include "threadpool.h"
 #include "log.h"
 #include "util.h"
+#include "reactorPool.h"
+#include "ioStats.h"
+#include <sys/eventfd.h>
+#include <sys/resource.h>
 
 extern CLogFile logfile;
 
 int TIMER_TIME_OUT = 500;
 
-epoll_event *Epoll::events;
-std::unordered_map<int, std::shared_ptr<RequestData>> Epoll::fd2req;
-int Epoll::epoll_fd = 0;
 const std::string Epoll::PATH = "/";
 
-TimerManager Epoll::timer_manager;
+Epoll::Epoll() : events(NULL),
+                 epoll_fd(-1),
+                 handle_inline(false),
+                 wakeup_fd(-1)
+{
+}
+
+Epoll::~Epoll()
+{
+    if (wakeup_fd >= 0)
+        close(wakeup_fd);
+    if (epoll_fd >= 0)
+        close(epoll_fd);
+    delete[] events;
+}
+
+// epoll_event.data.u64：高32位为代数，低32位为fd
+static inline uint64_t make_event_data(int fd, unsigned int generation)
+{
+    return ((uint64_t)generation << 32) | (unsigned int)fd;
+}
 
 // 注册新描述符
 int Epoll::epoll_add(int fd, SP_ReqData request, __uint32_t events)
 {
+    if (fd < 0 || (size_t)fd >= slots.size())
+        return -1;
+    ConnSlot &slot = slots[fd];
+    // 新连接使用新的代数，之前同一fd残留的事件都会被识别为过期事件
+    ++slot.generation;
     struct epoll_event event;
-    event.data.fd = fd;
+    event.data.u64 = make_event_data(fd, slot.generation);
     event.events = events;
+    IoStats::addSyscall();
     if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0)
     {
         // perror("epoll_add error");
         return -1;
     }
-    fd2req[fd] = request;
+    slot.request = request;
+    slot.events = events;
     return 0;
 }
 
-// 修改描述符状态
-int Epoll::epoll_mod(int fd, SP_ReqData request, __uint32_t events)
+// 修改描述符状态，连接仍在槽中，不需要修改连接表
+int Epoll::epoll_mod(int fd, __uint32_t events)
 {
+    if (fd < 0 || (size_t)fd >= slots.size())
+        return -1;
     struct epoll_event event;
-    event.data.fd = fd;
+    event.data.u64 = make_event_data(fd, slots[fd].generation);
     event.events = events;
+    IoStats::addSyscall();
     if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &event) < 0)
     {
         // perror("epoll_mod error");
         return -1;
     }
-    fd2req[fd] = request;
+    slots[fd].events = events;
     return 0;
 }
 
+// 只在关注的事件发生变化时才调用epoll_ctl
+int Epoll::epoll_update(int fd, __uint32_t events)
+{
+    if (fd < 0 || (size_t)fd >= slots.size())
+        return -1;
+    if (slots[fd].events == events)
+        return 0;
+    return epoll_mod(fd, events);
+}
+
+bool Epoll::isPinned()
+{
+    return handle_inline;
+}
+
 // 从epoll中删除描述符
 int Epoll::epoll_del(int fd, __uint32_t events)
 {
+    if (fd < 0 || (size_t)fd >= slots.size())
+        return -1;
     struct epoll_event event;
-    event.data.fd = fd;
+    event.data.u64 = make_event_data(fd, slots[fd].generation);
     event.events = events;
+    IoStats::addSyscall();
     if (epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, &event) < 0)
     {
         // perror("epoll_del error");
         return -1;
     }
-    auto fd_ite = fd2req.find(fd);
-    if (fd_ite != fd2req.end())
-        fd2req.erase(fd_ite);
+    ConnSlot &slot = slots[fd];
+    ++slot.generation;
+    slot.request.reset();
     return 0;
 }
 
@@ -66,38 +115,111 @@ int Epoll::epoll_del(int fd, __uint32_t events)
 int Epoll::my_epoll_wait(int listen_fd, int max_events, int timeout)
 {
     int event_count = epoll_wait(epoll_fd, events, max_events, timeout);
+    IoStats::addSyscall();
     if (event_count < 0)
         // perror("epoll wait error");
         return -1;
-    std::vector<SP_ReqData> req_data = getEventsRequest(listen_fd, event_count, PATH);
-    if (req_data.size() > 0)
+    getEventsRequest(listen_fd, event_count, PATH);
+    if (handle_inline)
     {
-        for (auto &req : req_data)
-        {
-            if (ThreadPool::threadpool_add(req) < 0)
-            {
-                // 线程池满了或者关闭了等原因，抛弃本次监听到的请求。
-                break;
-            }
-        }
+        // one loop per thread：连接只属于当前线程，直接在本线程处理，省去线程池的加锁与唤醒
+        for (auto &req : ready_reqs)
+            myHandler(req);
+    }
+    else if (ready_reqs.size() > 0)
+    {
+        // 本轮就绪的请求整批交给线程池，只同步一次，过载被拒绝的请求已回复503并关闭
+        for (auto &req : ready_reqs)
+            task_batch.push_back(ThreadPool::threadpool_task(std::move(req)));
+        ThreadPool::threadpool_add_batch(task_batch.data(), task_batch.size());
+        // 线程池关闭等原因未能放入的请求在这里丢弃
+        task_batch.clear();
     }
+    // 及时释放对本轮请求的引用，已关闭的连接在这里析构并关闭fd
+    ready_reqs.clear();
     timer_manager.handle_expired_event();
+    IoStats::flush();
     return 0;
 }
 
 // 初始化epoll
-int Epoll::epoll_init(int maxevents, int listen_num)
+int Epoll::epoll_init(int maxevents, int listen_num, bool _handle_inline)
 {
     epoll_fd = epoll_create(listen_num + 1);
     if (epoll_fd == -1)
         return -1;
     // events.reset(new epoll_event[maxevents], [](epoll_event *data){delete [] data;});
     events = new epoll_event[maxevents];
+    handle_inline = _handle_inline;
+    // 按进程可打开的最大描述符数预分配连接表，运行期间不再扩容，分发时只需一次数组下标访问
+    struct rlimit rl;
+    size_t max_fds = 65536;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY)
+        max_fds = rl.rlim_cur;
+    slots.resize(max_fds);
+    // 注册eventfd，其他线程投递新连接后通过它唤醒epoll_wait
+    wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wakeup_fd == -1)
+        return -1;
+    struct epoll_event event;
+    event.data.u64 = make_event_data(wakeup_fd, 0);
+    event.events = EPOLLIN;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wakeup_fd, &event) < 0)
+        return -1;
     return 0;
 }
 
+// 投递新连接，可在任意线程中调用
+void Epoll::queueConnection(int accept_fd, const std::string &ip)
+{
+    {
+        MutexLockGuard locker(pending_lock);
+        pending_conns.push_back(std::make_pair(accept_fd, ip));
+    }
+    uint64_t one = 1;
+    IoStats::addSyscall();
+    ssize_t n = write(wakeup_fd, &one, sizeof(one));
+    (void)n;
+}
+
+// 被唤醒后在本线程中注册投递过来的连接
+void Epoll::handleWakeup()
+{
+    uint64_t cnt = 0;
+    IoStats::addSyscall();
+    ssize_t n = read(wakeup_fd, &cnt, sizeof(cnt));
+    (void)n;
+    std::vector<std::pair<int, std::string>> conns;
+    {
+        MutexLockGuard locker(pending_lock);
+        conns.swap(pending_conns);
+    }
+    for (auto &conn : conns)
+    {
+        // fd为-1是reactor_destroy用来唤醒的空投递
+        if (conn.first >= 0)
+            registerConnection(conn.first, conn.second, PATH);
+    }
+}
+
+// 为新连接创建RequestData并注册到本事件循环
+void Epoll::registerConnection(int accept_fd, const std::string &ip, const std::string path)
+{
+    SP_ReqData req_info(new RequestData(this, accept_fd, ip, path));
+
+    // 文件描述符可以读，边缘触发(Edge Triggered)模式
+    // 交给线程池处理时使用EPOLLONESHOT，保证一个socket连接在任一时刻只被一个线程处理
+    // 连接固定在本线程时只注册一次，此后不再需要每次请求都重新激活
+    __uint32_t _epo_event = EPOLLIN | EPOLLET | EPOLLONESHOT;
+    if (handle_inline)
+        _epo_event = EPOLLIN | EPOLLET | EPOLLRDHUP;
+    epoll_add(accept_fd, req_info, _epo_event);
+    // 新增时间信息，为每一个新的连接添加一个过期时间
+    timer_manager.addTimer(req_info, TIMER_TIME_OUT);
+}
+
 // 监听描述符，接受新连接
-void Epoll::acceptConnection(int listen_fd, int epoll_fd, const std::string path)
+void Epoll::acceptConnection(int listen_fd, const std::string path)
 {
     struct sockaddr_in client_addr;
     memset(&client_addr, 0, sizeof(struct sockaddr_in));
@@ -106,6 +228,7 @@ void Epoll::acceptConnection(int listen_fd, int epoll_fd, const std::string path
     // 此处使用while循环是解决边沿触发问题，多个连接请求同时到达，epoll_wait只会通知一次，导致有的连接没有响应
     while ((accept_fd = accept(listen_fd, (struct sockaddr *)&client_addr, &client_addr_len)) > 0)
     {
+        IoStats::addSyscall(2); // accept + fcntl
 
         // cout << inet_addr(client_addr.sin_addr.s_addr) << endl;
         // cout << client_addr.sin_port << endl;
@@ -118,7 +241,9 @@ void Epoll::acceptConnection(int listen_fd, int epoll_fd, const std::string path
         */
 
         // 记录连接日志
-        char *str = inet_ntoa(client_addr.sin_addr);
+        // 多个IO线程可能同时accept，inet_ntoa使用静态缓冲区不可重入，改用inet_ntop
+        char str[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &client_addr.sin_addr, str, sizeof(str));
         // pthread_mutex_lock(&log_lock);
         {
             MutexLockGuard_LOG();
@@ -133,30 +258,35 @@ void Epoll::acceptConnection(int listen_fd, int epoll_fd, const std::string path
         }
         // pthread_mutex_unlock(&log_lock);
 
-        SP_ReqData req_info(new RequestData(epoll_fd, accept_fd, std::string(str), path));
-
-        // 文件描述符可以读，边缘触发(Edge Triggered)模式，保证一个socket连接在任一时刻只被一个线程处理
-        __uint32_t _epo_event = EPOLLIN | EPOLLET | EPOLLONESHOT;
-        Epoll::epoll_add(accept_fd, req_info, _epo_event);
-        // 新增时间信息，为每一个新的连接添加一个过期时间
-        timer_manager.addTimer(req_info, TIMER_TIME_OUT);
+        // 主线程作为acceptor时把连接交给某个IO线程，IO线程自己accept的连接直接注册到本事件循环
+        Epoll *loop = handle_inline ? NULL : ReactorPool::getNextLoop();
+        if (loop != NULL)
+            loop->queueConnection(accept_fd, std::string(str));
+        else
+            registerConnection(accept_fd, std::string(str), path);
     }
+    // 最后一次返回EAGAIN的accept
+    IoStats::addSyscall();
 }
 
-// 分发处理函数
-std::vector<std::shared_ptr<RequestData>> Epoll::getEventsRequest(int listen_fd, int events_num, const std::string path)
+// 分发处理函数，就绪的请求放入ready_reqs
+void Epoll::getEventsRequest(int listen_fd, int events_num, const std::string path)
 {
-    std::vector<SP_ReqData> req_data;
     for (int i = 0; i < events_num; ++i)
     {
-        // 获取有事件产生的描述符
-        int fd = events[i].data.fd;
+        // 获取有事件产生的描述符和注册时的代数
+        int fd = (int)(events[i].data.u64 & 0xffffffffULL);
+        unsigned int generation = (unsigned int)(events[i].data.u64 >> 32);
 
         // 有事件发生的描述符为监听描述符
         if (fd == listen_fd)
         {
             // cout << "This is listen_fd" << endl;
-            acceptConnection(listen_fd, epoll_fd, path);
+            acceptConnection(listen_fd, path);
+        }
+        else if (fd == wakeup_fd)
+        {
+            handleWakeup();
         }
         // 排除标准输入、输出、标准错误输出
         else if (fd < 3)
@@ -165,20 +295,23 @@ std::vector<std::shared_ptr<RequestData>> Epoll::getEventsRequest(int listen_fd,
         }
         else
         {
+            ConnSlot &slot = slots[fd];
+            // 代数不一致说明原连接已关闭、fd已被新连接复用，丢弃过期事件
+            if (slot.generation != generation || !slot.request)
+                continue;
             // 排除错误事件
             if ((events[i].events & EPOLLERR) || (events[i].events & EPOLLHUP))
             {
                 // printf("error event\n");
-                auto fd_ite = fd2req.find(fd);
-                if (fd_ite != fd2req.end())
-                    fd2req.erase(fd_ite);
+                epoll_del(fd);
                 // printf("fd = %d, here\n", fd);
                 continue;
             }
 
             // 将请求任务加入到线程池中
             // 加入线程池之前将Timer和request分离
-            SP_ReqData cur_req(fd2req[fd]);
+            // 连接留在槽中，EPOLLONESHOT保证处理期间不会再有该fd的事件
+            SP_ReqData cur_req(slot.request);
             // 如果为读取或者读取紧急数据事件
             if ((events[i].events & EPOLLIN) || (events[i].events & EPOLLPRI))
                 cur_req->enableRead();
@@ -186,13 +319,9 @@ std::vector<std::shared_ptr<RequestData>> Epoll::getEventsRequest(int listen_fd,
                 cur_req->enableWrite();
             // printf("cur_req.use_count=%d\n", cur_req.use_count());
             cur_req->seperateTimer();
-            req_data.push_back(cur_req);
-            auto fd_ite = fd2req.find(fd);
-            if (fd_ite != fd2req.end())
-                fd2req.erase(fd_ite);
+            ready_reqs.push_back(cur_req);
         }
     }
-    return req_data;
 }
 
 void Epoll::add_timer(SP_ReqData request_data, int timeout)
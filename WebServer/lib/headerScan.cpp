@@ -0,0 +1,152 @@
+#include "headerScan.h"
+#include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HEADER_SCAN_X86
+#endif
+
+// 逐字节实现使用的查表：非0表示需要停下的字节
+struct ScanTable
+{
+    unsigned char key[256];
+    unsigned char value[256];
+    ScanTable()
+    {
+        memset(key, 0, sizeof(key));
+        memset(value, 0, sizeof(value));
+        for (int c = 0; c <= 0x20; ++c)
+            key[c] = 1;
+        key[(unsigned char)':'] = 1;
+        key[0x7f] = 1;
+        for (int c = 0; c < 0x20; ++c)
+            value[c] = (c != '\t');
+        value[0x7f] = 1;
+    }
+};
+static const ScanTable scan_table;
+
+static const char *scanKeyScalar(const char *p, const char *end)
+{
+    while (p < end && !scan_table.key[(unsigned char)*p])
+        ++p;
+    return p;
+}
+
+static const char *scanValueScalar(const char *p, const char *end)
+{
+    while (p < end && !scan_table.value[(unsigned char)*p])
+        ++p;
+    return p;
+}
+
+#ifdef HEADER_SCAN_X86
+// pcmpestri的范围模式：每两个字节为一个闭区间，数据中第一个落在任一区间内的字节的下标，没有时为16
+// 使用显式长度的版本，数据中的'\0'不会提前结束比较
+static const char KEY_RANGES[16] = {'\x00', '\x20', ':', ':', '\x7f', '\x7f'};
+static const int KEY_RANGES_LEN = 6;
+static const char VALUE_RANGES[16] = {'\x00', '\x08', '\x0a', '\x1f', '\x7f', '\x7f'};
+static const int VALUE_RANGES_LEN = 6;
+
+__attribute__((target("sse4.2"))) static const char *scanKeySse42(const char *p, const char *end)
+{
+    const __m128i ranges = _mm_loadu_si128(reinterpret_cast<const __m128i *>(KEY_RANGES));
+    for (; end - p >= 16; p += 16)
+    {
+        __m128i data = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+        int idx = _mm_cmpestri(ranges, KEY_RANGES_LEN, data, 16, _SIDD_UBYTE_OPS | _SIDD_CMP_RANGES | _SIDD_LEAST_SIGNIFICANT);
+        if (idx != 16)
+            return p + idx;
+    }
+    return scanKeyScalar(p, end);
+}
+
+__attribute__((target("sse4.2"))) static const char *scanValueSse42(const char *p, const char *end)
+{
+    const __m128i ranges = _mm_loadu_si128(reinterpret_cast<const __m128i *>(VALUE_RANGES));
+    for (; end - p >= 16; p += 16)
+    {
+        __m128i data = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+        int idx = _mm_cmpestri(ranges, VALUE_RANGES_LEN, data, 16, _SIDD_UBYTE_OPS | _SIDD_CMP_RANGES | _SIDD_LEAST_SIGNIFICANT);
+        if (idx != 16)
+            return p + idx;
+    }
+    return scanValueScalar(p, end);
+}
+
+// AVX2没有无符号字节比较，x <= c 用 max(x, c) == c 判断
+__attribute__((target("avx2"))) static const char *scanKeyAvx2(const char *p, const char *end)
+{
+    const __m256i space = _mm256_set1_epi8(0x20);
+    const __m256i colon = _mm256_set1_epi8(':');
+    const __m256i del = _mm256_set1_epi8(0x7f);
+    for (; end - p >= 32; p += 32)
+    {
+        __m256i data = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+        __m256i hit = _mm256_cmpeq_epi8(_mm256_max_epu8(data, space), space);
+        hit = _mm256_or_si256(hit, _mm256_cmpeq_epi8(data, colon));
+        hit = _mm256_or_si256(hit, _mm256_cmpeq_epi8(data, del));
+        unsigned int mask = _mm256_movemask_epi8(hit);
+        if (mask != 0)
+            return p + __builtin_ctz(mask);
+    }
+    return scanKeyScalar(p, end);
+}
+
+__attribute__((target("avx2"))) static const char *scanValueAvx2(const char *p, const char *end)
+{
+    const __m256i ctl = _mm256_set1_epi8(0x1f);
+    const __m256i tab = _mm256_set1_epi8('\t');
+    const __m256i del = _mm256_set1_epi8(0x7f);
+    for (; end - p >= 32; p += 32)
+    {
+        __m256i data = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+        __m256i hit = _mm256_cmpeq_epi8(_mm256_max_epu8(data, ctl), ctl);
+        hit = _mm256_andnot_si256(_mm256_cmpeq_epi8(data, tab), hit);
+        hit = _mm256_or_si256(hit, _mm256_cmpeq_epi8(data, del));
+        unsigned int mask = _mm256_movemask_epi8(hit);
+        if (mask != 0)
+            return p + __builtin_ctz(mask);
+    }
+    return scanValueScalar(p, end);
+}
+#endif
+
+const char *HeaderScan::impl_name = "scalar";
+HeaderScan::ScanFunc HeaderScan::key_scan = HeaderScan::selectKeyScan();
+HeaderScan::ScanFunc HeaderScan::value_scan = HeaderScan::selectValueScan();
+
+// 在静态初始化阶段选择实现，之后每次调用只是一次间接调用
+HeaderScan::ScanFunc HeaderScan::selectKeyScan()
+{
+#ifdef HEADER_SCAN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        impl_name = "avx2";
+        return scanKeyAvx2;
+    }
+    if (__builtin_cpu_supports("sse4.2"))
+    {
+        impl_name = "sse4.2";
+        return scanKeySse42;
+    }
+#endif
+    return scanKeyScalar;
+}
+
+HeaderScan::ScanFunc HeaderScan::selectValueScan()
+{
+#ifdef HEADER_SCAN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return scanValueAvx2;
+    if (__builtin_cpu_supports("sse4.2"))
+        return scanValueSse42;
+#endif
+    return scanValueScalar;
+}
+
+const char *HeaderScan::implName()
+{
+    return impl_name;
+}
@@ -0,0 +1,36 @@
+#include "ioStats.h"
+#include "log.h"
+
+extern CLogFile logfile;
+
+thread_local unsigned long IoStats::local_syscalls = 0;
+thread_local unsigned long IoStats::local_requests = 0;
+std::atomic<unsigned long> IoStats::syscalls(0);
+std::atomic<unsigned long> IoStats::requests(0);
+unsigned long IoStats::last_requests = 0;
+
+void IoStats::flush()
+{
+    if (local_syscalls)
+    {
+        syscalls.fetch_add(local_syscalls, std::memory_order_relaxed);
+        local_syscalls = 0;
+    }
+    if (local_requests)
+    {
+        requests.fetch_add(local_requests, std::memory_order_relaxed);
+        local_requests = 0;
+    }
+}
+
+void IoStats::report(const char *backend)
+{
+    unsigned long _requests = requests.load(std::memory_order_relaxed);
+    unsigned long _syscalls = syscalls.load(std::memory_order_relaxed);
+    if (_requests == last_requests)
+        return;
+    last_requests = _requests;
+    MutexLockGuard_LOG();
+    logfile.Write("[%s] requests=%lu syscalls=%lu syscalls/request=%.2f\n",
+                  backend, _requests, _syscalls, (double)_syscalls / _requests);
+}
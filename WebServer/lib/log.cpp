@@ -205,7 +205,9 @@ void timetostr(const time_t ltime, char *stime, const char *fmt)
   strcpy(stime, "");
 
   // 用ltime的值生成tm结构
-  struct tm sttm = *localtime(&ltime);
+  // localtime每次调用都重新检查TZ环境变量并分配内存，且返回静态缓冲区，多线程写日志时不安全，用localtime_r
+  struct tm sttm;
+  localtime_r(&ltime, &sttm);
 
   sttm.tm_year = sttm.tm_year + 1900; // 自1900年起的年份
   sttm.tm_mon++;                      // ++是因为范围是0-11
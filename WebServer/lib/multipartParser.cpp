@@ -0,0 +1,318 @@
+#include "multipartParser.h"
+#include <algorithm>
+#include <string.h>
+#include <strings.h>
+
+// 解析状态
+static const int MP_PREAMBLE = 0;   // 第一个分隔符之前，内容丢弃
+static const int MP_DELIM_TAIL = 1; // 分隔符所在行的剩余部分："--"表示结束，否则只能是空白
+static const int MP_HEADERS = 2;    // 部分的头部
+static const int MP_DATA = 3;       // 部分的内容
+static const int MP_EPILOGUE = 4;   // 结束分隔符之后，内容丢弃
+
+static bool isSpace(char c)
+{
+    return c == ' ' || c == '\t';
+}
+
+static void trim(const char *&begin, const char *&end)
+{
+    while (begin < end && isSpace(*begin))
+        ++begin;
+    while (end > begin && isSpace(end[-1]))
+        --end;
+}
+
+// 参数值：token或带引号的字符串，begin移到值之后
+static std::string paramValue(const char *&begin, const char *end)
+{
+    std::string value;
+    if (begin < end && *begin == '"')
+    {
+        for (++begin; begin < end && *begin != '"'; ++begin)
+        {
+            if (*begin == '\\' && begin + 1 < end)
+                ++begin;
+            value += *begin;
+        }
+        if (begin < end)
+            ++begin;
+        return value;
+    }
+    const char *stop = begin;
+    while (stop < end && *stop != ';')
+        ++stop;
+    const char *token_end = stop;
+    trim(begin, token_end);
+    value.assign(begin, token_end);
+    begin = stop;
+    return value;
+}
+
+MultipartParser::MultipartParser() : state(MP_PREAMBLE), header_bytes(0)
+{
+}
+
+bool MultipartParser::isMultipart(const char *content_type, size_t len)
+{
+    static const char TYPE[] = "multipart/form-data";
+    return len >= sizeof(TYPE) - 1 && strncasecmp(content_type, TYPE, sizeof(TYPE) - 1) == 0;
+}
+
+int MultipartParser::init(const char *content_type, size_t len)
+{
+    const char *p = content_type;
+    const char *end = content_type + len;
+    std::string boundary;
+    while ((p = (const char *)memchr(p, ';', end - p)) != NULL)
+    {
+        ++p;
+        while (p < end && isSpace(*p))
+            ++p;
+        const char *eq = (const char *)memchr(p, '=', end - p);
+        if (eq == NULL)
+            break;
+        const char *key_end = eq;
+        trim(p, key_end);
+        bool is_boundary = (key_end - p == 8 && strncasecmp(p, "boundary", 8) == 0);
+        p = eq + 1;
+        while (p < end && isSpace(*p))
+            ++p;
+        std::string value = paramValue(p, end);
+        if (is_boundary)
+            boundary = value;
+    }
+    if (boundary.empty() || boundary.size() > MULTIPART_MAX_BOUNDARY)
+        return -1;
+    delimiter = "\r\n--" + boundary;
+    // 第一个分隔符可以在请求体的最开始，前面补上CRLF后与其余分隔符按同样的方式查找
+    carry = "\r\n";
+    return 0;
+}
+
+int MultipartParser::store(const std::string &str, StrSpan &span)
+{
+    if (fields.size() + str.size() > MULTIPART_MAX_FIELDS)
+        return MULTIPART_TOO_LARGE;
+    span.off = fields.size();
+    span.len = str.size();
+    fields += str;
+    return MULTIPART_OK;
+}
+
+// 只关心Content-Disposition中的name、filename和Content-Type，其余头部忽略
+int MultipartParser::parsePartHeader(const char *line, const char *end)
+{
+    const char *colon = (const char *)memchr(line, ':', end - line);
+    if (colon == NULL || colon == line)
+        return MULTIPART_ERROR;
+    const char *value = colon + 1;
+    trim(value, end);
+    MultipartPart &part = parts.back();
+    if (colon - line == 12 && strncasecmp(line, "Content-Type", 12) == 0)
+        return store(std::string(value, end), part.content_type);
+    if (colon - line != 19 || strncasecmp(line, "Content-Disposition", 19) != 0)
+        return MULTIPART_OK;
+    // form-data; name="field"; filename="a.txt"
+    const char *p = value;
+    while ((p = (const char *)memchr(p, ';', end - p)) != NULL)
+    {
+        ++p;
+        while (p < end && isSpace(*p))
+            ++p;
+        const char *key = p;
+        while (p < end && *p != '=' && *p != ';')
+            ++p;
+        const char *key_end = p;
+        trim(key, key_end);
+        if (p == end || *p == ';')
+            continue;
+        ++p;
+        while (p < end && isSpace(*p))
+            ++p;
+        std::string param = paramValue(p, end);
+        int ret = MULTIPART_OK;
+        if (key_end - key == 4 && strncasecmp(key, "name", 4) == 0)
+            ret = store(param, part.name);
+        else if (key_end - key == 8 && strncasecmp(key, "filename", 8) == 0)
+        {
+            part.is_file = true;
+            ret = store(param, part.filename);
+        }
+        if (ret != MULTIPART_OK)
+            return ret;
+    }
+    return MULTIPART_OK;
+}
+
+// 头部结束：文件部分准备好BodySink，普通字段的值从fields的末尾开始连续追加
+int MultipartParser::beginPartData()
+{
+    MultipartPart &part = parts.back();
+    if (part.is_file)
+    {
+        part.file.reset(new BodySink());
+        if (part.file->begin(0) < 0)
+            return MULTIPART_IO_ERROR;
+    }
+    else
+        part.value.off = fields.size();
+    return MULTIPART_OK;
+}
+
+int MultipartParser::appendData(const char *data, size_t len)
+{
+    MultipartPart &part = parts.back();
+    if (part.is_file)
+        return part.file->append(data, len) < 0 ? MULTIPART_IO_ERROR : MULTIPART_OK;
+    if (fields.size() + len > MULTIPART_MAX_FIELDS)
+        return MULTIPART_TOO_LARGE;
+    fields.append(data, len);
+    part.value.len += len;
+    return MULTIPART_OK;
+}
+
+// 处理data中能处理的部分，返回处理了的字节数；剩下的是可能的分隔符开头或不完整的一行，需要等待更多数据
+long MultipartParser::process(const char *data, size_t len, int &err)
+{
+    size_t pos = 0;
+    while (pos < len && state != MP_EPILOGUE)
+    {
+        if (state == MP_PREAMBLE || state == MP_DATA)
+        {
+            const char *hit = (const char *)memmem(data + pos, len - pos, delimiter.data(), delimiter.size());
+            // 没有找到时，最后delimiter.size()-1个字节可能是分隔符的开头，先不处理
+            size_t avail = hit ? hit - (data + pos) : (len - pos >= delimiter.size() ? len - pos - (delimiter.size() - 1) : 0);
+            if (state == MP_DATA && avail > 0 && (err = appendData(data + pos, avail)) != MULTIPART_OK)
+                return -1;
+            pos += avail;
+            if (hit == NULL)
+                break;
+            pos += delimiter.size();
+            state = MP_DELIM_TAIL;
+            header_bytes = 0;
+            continue;
+        }
+        // 结束分隔符"--boundary--"之后可以直接是请求体的末尾，不必等待换行
+        if (state == MP_DELIM_TAIL && len - pos >= 2 && data[pos] == '-' && data[pos + 1] == '-')
+        {
+            state = MP_EPILOGUE;
+            break;
+        }
+        // 其余部分都以行为单位
+        const char *line = data + pos;
+        const char *eol = (const char *)memchr(line, '\n', len - pos);
+        if (eol == NULL)
+        {
+            if (header_bytes + (len - pos) > MULTIPART_MAX_HEADER)
+            {
+                err = MULTIPART_ERROR;
+                return -1;
+            }
+            break;
+        }
+        const char *line_end = (eol > line && eol[-1] == '\r') ? eol - 1 : eol;
+        header_bytes += eol + 1 - line;
+        pos = eol + 1 - data;
+        if (header_bytes > MULTIPART_MAX_HEADER)
+        {
+            err = MULTIPART_ERROR;
+            return -1;
+        }
+        if (state == MP_DELIM_TAIL)
+        {
+            // 分隔符之后到行尾只允许空白
+            for (const char *p = line; p < line_end; ++p)
+            {
+                if (!isSpace(*p))
+                {
+                    err = MULTIPART_ERROR;
+                    return -1;
+                }
+            }
+            if (parts.size() >= MULTIPART_MAX_PARTS)
+            {
+                err = MULTIPART_TOO_LARGE;
+                return -1;
+            }
+            // 值初始化，各StrSpan为空，is_file为false
+            parts.push_back(MultipartPart());
+            state = MP_HEADERS;
+        }
+        else if (line_end == line)
+        {
+            if ((err = beginPartData()) != MULTIPART_OK)
+                return -1;
+            state = MP_DATA;
+        }
+        else if ((err = parsePartHeader(line, line_end)) != MULTIPART_OK)
+            return -1;
+    }
+    // 结束分隔符之后的内容丢弃
+    if (state == MP_EPILOGUE)
+        pos = len;
+    return pos;
+}
+
+int MultipartParser::feed(const char *data, size_t len)
+{
+    int err = MULTIPART_OK;
+    if (!carry.empty())
+    {
+        // 上次剩下的数据与新数据的开头拼在一起处理，只拼接判断所需的长度，其余新数据不复制
+        size_t old = carry.size();
+        size_t take = std::min(len, (state == MP_PREAMBLE || state == MP_DATA) ? delimiter.size() : MULTIPART_MAX_HEADER);
+        carry.append(data, take);
+        long used = process(carry.data(), carry.size(), err);
+        if (used < 0)
+            return err;
+        if ((size_t)used < old)
+        {
+            // 新数据已全部放入carry，仍然不够处理原来剩下的部分
+            if (take < len)
+                return MULTIPART_ERROR;
+            carry.erase(0, used);
+            return MULTIPART_OK;
+        }
+        // carry中新数据的部分可能只处理了一部分，从data中对应的位置继续
+        data += used - old;
+        len -= used - old;
+        carry.clear();
+    }
+    long used = process(data, len, err);
+    if (used < 0)
+        return err;
+    carry.assign(data + used, len - used);
+    return MULTIPART_OK;
+}
+
+bool MultipartParser::finished() const
+{
+    return state == MP_EPILOGUE;
+}
+
+const std::vector<MultipartPart> &MultipartParser::getParts() const
+{
+    return parts;
+}
+
+const MultipartPart *MultipartParser::find(const char *name) const
+{
+    size_t len = strlen(name);
+    for (size_t i = 0; i < parts.size(); ++i)
+    {
+        if (parts[i].name.len == len && fields.compare(parts[i].name.off, len, name) == 0)
+            return &parts[i];
+    }
+    return NULL;
+}
+
+const std::string &MultipartParser::fieldData() const
+{
+    return fields;
+}
+
+std::string MultipartParser::spanString(const StrSpan &span) const
+{
+    return fields.substr(span.off, span.len);
+}
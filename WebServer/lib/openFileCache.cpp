@@ -0,0 +1,188 @@
+#include "openFileCache.h"
+#include "HttpRequestData.h"
+#include "_cmpublic.h"
+#include "ioStats.h"
+#include <vector>
+
+OpenFileCache::Shard OpenFileCache::shards[OPEN_FILE_CACHE_SHARDS];
+size_t OpenFileCache::max_entries = 0;
+int OpenFileCache::valid_ms = 0;
+
+static size_t now_ms()
+{
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return (now.tv_sec * 1000) + (now.tv_usec / 1000);
+}
+
+// 有效期过后用stat校验：设备、inode、大小、修改时间都没变才认为是同一个文件
+static bool sameFile(const struct stat &a, const struct stat &b)
+{
+    return a.st_dev == b.st_dev && a.st_ino == b.st_ino && a.st_size == b.st_size &&
+           a.st_mtim.tv_sec == b.st_mtim.tv_sec && a.st_mtim.tv_nsec == b.st_mtim.tv_nsec;
+}
+
+void OpenFileCache::cache_init(size_t _max_entries, int _valid_ms)
+{
+    max_entries = (_max_entries + OPEN_FILE_CACHE_SHARDS - 1) / OPEN_FILE_CACHE_SHARDS;
+    valid_ms = _valid_ms;
+}
+
+std::string OpenFileCache::normalizePath(const std::string &path)
+{
+    bool absolute = !path.empty() && path[0] == '/';
+    std::vector<std::string> parts;
+    size_t start = 0;
+    while (start <= path.size())
+    {
+        size_t end = path.find('/', start);
+        if (end == std::string::npos)
+            end = path.size();
+        std::string part = path.substr(start, end - start);
+        start = end + 1;
+        if (part.empty() || part == ".")
+            continue;
+        if (part == "..")
+        {
+            if (!parts.empty() && parts.back() != "..")
+                parts.pop_back();
+            // 相对路径保留开头的".."，绝对路径不越过根目录
+            else if (!absolute)
+                parts.push_back(part);
+            continue;
+        }
+        parts.push_back(part);
+    }
+    std::string result = absolute ? "/" : "";
+    for (size_t i = 0; i < parts.size(); ++i)
+    {
+        if (i > 0)
+            result += '/';
+        result += parts[i];
+    }
+    if (result.empty())
+        result = ".";
+    return result;
+}
+
+bool OpenFileCache::isNormalized(const std::string &path)
+{
+    if (path == "/")
+        return true;
+    bool absolute = !path.empty() && path[0] == '/';
+    // 相对路径开头连续的".."在规范形式中保留
+    bool leading = !absolute;
+    size_t start = absolute ? 1 : 0;
+    while (start <= path.size())
+    {
+        size_t end = path.find('/', start);
+        if (end == std::string::npos)
+            end = path.size();
+        size_t len = end - start;
+        if (len == 0 || (len == 1 && path[start] == '.'))
+            return false;
+        if (len == 2 && path[start] == '.' && path[start + 1] == '.')
+        {
+            if (!leading)
+                return false;
+        }
+        else
+            leading = false;
+        start = end + 1;
+    }
+    return true;
+}
+
+// 打开文件并取得元数据，失败时记录errno
+OpenFileCache::SP_Info OpenFileCache::openFile(const std::string &path, unsigned long version)
+{
+    std::shared_ptr<OpenFileInfo> info(new OpenFileInfo());
+    IoStats::addSyscall();
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC, 0);
+    if (fd < 0)
+        info->err = errno;
+    else
+    {
+        IoStats::addSyscall();
+        if (fstat(fd, &info->sbuf) < 0)
+            info->err = errno;
+        else if (!S_ISREG(info->sbuf.st_mode))
+            info->err = EISDIR;
+        else
+        {
+            info->err = 0;
+            info->file.reset(new FileHandle(fd));
+        }
+        if (info->err != 0)
+            close(fd);
+    }
+    // 只取最后一个'/'之后的扩展名
+    size_t slash_pos = path.rfind('/');
+    size_t dot_pos = path.rfind('.');
+    if (dot_pos == std::string::npos || (slash_pos != std::string::npos && dot_pos < slash_pos))
+        info->mime = MimeType::getMime("default");
+    else
+        info->mime = MimeType::getMime(path.data() + dot_pos, path.size() - dot_pos);
+    info->valid_time = now_ms() + valid_ms;
+    info->version = version;
+    return info;
+}
+
+void OpenFileCache::insert(Shard &shard, const std::string &path, const SP_Info &info)
+{
+    MutexLockGuard lock(shard.lock);
+    std::unordered_map<std::string, InfoList::iterator>::iterator it = shard.index.find(path);
+    if (it != shard.index.end())
+    {
+        shard.lru.erase(it->second);
+        shard.index.erase(it);
+    }
+    shard.lru.push_front(std::make_pair(path, info));
+    shard.index[path] = shard.lru.begin();
+    // 淘汰的项只释放缓存持有的引用，正在发送的响应仍持有文件
+    while (shard.lru.size() > max_entries)
+    {
+        shard.index.erase(shard.lru.back().first);
+        shard.lru.pop_back();
+    }
+}
+
+OpenFileCache::SP_Info OpenFileCache::get(const std::string &path, unsigned long version)
+{
+    if (max_entries == 0)
+        return openFile(path, version);
+    Shard &shard = shards[std::hash<std::string>()(path) % OPEN_FILE_CACHE_SHARDS];
+    SP_Info cached;
+    size_t now = now_ms();
+    {
+        MutexLockGuard lock(shard.lock);
+        std::unordered_map<std::string, InfoList::iterator>::iterator it = shard.index.find(path);
+        if (it != shard.index.end())
+        {
+            shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+            cached = it->second->second;
+            if (cached->valid_time > now && cached->version == version)
+                return cached;
+        }
+    }
+    // 已过期或版本变化：文件没有变化时继续使用已打开的fd，只延长有效期
+    SP_Info info;
+    if (cached && cached->err == 0)
+    {
+        struct stat sbuf;
+        IoStats::addSyscall();
+        if (stat(path.c_str(), &sbuf) == 0 && sameFile(sbuf, cached->sbuf))
+        {
+            std::shared_ptr<OpenFileInfo> renewed(new OpenFileInfo(*cached));
+            renewed->valid_time = now + valid_ms;
+            renewed->version = version;
+            info = renewed;
+        }
+    }
+    if (!info)
+        info = openFile(path, version);
+    // 负缓存只针对文件不存在的情况，权限、描述符耗尽等错误每次重试
+    if (info->err == 0 || info->err == ENOENT || info->err == ENOTDIR || info->err == EISDIR)
+        insert(shard, path, info);
+    return info;
+}
@@ -0,0 +1,227 @@
+#include "outputQueue.h"
+#include "ioStats.h"
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <utility>
+
+FileHandle::FileHandle(int _fd) : fd(_fd)
+{
+}
+
+FileHandle::~FileHandle()
+{
+    if (fd >= 0)
+        close(fd);
+}
+
+int FileHandle::get() const
+{
+    return fd;
+}
+
+OutputQueue::OutputQueue() : bytes(0)
+{
+}
+
+void OutputQueue::append(std::string &&data)
+{
+    if (data.empty())
+        return;
+    bytes += data.size();
+    segments.push_back(Segment());
+    Segment &seg = segments.back();
+    seg.data.swap(data);
+    seg.start = 0;
+    seg.length = seg.data.size();
+    seg.offset = 0;
+}
+
+void OutputQueue::append(const char *data, size_t len)
+{
+    append(std::string(data, len));
+}
+
+void OutputQueue::append(const SP_Buffer &buf)
+{
+    if (buf)
+        append(buf, 0, buf->size());
+}
+
+void OutputQueue::append(const SP_Buffer &buf, size_t start, size_t len)
+{
+    if (len == 0)
+        return;
+    bytes += len;
+    segments.push_back(Segment());
+    Segment &seg = segments.back();
+    seg.shared = buf;
+    seg.start = start;
+    seg.length = len;
+    seg.offset = 0;
+}
+
+void OutputQueue::append(const SP_File &file, off_t file_offset, size_t len)
+{
+    if (len == 0)
+        return;
+    bytes += len;
+    segments.push_back(Segment());
+    Segment &seg = segments.back();
+    seg.file = file;
+    seg.start = file_offset;
+    seg.length = len;
+    seg.offset = 0;
+}
+
+void OutputQueue::splice(OutputQueue &other)
+{
+    while (!other.segments.empty())
+    {
+        Segment &src = other.segments.front();
+        segments.push_back(Segment());
+        Segment &seg = segments.back();
+        seg.data.swap(src.data);
+        seg.shared.swap(src.shared);
+        seg.file.swap(src.file);
+        seg.start = src.start;
+        seg.length = src.length;
+        seg.offset = src.offset;
+        other.segments.pop_front();
+    }
+    bytes += other.bytes;
+    other.bytes = 0;
+}
+
+int OutputQueue::fillIovec(struct iovec *iov, int max_iov) const
+{
+    int cnt = 0;
+    for (SegmentDeque::const_iterator it = segments.begin(); it != segments.end() && cnt < max_iov; ++it, ++cnt)
+    {
+        if (it->file)
+            break;
+        const std::string &data = it->shared ? *it->shared : it->data;
+        iov[cnt].iov_base = const_cast<char *>(data.data()) + it->start + it->offset;
+        iov[cnt].iov_len = it->length - it->offset;
+    }
+    return cnt;
+}
+
+ssize_t OutputQueue::loadFile(size_t max_bytes)
+{
+    // 找到队首连续内存段之后的第一个文件段，与前面的响应头一起发送
+    size_t k = 0;
+    while (k < segments.size() && !segments[k].file)
+        ++k;
+    if (k == segments.size() || k >= (size_t)OUTPUT_MAX_IOV)
+        return 0;
+    Segment &seg = segments[k];
+    size_t len = seg.length - seg.offset;
+    if (len > max_bytes)
+        len = max_bytes;
+    std::string buf(len, '\0');
+    IoStats::addSyscall();
+    ssize_t nread = pread(seg.file->get(), &buf[0], len, seg.start + seg.offset);
+    // 读到0说明文件在发送期间被截断，已发出的Content-Length无法满足，只能按出错处理
+    if (nread <= 0)
+        return -1;
+    buf.resize(nread);
+    // 读入的部分从文件段移到它前面的内存段，未发送的总字节数不变
+    seg.offset += nread;
+    if (seg.offset == seg.length)
+        segments.erase(segments.begin() + k);
+    SegmentDeque::iterator it = segments.insert(segments.begin() + k, Segment());
+    it->data.swap(buf);
+    it->start = 0;
+    it->length = it->data.size();
+    it->offset = 0;
+    return nread;
+}
+
+void OutputQueue::consume(size_t n)
+{
+    bytes -= n;
+    while (n > 0 && !segments.empty())
+    {
+        Segment &seg = segments.front();
+        size_t left = seg.length - seg.offset;
+        if (n < left)
+        {
+            seg.offset += n;
+            return;
+        }
+        n -= left;
+        segments.pop_front();
+    }
+}
+
+ssize_t OutputQueue::flush(int fd)
+{
+    ssize_t sum = 0;
+    struct iovec iov[OUTPUT_MAX_IOV];
+    while (!segments.empty())
+    {
+        Segment &front = segments.front();
+        size_t want = 0;
+        ssize_t nwritten;
+        if (front.file)
+        {
+            // 文件内容由内核直接从页缓存发往socket，大文件跨多次EPOLLOUT逐步发送
+            off_t off = front.start + front.offset;
+            want = front.length - front.offset;
+            IoStats::addSyscall();
+            nwritten = sendfile(fd, front.file->get(), &off, want);
+            // 返回0说明文件被截断，剩余内容永远发不出去
+            if (nwritten == 0)
+                return -1;
+        }
+        else
+        {
+            int cnt = fillIovec(iov, OUTPUT_MAX_IOV);
+            for (int i = 0; i < cnt; ++i)
+                want += iov[i].iov_len;
+            struct msghdr msg;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = iov;
+            msg.msg_iovlen = cnt;
+            // 后面紧跟文件段时带上MSG_MORE，响应头与文件开头合并到同一个TCP报文中
+            int flags = MSG_NOSIGNAL;
+            if ((size_t)cnt < segments.size() && segments[cnt].file)
+                flags |= MSG_MORE;
+            IoStats::addSyscall();
+            nwritten = sendmsg(fd, &msg, flags);
+        }
+        if (nwritten < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            return -1;
+        }
+        consume(nwritten);
+        sum += nwritten;
+        // 没有写完说明发送缓冲区已满，不必再调用一次得到EAGAIN
+        if ((size_t)nwritten < want)
+            break;
+    }
+    return sum;
+}
+
+size_t OutputQueue::size() const
+{
+    return bytes;
+}
+
+bool OutputQueue::empty() const
+{
+    return segments.empty();
+}
+
+void OutputQueue::clear()
+{
+    segments.clear();
+    bytes = 0;
+}
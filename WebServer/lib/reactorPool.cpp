@@ -0,0 +1,154 @@
+#include "reactorPool.h"
+#include "_cmpublic.h"
+#include "log.h"
+
+extern CLogFile logfile;
+
+std::vector<Epoll *> ReactorPool::loops;
+std::vector<UringLoop *> ReactorPool::urings;
+std::vector<pthread_t> ReactorPool::threads;
+std::vector<int> ReactorPool::listen_fds;
+int ReactorPool::next = 0;
+int ReactorPool::max_events = 0;
+volatile int ReactorPool::shutdown = 0;
+
+// 创建thread_num个IO线程，每个线程一个事件循环
+// listen_mode为LISTEN_REUSEPORT时_listen_fds为每个IO线程一个，为LISTEN_EXCLUSIVE时为共享的一个
+int ReactorPool::reactor_create(int thread_num, int maxevents, int listen_num,
+                                const std::vector<int> &_listen_fds, int listen_mode)
+{
+    max_events = maxevents;
+    listen_fds.assign(thread_num, -1);
+    for (int i = 0; i < thread_num; ++i)
+    {
+        Epoll *loop = new Epoll();
+        // 连接由所属IO线程直接处理，不再交给线程池
+        if (loop->epoll_init(maxevents, listen_num, true) < 0)
+        {
+            delete loop;
+            return -1;
+        }
+        loops.push_back(loop);
+        if (listen_mode == LISTEN_ACCEPTOR)
+            continue;
+        // 监听描述符不需要RequestData
+        __uint32_t event = EPOLLIN | EPOLLET;
+        if (listen_mode == LISTEN_REUSEPORT)
+        {
+            listen_fds[i] = _listen_fds[i];
+        }
+        else
+        {
+            // EPOLLEXCLUSIVE不能与EPOLLONESHOT一起使用，使用水平触发，未被accept完的连接会继续唤醒某个线程
+            listen_fds[i] = _listen_fds[0];
+            event = EPOLLIN | EPOLLEXCLUSIVE;
+        }
+        if (loop->epoll_add(listen_fds[i], Epoll::SP_ReqData(), event) < 0)
+            return -1;
+    }
+    threads.resize(thread_num);
+    for (int i = 0; i < thread_num; ++i)
+    {
+        if (pthread_create(&threads[i], NULL, reactor_thread, (void *)(long)i) != 0)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// IO线程：只运行自己的事件循环
+void *ReactorPool::reactor_thread(void *args)
+{
+    int index = (int)(long)args;
+    Epoll *loop = loops[index];
+    int listen_fd = listen_fds[index];
+    while (!shutdown)
+    {
+        if (loop->my_epoll_wait(listen_fd, max_events, -1) < 0)
+        {
+            MutexLockGuard_LOG();
+            logfile.Write("reactor epoll wait failed\n");
+            break;
+        }
+    }
+    pthread_exit(NULL);
+}
+
+int ReactorPool::uring_create(int thread_num, unsigned entries, const std::vector<int> &_listen_fds)
+{
+    for (int i = 0; i < thread_num; ++i)
+    {
+        UringLoop *loop = new UringLoop();
+        urings.push_back(loop);
+        if (loop->uring_init(entries, _listen_fds[i]) < 0)
+        {
+            for (size_t j = 0; j < urings.size(); ++j)
+                delete urings[j];
+            urings.clear();
+            return -1;
+        }
+    }
+    threads.resize(thread_num);
+    for (int i = 0; i < thread_num; ++i)
+    {
+        if (pthread_create(&threads[i], NULL, uring_thread, (void *)urings[i]) != 0)
+        {
+            // 已启动的线程在下一次周期超时时看到shutdown退出，等它们结束后再释放，调用者随后会关闭监听描述符
+            shutdown = true;
+            for (int j = 0; j < i; ++j)
+                pthread_join(threads[j], NULL);
+            for (size_t j = 0; j < urings.size(); ++j)
+                delete urings[j];
+            urings.clear();
+            threads.clear();
+            shutdown = false;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void *ReactorPool::uring_thread(void *args)
+{
+    UringLoop *loop = static_cast<UringLoop *>(args);
+    while (!shutdown)
+    {
+        if (loop->uring_wait() < 0)
+        {
+            MutexLockGuard_LOG();
+            logfile.Write("io_uring wait failed\n");
+            break;
+        }
+    }
+    pthread_exit(NULL);
+}
+
+int ReactorPool::reactor_destroy()
+{
+    shutdown = true;
+    for (size_t i = 0; i < threads.size(); ++i)
+    {
+        // 投递一个无效连接用于唤醒阻塞在epoll_wait中的线程
+        loops[i]->queueConnection(-1, "");
+        pthread_join(threads[i], NULL);
+        delete loops[i];
+    }
+    threads.clear();
+    loops.clear();
+    return 0;
+}
+
+int ReactorPool::reactor_num()
+{
+    return loops.size();
+}
+
+Epoll *ReactorPool::getNextLoop()
+{
+    if (loops.empty())
+        return NULL;
+    Epoll *loop = loops[next];
+    next = (next + 1) % loops.size();
+    return loop;
+}
@@ -0,0 +1,238 @@
+#include "router.h"
+#include <algorithm>
+#include <string.h>
+
+std::vector<Router::BuildNode> Router::building;
+std::vector<Router::Node> Router::nodes;
+std::string Router::segments;
+
+int Router::newBuildNode(const std::string &segment)
+{
+    BuildNode node;
+    node.segment = segment;
+    node.param_child = -1;
+    for (int i = 0; i < ROUTE_METHOD_NUM; ++i)
+        node.exact[i] = node.prefix[i] = NULL;
+    building.push_back(node);
+    return building.size() - 1;
+}
+
+int Router::addRoute(int method, const char *pattern, int type, RouteHandler handler)
+{
+    if (method <= 0 || method >= ROUTE_METHOD_NUM || pattern[0] != '/' || handler == NULL)
+        return -1;
+    if (building.empty())
+        newBuildNode("");
+    int node = 0;
+    int params = 0;
+    const char *p = pattern;
+    while (*p != '\0')
+    {
+        // 连续的'/'与末尾的'/'不构成段
+        if (*p == '/')
+        {
+            ++p;
+            continue;
+        }
+        const char *end = strchr(p, '/');
+        std::string seg(p, end ? end - p : strlen(p));
+        p += seg.size();
+        if (seg[0] == ':')
+        {
+            if (seg.size() == 1 || ++params > MAX_ROUTE_PARAMS)
+                return -1;
+            // 同一位置的参数段只能有一个名称
+            if (building[node].param_child < 0)
+            {
+                int child = newBuildNode("");
+                building[node].param_child = child;
+                building[node].param_name = seg.substr(1);
+            }
+            else if (building[node].param_name != seg.substr(1))
+                return -1;
+            node = building[node].param_child;
+            continue;
+        }
+        int child = -1;
+        for (size_t i = 0; i < building[node].children.size(); ++i)
+        {
+            if (building[building[node].children[i]].segment == seg)
+            {
+                child = building[node].children[i];
+                break;
+            }
+        }
+        if (child < 0)
+        {
+            child = newBuildNode(seg);
+            building[node].children.push_back(child);
+        }
+        node = child;
+    }
+    if (type == ROUTE_PREFIX)
+        building[node].prefix[method] = handler;
+    else
+        building[node].exact[method] = handler;
+    return 0;
+}
+
+// 按层次顺序把节点排列到数组中，同一节点的静态子节点相邻并按(长度, 内容)排序，参数子节点紧随其后
+void Router::compile()
+{
+    if (building.empty())
+        newBuildNode("");
+    nodes.assign(1, Node());
+    segments.clear();
+    std::vector<int> param_off(1, -1);
+    std::vector<std::pair<int, int>> queue; /* (注册阶段的节点, 编译后的下标) */
+    queue.push_back(std::make_pair(0, 0));
+    for (size_t i = 0; i < queue.size(); ++i)
+    {
+        const BuildNode &b = building[queue[i].first];
+        int index = queue[i].second;
+        std::vector<int> children = b.children;
+        std::sort(children.begin(), children.end(), [](int x, int y) {
+            const std::string &a = building[x].segment;
+            const std::string &c = building[y].segment;
+            return a.size() != c.size() ? a.size() < c.size() : a < c;
+        });
+        Node node;
+        node.seg_off = segments.size();
+        node.seg_len = b.segment.size();
+        segments += b.segment;
+        node.first_child = nodes.size();
+        node.child_count = children.size();
+        node.param_child = -1;
+        node.param_name = NULL;
+        for (int m = 0; m < ROUTE_METHOD_NUM; ++m)
+        {
+            node.exact[m] = b.exact[m];
+            node.prefix[m] = b.prefix[m];
+        }
+        for (size_t k = 0; k < children.size(); ++k)
+            queue.push_back(std::make_pair(children[k], node.first_child + k));
+        nodes.resize(nodes.size() + children.size());
+        if (b.param_child >= 0)
+        {
+            node.param_child = nodes.size();
+            queue.push_back(std::make_pair(b.param_child, node.param_child));
+            nodes.resize(nodes.size() + 1);
+            // 参数名以'\0'结尾放在段之后，全部编译完成后再取指针
+            param_off.resize(nodes.size(), -1);
+            param_off[index] = segments.size();
+            segments += b.param_name;
+            segments += '\0';
+        }
+        nodes[index] = node;
+    }
+    param_off.resize(nodes.size(), -1);
+    for (size_t i = 0; i < nodes.size(); ++i)
+    {
+        if (param_off[i] >= 0)
+            nodes[i].param_name = segments.c_str() + param_off[i];
+    }
+    building.clear();
+}
+
+int Router::findChild(const Node &node, const char *seg, size_t len)
+{
+    unsigned int lo = node.first_child;
+    unsigned int hi = node.first_child + node.child_count;
+    while (lo < hi)
+    {
+        unsigned int mid = (lo + hi) / 2;
+        const Node &child = nodes[mid];
+        int cmp = child.seg_len != len ? (child.seg_len < len ? -1 : 1) : memcmp(segments.data() + child.seg_off, seg, len);
+        if (cmp == 0)
+            return mid;
+        if (cmp < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return -1;
+}
+
+int Router::match(int method, const char *path, size_t len, RouteMatch &result)
+{
+    result.handler = NULL;
+    result.param_count = 0;
+    result.rest.off = result.rest.len = 0;
+    result.allowed = 0;
+    if (nodes.empty() || method <= 0 || method >= ROUTE_METHOD_NUM)
+        return ROUTE_NOT_FOUND;
+    // 路径上最长的前缀路由，精确路由不匹配时使用
+    RouteHandler prefix = NULL;
+    int prefix_params = 0;
+    StrSpan prefix_rest = {0, 0};
+    int index = 0;
+    size_t pos = 0;
+    while (true)
+    {
+        const Node &node = nodes[index];
+        for (int m = 1; m < ROUTE_METHOD_NUM; ++m)
+            result.allowed |= node.prefix[m] != NULL ? 1u << m : 0;
+        if (node.prefix[method] != NULL)
+        {
+            prefix = node.prefix[method];
+            prefix_params = result.param_count;
+            prefix_rest.off = pos;
+            prefix_rest.len = len - pos;
+        }
+        while (pos < len && path[pos] == '/')
+            ++pos;
+        if (pos == len)
+            break;
+        const char *seg = path + pos;
+        const char *end = (const char *)memchr(seg, '/', len - pos);
+        size_t seg_len = end ? end - seg : len - pos;
+        int child = findChild(node, seg, seg_len);
+        if (child < 0 && node.param_child >= 0 && result.param_count < MAX_ROUTE_PARAMS)
+        {
+            child = node.param_child;
+            result.names[result.param_count] = node.param_name;
+            result.values[result.param_count].off = pos;
+            result.values[result.param_count].len = seg_len;
+            ++result.param_count;
+        }
+        if (child < 0)
+        {
+            index = -1;
+            break;
+        }
+        index = child;
+        pos += seg_len;
+    }
+    if (index >= 0)
+    {
+        const Node &node = nodes[index];
+        if (node.exact[method] != NULL)
+        {
+            result.handler = node.exact[method];
+            return ROUTE_FOUND;
+        }
+        for (int m = 1; m < ROUTE_METHOD_NUM; ++m)
+            result.allowed |= node.exact[m] != NULL ? 1u << m : 0;
+    }
+    if (prefix != NULL)
+    {
+        result.handler = prefix;
+        result.param_count = prefix_params;
+        result.rest = prefix_rest;
+        return ROUTE_FOUND;
+    }
+    return result.allowed != 0 ? ROUTE_METHOD_NOT_ALLOWED : ROUTE_NOT_FOUND;
+}
+
+const char *Router::methodName(int method)
+{
+    switch (method)
+    {
+    case METHOD_POST:
+        return "POST";
+    case METHOD_GET:
+        return "GET";
+    default:
+        return "";
+    }
+}
@@ -0,0 +1,256 @@
+#include "staticCache.h"
+#include "_cmpublic.h"
+#include "ioStats.h"
+#include "log.h"
+#include <limits.h>
+#include <sys/inotify.h>
+
+extern CLogFile logfile;
+
+StaticCache::Shard StaticCache::shards[STATIC_CACHE_SHARDS];
+std::unordered_map<int, std::string> StaticCache::watches;
+int StaticCache::inotify_fd = -1;
+std::atomic<bool> StaticCache::enabled(false);
+std::atomic<unsigned long> StaticCache::version(0);
+pthread_t StaticCache::watcher;
+
+int StaticCache::cache_init(const std::vector<std::string> &dirs)
+{
+    inotify_fd = inotify_init1(IN_CLOEXEC);
+    if (inotify_fd < 0)
+        return -1;
+    for (size_t i = 0; i < dirs.size(); ++i)
+    {
+        char real[PATH_MAX];
+        if (realpath(dirs[i].c_str(), real) == NULL)
+            continue;
+        int wd = inotify_add_watch(inotify_fd, real,
+                                   IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_CREATE | IN_DELETE |
+                                       IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF);
+        if (wd < 0)
+            continue;
+        watches[wd] = std::string(real) + "/";
+    }
+    if (watches.empty() || pthread_create(&watcher, NULL, watch_thread, NULL) != 0)
+    {
+        close(inotify_fd);
+        inotify_fd = -1;
+        watches.clear();
+        return -1;
+    }
+    pthread_detach(watcher);
+    enabled = true;
+    return 0;
+}
+
+StaticCache::Shard &StaticCache::getShard(const std::string &path)
+{
+    return shards[std::hash<std::string>()(path) % STATIC_CACHE_SHARDS];
+}
+
+size_t StaticCache::entrySize(const SP_Entry &entry)
+{
+    size_t size = entry->body->size() + entry->etag.size() + entry->real_path.size();
+    for (int i = 0; i < CONN_HEADER_NUM; ++i)
+        size += entry->headers[i]->size() + entry->not_modified[i]->size();
+    return size;
+}
+
+StaticCache::SP_Entry StaticCache::get(const std::string &path)
+{
+    if (!enabled)
+        return SP_Entry();
+    Shard &shard = getShard(path);
+    MutexLockGuard lock(shard.lock);
+    std::unordered_map<std::string, EntryList::iterator>::iterator it = shard.index.find(path);
+    if (it == shard.index.end())
+        return SP_Entry();
+    // 移到表头
+    shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+    return it->second->second;
+}
+
+unsigned long StaticCache::getVersion()
+{
+    return version.load();
+}
+
+// dir为以'/'结尾的绝对路径；watches只在cache_init中写入，之后只读
+bool StaticCache::isWatched(const std::string &dir)
+{
+    for (std::unordered_map<int, std::string>::iterator it = watches.begin(); it != watches.end(); ++it)
+    {
+        if (it->second == dir)
+            return true;
+    }
+    return false;
+}
+
+bool StaticCache::isStaticDir(const std::string &path)
+{
+    char real[PATH_MAX];
+    if (!enabled || realpath(path.c_str(), real) == NULL)
+        return false;
+    return isWatched(std::string(real) + "/");
+}
+
+StaticCache::SP_Entry StaticCache::put(const std::string &path, const OpenFileCache::SP_Info &info,
+                                       const std::string &content_header, const std::string &validator_header,
+                                       unsigned long _version)
+{
+    const struct stat &sbuf = info->sbuf;
+    if (!enabled || (size_t)sbuf.st_size > STATIC_CACHE_MAX_FILE)
+        return SP_Entry();
+    // inotify不递归监视子目录，只缓存直接位于被监视目录中的文件
+    char real[PATH_MAX];
+    if (realpath(path.c_str(), real) == NULL)
+        return SP_Entry();
+    std::string real_path(real);
+    if (!isWatched(real_path.substr(0, real_path.rfind('/') + 1)))
+        return SP_Entry();
+    // fd可能来自打开文件缓存，文件此后被替换或修改过时不缓存，避免旧内容在缓存中长期保留
+    struct stat cur;
+    IoStats::addSyscall();
+    if (stat(real, &cur) < 0 || cur.st_dev != sbuf.st_dev || cur.st_ino != sbuf.st_ino ||
+        cur.st_size != sbuf.st_size || cur.st_mtim.tv_sec != sbuf.st_mtim.tv_sec ||
+        cur.st_mtim.tv_nsec != sbuf.st_mtim.tv_nsec)
+        return SP_Entry();
+
+    std::string body(sbuf.st_size, '\0');
+    size_t nread = 0;
+    while (nread < body.size())
+    {
+        IoStats::addSyscall();
+        ssize_t n = pread(info->file->get(), &body[nread], body.size() - nread, nread);
+        if (n < 0 && errno == EINTR)
+            continue;
+        // 文件在读取期间被截断
+        if (n <= 0)
+            return SP_Entry();
+        nread += n;
+    }
+    std::shared_ptr<StaticEntry> entry(new StaticEntry());
+    for (int i = 0; i < CONN_HEADER_NUM; ++i)
+    {
+        entry->headers[i].reset(new std::string("HTTP/1.1 200 OK\r\n" + RequestData::connectionHeader(i) + content_header));
+        entry->not_modified[i].reset(new std::string("HTTP/1.1 304 Not Modified\r\n" + RequestData::connectionHeader(i) + validator_header + "\r\n"));
+    }
+    std::shared_ptr<std::string> content(new std::string());
+    content->swap(body);
+    entry->body = content;
+    entry->sbuf = sbuf;
+    entry->mime = info->mime;
+    entry->etag = RequestData::makeETag(sbuf);
+    entry->real_path = real_path;
+    entry->variant_validators = validator_header.substr(validator_header.find("\r\n") + 2);
+    for (int i = 0; i < ENCODING_NUM; ++i)
+    {
+        entry->variants[i].mime = &entry->mime;
+        entry->variants[i].validators = &entry->variant_validators;
+    }
+
+    Shard &shard = getShard(path);
+    MutexLockGuard lock(shard.lock);
+    // 打开文件之后目录中有文件发生变化，读到的内容可能已经过期，只用于本次响应
+    if (version.load() != _version)
+        return entry;
+    std::unordered_map<std::string, EntryList::iterator>::iterator it = shard.index.find(path);
+    if (it != shard.index.end())
+    {
+        shard.bytes -= entrySize(it->second->second);
+        shard.lru.erase(it->second);
+        shard.index.erase(it);
+    }
+    shard.lru.push_front(std::make_pair(path, SP_Entry(entry)));
+    shard.index[path] = shard.lru.begin();
+    shard.bytes += entrySize(entry);
+    // 超出本分片的预算时从表尾淘汰
+    while (shard.bytes > STATIC_CACHE_BUDGET / STATIC_CACHE_SHARDS && shard.lru.size() > 1)
+    {
+        shard.bytes -= entrySize(shard.lru.back().second);
+        shard.index.erase(shard.lru.back().first);
+        shard.lru.pop_back();
+    }
+    return entry;
+}
+
+// 同一个文件可能以不同的请求路径缓存了多项，按绝对路径逐一删除
+// 预压缩文件(.gz、.br)变化时同时删除原文件的缓存项，其中记录的压缩表示已经过期
+void StaticCache::invalidate(const std::string &real_path)
+{
+    ++version;
+    std::string original;
+    size_t len = real_path.size();
+    if (len > 3 && (real_path.compare(len - 3, 3, ".gz") == 0 || real_path.compare(len - 3, 3, ".br") == 0))
+        original = real_path.substr(0, len - 3);
+    for (int i = 0; i < STATIC_CACHE_SHARDS; ++i)
+    {
+        Shard &shard = shards[i];
+        MutexLockGuard lock(shard.lock);
+        for (EntryList::iterator it = shard.lru.begin(); it != shard.lru.end();)
+        {
+            if (it->second->real_path == real_path || (!original.empty() && it->second->real_path == original))
+            {
+                shard.bytes -= entrySize(it->second);
+                shard.index.erase(it->first);
+                it = shard.lru.erase(it);
+            }
+            else
+                ++it;
+        }
+    }
+}
+
+void StaticCache::invalidateAll()
+{
+    ++version;
+    for (int i = 0; i < STATIC_CACHE_SHARDS; ++i)
+    {
+        Shard &shard = shards[i];
+        MutexLockGuard lock(shard.lock);
+        shard.lru.clear();
+        shard.index.clear();
+        shard.bytes = 0;
+    }
+}
+
+// inotify线程：阻塞读取文件变化事件，使对应的缓存项失效
+void *StaticCache::watch_thread(void *)
+{
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    while (true)
+    {
+        ssize_t len = read(inotify_fd, buf, sizeof(buf));
+        if (len < 0 && errno == EINTR)
+            continue;
+        if (len <= 0)
+            break;
+        for (char *ptr = buf; ptr < buf + len;)
+        {
+            struct inotify_event *event = reinterpret_cast<struct inotify_event *>(ptr);
+            ptr += sizeof(struct inotify_event) + event->len;
+            // 事件队列溢出，无法确定哪些文件变化了
+            if (event->mask & IN_Q_OVERFLOW)
+            {
+                invalidateAll();
+                continue;
+            }
+            // 被监视的目录本身被删除或移动，之后收不到其中文件的变化，关闭缓存
+            if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED))
+            {
+                enabled = false;
+                invalidateAll();
+                continue;
+            }
+            std::unordered_map<int, std::string>::iterator it = watches.find(event->wd);
+            if (it != watches.end() && event->len > 0)
+                invalidate(it->second + event->name);
+        }
+    }
+    // 不再能收到文件变化通知，关闭缓存
+    enabled = false;
+    invalidateAll();
+    MutexLockGuard_LOG();
+    logfile.Write("static cache inotify read failed, cache disabled\n");
+    return NULL;
+}
@@ -0,0 +1,307 @@
+#include "taskQueue.h"
+
+TaskQueue::TaskQueue() : mask(0), enqueue_pos(0), dequeue_pos(0)
+{
+}
+
+void TaskQueue::init(size_t capacity)
+{
+    size_t size = 2;
+    while (size < capacity)
+        size <<= 1;
+    std::vector<Cell>(size).swap(cells);
+    for (size_t i = 0; i < size; ++i)
+        cells[i].sequence.store(i, std::memory_order_relaxed);
+    mask = size - 1;
+    enqueue_pos.store(0, std::memory_order_relaxed);
+    dequeue_pos.store(0, std::memory_order_relaxed);
+}
+
+bool TaskQueue::push(ThreadPoolTask &task)
+{
+    size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+    Cell *cell;
+    while (true)
+    {
+        cell = &cells[pos & mask];
+        size_t seq = cell->sequence.load(std::memory_order_acquire);
+        long diff = (long)seq - (long)pos;
+        if (diff == 0)
+        {
+            if (enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                break;
+        }
+        else if (diff < 0)
+            return false; /* 上一轮的任务还没有被取走 */
+        else
+            pos = enqueue_pos.load(std::memory_order_relaxed);
+    }
+    cell->task = std::move(task);
+    cell->sequence.store(pos + 1, std::memory_order_release);
+    return true;
+}
+
+size_t TaskQueue::pushBatch(ThreadPoolTask *tasks, size_t n)
+{
+    size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+    size_t count;
+    while (true)
+    {
+        // 从pos开始连续可写的单元个数；这些单元只有占到对应位置的生产者才能改动
+        count = 0;
+        while (count < n && count <= mask && cells[(pos + count) & mask].sequence.load(std::memory_order_acquire) == pos + count)
+            ++count;
+        if (count == 0)
+        {
+            size_t seq = cells[pos & mask].sequence.load(std::memory_order_acquire);
+            if ((long)seq - (long)pos < 0)
+                return 0; /* 队列满 */
+            pos = enqueue_pos.load(std::memory_order_relaxed);
+            continue;
+        }
+        if (enqueue_pos.compare_exchange_weak(pos, pos + count, std::memory_order_relaxed))
+            break;
+    }
+    for (size_t i = 0; i < count; ++i)
+    {
+        Cell &cell = cells[(pos + i) & mask];
+        cell.task = std::move(tasks[i]);
+        cell.sequence.store(pos + i + 1, std::memory_order_release);
+    }
+    return count;
+}
+
+bool TaskQueue::pop(ThreadPoolTask &task)
+{
+    size_t pos = dequeue_pos.load(std::memory_order_relaxed);
+    Cell *cell;
+    while (true)
+    {
+        cell = &cells[pos & mask];
+        size_t seq = cell->sequence.load(std::memory_order_acquire);
+        long diff = (long)seq - (long)(pos + 1);
+        if (diff == 0)
+        {
+            if (dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                break;
+        }
+        else if (diff < 0)
+            return false; /* 该位置还没有写入 */
+        else
+            pos = dequeue_pos.load(std::memory_order_relaxed);
+    }
+    task = std::move(cell->task);
+    cell->sequence.store(pos + mask + 1, std::memory_order_release);
+    return true;
+}
+
+size_t TaskQueue::capacity() const
+{
+    return mask + 1;
+}
+
+/*微基准：与原来加锁的环形队列(std::function + shared_ptr参数)对比入队出队的吞吐*/
+/*g++ -std=c++11 -O2 -pthread -DTASKQUEUE_BENCH -I include lib/taskQueue.cpp -o taskqueue_bench*/
+#ifdef TASKQUEUE_BENCH
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include <algorithm>
+#include <functional>
+#include <memory>
+
+static const int QUEUE_SIZE = 128;
+static long ops_per_producer = 1000000;
+static std::atomic<long> consumed(0);
+static std::atomic<long> checksum(0);
+
+static void work(std::shared_ptr<void> arg)
+{
+    checksum.fetch_add(*static_cast<int *>(arg.get()), std::memory_order_relaxed);
+}
+
+// 原线程池的队列：一把锁，入队广播queue_not_empty
+struct MutexQueue
+{
+    struct Task
+    {
+        std::function<void(std::shared_ptr<void>)> fun;
+        std::shared_ptr<void> args;
+    };
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty, not_full;
+    std::vector<Task> queue;
+    int front, rear, size;
+    MutexQueue() : queue(QUEUE_SIZE), front(0), rear(0), size(0)
+    {
+        pthread_mutex_init(&lock, NULL);
+        pthread_cond_init(&not_empty, NULL);
+        pthread_cond_init(&not_full, NULL);
+    }
+    void push(std::shared_ptr<void> args, std::function<void(std::shared_ptr<void>)> fun)
+    {
+        pthread_mutex_lock(&lock);
+        while (size == QUEUE_SIZE)
+            pthread_cond_wait(&not_full, &lock);
+        queue[rear].fun = fun;
+        queue[rear].args = args;
+        rear = (rear + 1) % QUEUE_SIZE;
+        size++;
+        pthread_cond_broadcast(&not_empty);
+        pthread_mutex_unlock(&lock);
+    }
+    bool pop(Task &task)
+    {
+        pthread_mutex_lock(&lock);
+        while (size == 0 && consumed.load() < total())
+            pthread_cond_wait(&not_empty, &lock);
+        if (size == 0)
+        {
+            pthread_mutex_unlock(&lock);
+            return false;
+        }
+        task.fun = queue[front].fun;
+        task.args = queue[front].args;
+        queue[front].args.reset();
+        front = (front + 1) % QUEUE_SIZE;
+        size--;
+        pthread_cond_broadcast(&not_full);
+        pthread_mutex_unlock(&lock);
+        return true;
+    }
+    static long total();
+};
+
+struct Call
+{
+    void (*fun)(std::shared_ptr<void>);
+    std::shared_ptr<void> args;
+    void operator()()
+    {
+        fun(std::move(args));
+    }
+};
+
+static int producers = 1, consumers = 4;
+long MutexQueue::total()
+{
+    return ops_per_producer * producers;
+}
+static MutexQueue mutex_queue;
+static TaskQueue task_queue;
+static std::shared_ptr<void> shared_arg(new int(1));
+
+static void *mutexProducer(void *)
+{
+    for (long i = 0; i < ops_per_producer; ++i)
+        mutex_queue.push(shared_arg, work);
+    return NULL;
+}
+
+static void *mutexConsumer(void *)
+{
+    MutexQueue::Task task;
+    while (mutex_queue.pop(task))
+    {
+        task.fun(task.args);
+        task.args.reset();
+        if (consumed.fetch_add(1) + 1 == MutexQueue::total())
+        {
+            pthread_mutex_lock(&mutex_queue.lock);
+            pthread_cond_broadcast(&mutex_queue.not_empty);
+            pthread_mutex_unlock(&mutex_queue.lock);
+        }
+    }
+    return NULL;
+}
+
+static void *ringProducer(void *)
+{
+    for (long i = 0; i < ops_per_producer; ++i)
+    {
+        Call call = {work, shared_arg};
+        ThreadPoolTask task(std::move(call));
+        while (!task_queue.push(task))
+            sched_yield();
+    }
+    return NULL;
+}
+
+static void *batchProducer(void *)
+{
+    const size_t BATCH = 8;
+    ThreadPoolTask tasks[BATCH];
+    for (long i = 0; i < ops_per_producer; i += BATCH)
+    {
+        size_t n = std::min((long)BATCH, ops_per_producer - i);
+        for (size_t k = 0; k < n; ++k)
+        {
+            Call call = {work, shared_arg};
+            tasks[k] = ThreadPoolTask(std::move(call));
+        }
+        for (size_t done = 0; done < n;)
+        {
+            size_t pushed = task_queue.pushBatch(tasks + done, n - done);
+            if (pushed == 0)
+                sched_yield();
+            done += pushed;
+        }
+    }
+    return NULL;
+}
+
+static void *ringConsumer(void *)
+{
+    ThreadPoolTask task;
+    while (consumed.load(std::memory_order_relaxed) < MutexQueue::total())
+    {
+        if (!task_queue.pop(task))
+        {
+            sched_yield();
+            continue;
+        }
+        task();
+        task.reset();
+        consumed.fetch_add(1);
+    }
+    return NULL;
+}
+
+static double run(void *(*producer)(void *), void *(*consumer)(void *))
+{
+    consumed = 0;
+    checksum = 0;
+    std::vector<pthread_t> tids(producers + consumers);
+    struct timeval begin, end;
+    gettimeofday(&begin, NULL);
+    for (int i = 0; i < producers + consumers; ++i)
+        pthread_create(&tids[i], NULL, i < producers ? producer : consumer, NULL);
+    for (size_t i = 0; i < tids.size(); ++i)
+        pthread_join(tids[i], NULL);
+    gettimeofday(&end, NULL);
+    if (checksum.load() != MutexQueue::total())
+        printf("checksum mismatch %ld\n", checksum.load());
+    return (end.tv_sec - begin.tv_sec) + (end.tv_usec - begin.tv_usec) / 1e6;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc > 1)
+        producers = atoi(argv[1]);
+    if (argc > 2)
+        consumers = atoi(argv[2]);
+    if (argc > 3)
+        ops_per_producer = atol(argv[3]);
+    task_queue.init(QUEUE_SIZE);
+    printf("sizeof(ThreadPoolTask) %zu, producers %d, consumers %d, tasks %ld\n", sizeof(ThreadPoolTask), producers, consumers, MutexQueue::total());
+    double t1 = run(mutexProducer, mutexConsumer);
+    printf("mutex ring + std::function: %.3fs, %.0f ns/task\n", t1, t1 * 1e9 / MutexQueue::total());
+    double t2 = run(ringProducer, ringConsumer);
+    printf("lock-free TaskQueue:        %.3fs, %.0f ns/task\n", t2, t2 * 1e9 / MutexQueue::total());
+    double t3 = run(batchProducer, ringConsumer);
+    printf("lock-free TaskQueue, batch: %.3fs, %.0f ns/task\n", t3, t3 * 1e9 / MutexQueue::total());
+    return 0;
+}
+#endif
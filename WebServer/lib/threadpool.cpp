@@ -1,36 +1,69 @@
 #include "threadpool.h"
 #include "HttpRequestData.h"
 #include "_cmpublic.h"
+#include "ioStats.h"
+#include "log.h"
+#include <math.h>
+#include <algorithm>
+#include <sched.h>
 
-#define DEFAULT_TIME 10        /*10s检测一次*/
-#define MIN_WAIT_TASK_NUM 10   /*如果queue_size > MIN_WAIT_TASK_NUM 添加新的线程到线程池*/
-#define DEFAULT_THREAD_VARY 10 /*每次创建和销毁线程的个数*/
+extern CLogFile logfile;
+
+#define ADJUST_INTERVAL_MS 10   /*管理线程每10ms调整一次线程数*/
+#define TARGET_UTILIZATION 0.8  /*线程的目标利用率，留出余量应对突发*/
+#define TARGET_QUEUE_WAIT_MS 5  /*队列中积压的任务在5ms内处理完*/
+#define SHRINK_DELAY_MS 1000    /*需要的线程数持续低于当前线程数1s后才减少，避免突发流量下反复创建销毁*/
+#define EWMA_ALPHA 0.3          /*到达速率、处理时间、积压数的指数平均系数*/
+#define WORKER_QUEUE_SIZE 32    /*每个工作线程自己的队列可容纳的任务数*/
 
 /* 初始化互斥琐、条件变量 */
 pthread_mutex_t ThreadPool::lock = PTHREAD_MUTEX_INITIALIZER;
-pthread_mutex_t ThreadPool::thread_counter = PTHREAD_MUTEX_INITIALIZER;
 pthread_cond_t ThreadPool::queue_not_full = PTHREAD_COND_INITIALIZER;
-pthread_cond_t ThreadPool::queue_not_empty = PTHREAD_COND_INITIALIZER;
+pthread_mutex_t ThreadPool::idle_lock = PTHREAD_MUTEX_INITIALIZER;
 
 std::vector<pthread_t> ThreadPool::threads;
 pthread_t ThreadPool::adjust_tid = 0;
-std::vector<ThreadPoolTask> ThreadPool::queue;
 
 int ThreadPool::min_thr_num = 0;
 int ThreadPool::max_thr_num = 0;
 int ThreadPool::live_thr_num = 0;
-int ThreadPool::busy_thr_num = 0;
-int ThreadPool::wait_exit_thr_num = 0;
-
-int ThreadPool::queue_front = 0;
-int ThreadPool::queue_rear = 0;
-int ThreadPool::queue_size = 0;
+std::atomic<int> ThreadPool::busy_thr_num(0);
+std::atomic<int> ThreadPool::wait_exit_thr_num(0);
+
+TaskQueue ThreadPool::queue;
+std::vector<ThreadPoolWorker> ThreadPool::workers;
+std::vector<int> ThreadPool::idle_workers;
+std::atomic<int> ThreadPool::idle_num(0);
+std::atomic<int> ThreadPool::queue_size(0);
+std::atomic<unsigned> ThreadPool::next_worker(0);
+std::atomic<int> ThreadPool::worker_span(0);
 int ThreadPool::queue_max_size = 0;
 
 int ThreadPool::shutdown = 0;  /* 不关闭线程池 */
 
+int ThreadPool::overload_policy = OVERLOAD_BLOCK;
+std::atomic<unsigned long> ThreadPool::overload_blocked(0);
+std::atomic<unsigned long> ThreadPool::overload_rejected(0);
+std::atomic<unsigned long> ThreadPool::overload_inline(0);
+std::atomic<unsigned long> ThreadPool::overload_shed(0);
+unsigned long ThreadPool::last_overloads = 0;
+
+std::atomic<unsigned long> ThreadPool::arrivals(0);
+int ThreadPool::target_thr_num = 0;
+double ThreadPool::arrival_rate = 0;
+double ThreadPool::service_time = 0;
+double ThreadPool::queue_wait = 0;
+unsigned long ThreadPool::grow_times = 0;
+unsigned long ThreadPool::shrink_times = 0;
+unsigned long ThreadPool::threads_added = 0;
+unsigned long ThreadPool::threads_retired = 0;
+unsigned long ThreadPool::last_report_arrivals = 0;
+
+/* 当前线程在workers中的下标，不是工作线程时为-1 */
+static thread_local int worker_index = -1;
+
 // 线程池的创建
-int ThreadPool::threadpool_create(int _min_thr_num, int _max_thr_num, int _queue_max_size)
+int ThreadPool::threadpool_create(int _min_thr_num, int _max_thr_num, int _queue_max_size, int _overload_policy)
 {
     int i;
     do
@@ -38,13 +71,33 @@ int ThreadPool::threadpool_create(int _min_thr_num, int _max_thr_num, int _queue
         min_thr_num = _min_thr_num;
         max_thr_num = _max_thr_num;
         live_thr_num = _min_thr_num; /* 活着的线程数 初值=最小线程数 */
+        target_thr_num = _min_thr_num;
         queue_max_size = _queue_max_size;
+        overload_policy = _overload_policy;
 
         /* 根据最大线程上限数， 给工作线程数组开辟空间, 并清零 */
         threads.resize(_max_thr_num);
 
-        /* 队列开辟空间 */
-        queue.resize(_queue_max_size);
+        /* 全局队列的容量大于任务数上限，占到位置的添加者一定能入队 */
+        queue.init(_queue_max_size + 1);
+
+        /* 每个线程槽位一个任务队列，之后不再扩容 */
+        std::vector<ThreadPoolWorker>(_max_thr_num).swap(workers);
+        idle_workers.reserve(_max_thr_num);
+        for (i = 0; i < max_thr_num; i++)
+        {
+            pthread_mutex_init(&workers[i].lock, NULL);
+            pthread_cond_init(&workers[i].wakeup, NULL);
+            std::vector<ThreadPoolTask>(WORKER_QUEUE_SIZE).swap(workers[i].tasks);
+            workers[i].head = 0;
+            workers[i].size = 0;
+            workers[i].completed = 0;
+            workers[i].service_ns = 0;
+            workers[i].alive = (i < min_thr_num);
+            workers[i].notified = false;
+            workers[i].idle = false;
+        }
+        worker_span = min_thr_num;
 
         // 设置线程为分离状态
         pthread_attr_t attr;
@@ -54,7 +107,7 @@ int ThreadPool::threadpool_create(int _min_thr_num, int _max_thr_num, int _queue
         /* 启动 min_thr_num 个 work thread */
         for (i = 0; i < min_thr_num; i++)
         {
-            if (pthread_create(&threads[i], &attr, threadpool_thread, (void *)(0)) != 0) /*pool指向当前线程池*/
+            if (pthread_create(&threads[i], &attr, threadpool_thread, (void *)(long)i) != 0) /*参数为线程的槽位下标*/
             {
                 // threadpool_destroy(pool);
                 return -1;
@@ -81,260 +134,672 @@ void myHandler(std::shared_ptr<void> req)
     else if (request->canRead())
         request->handleRead();
     request->handleConn();
+    IoStats::flush();
 }
 
-/* 向线程池中 添加一个任务，args传给function */
-int ThreadPool::threadpool_add(std::shared_ptr<void> args, std::function<void(std::shared_ptr<void>)> fun)
+void myReject(std::shared_ptr<void> req)
 {
-    int err = 0;
-    if (pthread_mutex_lock(&lock) != 0)
+    std::shared_ptr<RequestData> request = std::static_pointer_cast<RequestData>(req);
+    request->rejectOverload();
+    IoStats::flush();
+}
+
+// 放入index的队列，槽位上的线程已退出或队列满时返回false
+bool ThreadPool::pushLocal(int index, ThreadPoolTask &task)
+{
+    ThreadPoolWorker &worker = workers[index];
+    pthread_mutex_lock(&worker.lock);
+    int size = worker.size;
+    if (!worker.alive || size == WORKER_QUEUE_SIZE)
     {
-        return THREADPOOL_LOCK_FAILURE;
+        pthread_mutex_unlock(&worker.lock);
+        return false;
     }
+    worker.tasks[(worker.head + size) % WORKER_QUEUE_SIZE] = std::move(task);
+    worker.size = size + 1;
+    pthread_mutex_unlock(&worker.lock);
+    return true;
+}
 
-    /* ==为真，队列已经满， 调wait阻塞 */
-    while ((queue_size == queue_max_size) && !shutdown)
+// 从k的队列取一个任务，k为当前线程index时取队尾，否则取队头
+bool ThreadPool::popLocal(int index, int k, ThreadPoolTask &task)
+{
+    ThreadPoolWorker &worker = workers[k];
+    if (worker.size == 0)
     {
-        if (pthread_cond_wait(&queue_not_full, &lock) != 0)
+        return false;
+    }
+    bool found = false;
+    pthread_mutex_lock(&worker.lock);
+    int size = worker.size;
+    if (size > 0)
+    {
+        if (k == index)
         {
-            err = THREADPOOL_LOCK_FAILURE;
-            break;
+            task = std::move(worker.tasks[(worker.head + size - 1) % WORKER_QUEUE_SIZE]);
+        }
+        else
+        {
+            task = std::move(worker.tasks[worker.head]);
+            worker.head = (worker.head + 1) % WORKER_QUEUE_SIZE;
         }
+        worker.size = size - 1;
+        found = true;
     }
-    if (shutdown)
+    pthread_mutex_unlock(&worker.lock);
+    return found;
+}
+
+// 从其他线程的队头窃取一个任务，index不是工作线程时为-1
+bool ThreadPool::stealTask(int index, ThreadPoolTask &task)
+{
+    int span = worker_span.load();
+    for (int i = 1; i <= span; i++)
     {
-        if (pthread_mutex_unlock(&lock) != 0)
+        int k = (index + i) % span;
+        if (k != index && popLocal(index, k, task))
         {
-            return THREADPOOL_LOCK_FAILURE;
+            return true;
         }
-        return THREADPOOL_SHUTDOWN;
     }
+    return false;
+}
 
-    // /* 清空工作线程调用的回调函数 的参数arg */
-    // if (pool->task_queue[pool->queue_rear].arg != NULL)
-    // {
-    //     free(pool->task_queue[pool->queue_rear].arg);
-    //     pool->task_queue[pool->queue_rear].arg = NULL;
-    // }
-    /*添加任务到任务队列里*/
-    queue[queue_rear].fun = fun;
-    queue[queue_rear].args = args;
-    queue_rear = (queue_rear + 1) % queue_max_size; /* 队尾指针移动, 模拟环形 */
-    queue_size++;
+// 依次从自己的队尾、全局队列、其他线程的队头取任务
+bool ThreadPool::takeTask(int index, ThreadPoolTask &task)
+{
+    bool found = popLocal(index, index, task) || queue.pop(task) || stealTask(index, task);
+    if (found)
+    {
+        releaseSlot();
+    }
+    return found;
+}
 
-    /*添加完任务后，队列不为空，唤醒线程池中 等待处理任务的线程*/
-    if ((pthread_cond_broadcast(&queue_not_empty) != 0) || (pthread_mutex_unlock(&lock) != 0))
+// 任务出队后释放占用的位置
+void ThreadPool::releaseSlot()
+{
+    /*队列从满变为不满，通知阻塞的添加者*/
+    if (queue_size.fetch_sub(1) == queue_max_size)
     {
-        err = THREADPOOL_LOCK_FAILURE;
+        pthread_mutex_lock(&lock);
+        pthread_cond_broadcast(&queue_not_full);
+        pthread_mutex_unlock(&lock);
     }
-    return err;
 }
 
-/* 线程池中各个工作线程 */
-void *ThreadPool::threadpool_thread(void *args)
+void ThreadPool::notifyWorker(int index)
 {
-    int err = 0;
+    ThreadPoolWorker &worker = workers[index];
+    pthread_mutex_lock(&worker.lock);
+    worker.notified = true;
+    pthread_cond_signal(&worker.wakeup);
+    pthread_mutex_unlock(&worker.lock);
+}
 
-    while (true)
+// 从空闲列表取出最多n个线程放入picked，只加一次锁；取出的线程必须随后用notifyWorker唤醒
+void ThreadPool::popIdle(int n, std::vector<int> &picked)
+{
+    picked.clear();
+    if (n <= 0 || idle_num.load() == 0)
+        return;
+    pthread_mutex_lock(&idle_lock);
+    while ((int)picked.size() < n && !idle_workers.empty())
+    {
+        int index = idle_workers.back();
+        idle_workers.pop_back();
+        workers[index].idle = false;
+        picked.push_back(index);
+    }
+    idle_num.fetch_sub(picked.size());
+    pthread_mutex_unlock(&idle_lock);
+}
+
+// 唤醒最多n个空闲线程，返回唤醒的个数
+int ThreadPool::wakeIdle(int n)
+{
+    static thread_local std::vector<int> picked;
+    popIdle(n, picked);
+    for (size_t i = 0; i < picked.size(); i++)
+    {
+        notifyWorker(picked[i]);
+    }
+    return picked.size();
+}
+
+void ThreadPool::pushIdle(int index)
+{
+    pthread_mutex_lock(&idle_lock);
+    if (!workers[index].idle)
+    {
+        workers[index].idle = true;
+        idle_workers.push_back(index);
+        idle_num.fetch_add(1);
+    }
+    pthread_mutex_unlock(&idle_lock);
+}
+
+void ThreadPool::removeIdle(int index)
+{
+    pthread_mutex_lock(&idle_lock);
+    if (workers[index].idle)
+    {
+        workers[index].idle = false;
+        idle_workers.erase(std::find(idle_workers.begin(), idle_workers.end(), index));
+        idle_num.fetch_sub(1);
+    }
+    pthread_mutex_unlock(&idle_lock);
+}
+
+// 调用fun(args)的任务，执行时把args移交给fun，取消时移交给reject
+struct HandlerCall
+{
+    void (*fun)(std::shared_ptr<void>);
+    void (*reject)(std::shared_ptr<void>);
+    std::shared_ptr<void> args;
+    void operator()()
+    {
+        fun(std::move(args));
+    }
+    void cancel()
+    {
+        if (reject != NULL)
+            reject(std::move(args));
+    }
+};
+
+// 不阻塞地占用一个位置，队列已满时返回false
+bool ThreadPool::reserveSlot()
+{
+    int size = queue_size.load();
+    while (size < queue_max_size)
+    {
+        if (queue_size.compare_exchange_weak(size, size + 1))
+            return true;
+    }
+    return false;
+}
+
+// 阻塞直到占用一个位置
+int ThreadPool::waitSlot()
+{
+    while (!reserveSlot())
     {
-        ThreadPoolTask task;
-        /* Lock must be taken to wait on conditional variable */
-        /*刚创建出线程，等待任务队列里有任务，否则阻塞等待任务队列里有任务后再唤醒接收任务*/
         if (pthread_mutex_lock(&lock) != 0)
         {
-            break;
+            return THREADPOOL_LOCK_FAILURE;
         }
-
-        /*queue_size == 0 说明没有任务，调 wait 阻塞在条件变量上, 若有任务，跳过该while*/
-        while ((queue_size == 0) && !shutdown)
+        while (queue_size.load() >= queue_max_size && !shutdown)
         {
-            // printf("thread 0x%x is waiting\n", (unsigned int)pthread_self());
-            if (pthread_cond_wait(&queue_not_empty, &lock) != 0)
-            {
-                err = THREADPOOL_LOCK_FAILURE;
-                break;
-            }
-
-            // 阻塞的线程为空闲的线程
-            /*清除指定数目的空闲线程，如果要结束的线程个数大于0，结束线程*/
-            if (wait_exit_thr_num > 0)
+            if (pthread_cond_wait(&queue_not_full, &lock) != 0)
             {
-                /*如果线程池里线程个数大于最小值时可以结束当前线程*/
-                if (live_thr_num > min_thr_num)
-                {
-                    wait_exit_thr_num--;
-                    // printf("thread 0x%x is exiting\n", (unsigned int)pthread_self());
-                    int k = 0;
-                    for (k = 0; k < max_thr_num; k++)
-                    {
-                        if (pthread_self() == threads[k])
-                        {
-                            break;
-                        }
-                    }
-                    memset(&threads[k], 0x00, sizeof(pthread_t));
-                    live_thr_num--;
-                    if (pthread_mutex_unlock(&lock) != 0)
-                    {
-                        err = THREADPOOL_LOCK_FAILURE;
-                        break;
-                    }
-                    pthread_exit(NULL);
-                }
+                pthread_mutex_unlock(&lock);
+                return THREADPOOL_LOCK_FAILURE;
             }
         }
-        if (err != 0)
+        if (pthread_mutex_unlock(&lock) != 0)
         {
-            break;
+            return THREADPOOL_LOCK_FAILURE;
         }
-        /*如果指定了true，要关闭线程池里的每个线程，自行退出处理*/
         if (shutdown)
         {
-            if (pthread_mutex_unlock(&lock) != 0)
-            {
-                break;
-            }
-            // printf("thread 0x%x is exiting\n", (unsigned int)pthread_self());
-            pthread_exit(NULL); /* 线程自行结束 */
+            return THREADPOOL_SHUTDOWN;
         }
+    }
+    return 0;
+}
 
-        /*从任务队列里获取任务, 是一个出队操作*/
-        task.fun = queue[queue_front].fun;
-        task.args = queue[queue_front].args;
-
-        queue_front = (queue_front + 1) % queue_max_size; /* 出队，模拟环形队列 */
-        queue_size--;
+// 放入一个已占到位置的任务
+void ThreadPool::enqueue(ThreadPoolTask &task)
+{
+    dispatch(&task, 1);
+}
 
-        /*通知可以有新的任务添加进来*/
-        /*任务取出后，立即将 线程池琐 释放*/
-        if ((pthread_cond_broadcast(&queue_not_full) != 0) || (pthread_mutex_unlock(&lock) != 0))
+// 放入count个已占到位置的任务
+void ThreadPool::dispatch(ThreadPoolTask *tasks, int count)
+{
+    /*有空闲线程时每个空闲线程直接放入一个任务，并只唤醒这些线程*/
+    static thread_local std::vector<int> picked;
+    int done = 0;
+    popIdle(count, picked);
+    for (size_t i = 0; i < picked.size(); i++)
+    {
+        if (pushLocal(picked[i], tasks[done]))
         {
-            break;
+            done++;
         }
+        notifyWorker(picked[i]);
+    }
+    int direct = done;
 
-        /*执行任务*/
-        // printf("thread 0x%x start working\n", (unsigned int)pthread_self());
-        if (pthread_mutex_lock(&thread_counter) != 0) /*忙状态线程数变量琐*/
+    /*工作线程自己添加的任务放入自己的队列，epoll线程添加的轮流放入各线程的队列*/
+    if (worker_index >= 0)
+    {
+        while (done < count && pushLocal(worker_index, tasks[done]))
         {
-            break;
+            done++;
         }
-        busy_thr_num++; /*忙状态线程数+1*/
-        if (pthread_mutex_unlock(&thread_counter) != 0)
+    }
+    int span = worker_span.load();
+    while (done < count && worker_index < 0 && span > 0)
+    {
+        int tries = 0;
+        while (tries < span && !pushLocal(next_worker.fetch_add(1, std::memory_order_relaxed) % span, tasks[done]))
         {
-            break;
+            tries++;
         }
-        (task.fun)(task.args); /*执行回调函数任务*/
-
-        /*任务结束处理*/
-        // printf("thread 0x%x end working\n", (unsigned int)pthread_self());
-        if (pthread_mutex_lock(&thread_counter) != 0)
+        if (tries == span)
         {
             break;
         }
-        busy_thr_num--; /*处理掉一个任务，忙状态数线程数-1*/
-        if (pthread_mutex_unlock(&thread_counter) != 0)
+        done++;
+    }
+
+    /*各线程的队列都放不下的任务一次放入全局队列；已占到位置，入队失败只可能是出队的线程还没有把单元放回，稍等即可*/
+    while (done < count)
+    {
+        int pushed = queue.pushBatch(tasks + done, count - done);
+        if (pushed == 0)
         {
-            break;
+            sched_yield();
         }
+        done += pushed;
     }
 
-    pthread_exit(NULL);
+    arrivals.fetch_add(count, std::memory_order_relaxed);
+
+    /*放入忙碌线程队列的任务：与工作线程登记空闲之后的检查配对，两边至少有一边能看到对方，此时空闲下来的线程被唤醒来窃取*/
+    if (count > direct)
+    {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        wakeIdle(count - direct);
+    }
 }
 
-/* 管理线程 */
-void *ThreadPool::adjust_thread(void *args)
+ThreadPoolTask ThreadPool::threadpool_task(std::shared_ptr<void> args, void (*fun)(std::shared_ptr<void>), void (*reject)(std::shared_ptr<void>))
 {
-    int i, err = 0;
-    while (!shutdown)
+    HandlerCall call = {fun, reject, std::move(args)};
+    return ThreadPoolTask(std::move(call));
+}
+
+/* 向线程池中 添加一个任务，args传给function */
+int ThreadPool::threadpool_add(std::shared_ptr<void> args, void (*fun)(std::shared_ptr<void>), void (*reject)(std::shared_ptr<void>))
+{
+    return threadpool_add(threadpool_task(std::move(args), fun, reject));
+}
+
+int ThreadPool::threadpool_try_add(ThreadPoolTask &&task)
+{
+    if (shutdown)
+    {
+        return THREADPOOL_SHUTDOWN;
+    }
+    if (!reserveSlot())
     {
+        return THREADPOOL_QUEUE_FULL;
+    }
+    enqueue(task);
+    return 0;
+}
 
-        sleep(DEFAULT_TIME); /*定时 对线程池管理*/
+int ThreadPool::threadpool_add(ThreadPoolTask &&task)
+{
+    int err = threadpool_try_add(std::move(task));
+    if (err != THREADPOOL_QUEUE_FULL)
+    {
+        return err;
+    }
 
-        if (pthread_mutex_lock(&lock) != 0)
+    /* 队列已满，按过载策略处理，调用者(epoll线程)只有OVERLOAD_BLOCK时才会阻塞 */
+    ThreadPoolTask oldest;
+    switch (overload_policy)
+    {
+    case OVERLOAD_REJECT:
+        overload_rejected.fetch_add(1, std::memory_order_relaxed);
+        task.cancel();
+        return THREADPOOL_REJECTED;
+    case OVERLOAD_INLINE:
+        overload_inline.fetch_add(1, std::memory_order_relaxed);
+        runTask(task);
+        return 0;
+    case OVERLOAD_SHED_OLDEST:
+        /*取出的任务占的位置直接给新任务：先取全局队列中的，再取各线程队头的；任务都已被工作线程取走时改为拒绝新任务*/
+        if (!queue.pop(oldest) && !stealTask(-1, oldest))
         {
-            err = THREADPOOL_LOCK_FAILURE;
-            break;
+            overload_rejected.fetch_add(1, std::memory_order_relaxed);
+            task.cancel();
+            return THREADPOOL_REJECTED;
         }
-        int _queue_size = queue_size;     /* 关注 任务数 */
-        int _live_thr_num = live_thr_num; /* 存活 线程数 */
-        if (pthread_mutex_unlock(&lock) != 0)
+        overload_shed.fetch_add(1, std::memory_order_relaxed);
+        enqueue(task);
+        oldest.cancel();
+        return 0;
+    default:
+        overload_blocked.fetch_add(1, std::memory_order_relaxed);
+        err = waitSlot();
+        if (err != 0)
         {
-            err = THREADPOOL_LOCK_FAILURE;
-            break;
+            return err;
         }
+        enqueue(task);
+        return 0;
+    }
+}
 
-        if (pthread_mutex_lock(&thread_counter) != 0)
-        {
-            err = THREADPOOL_LOCK_FAILURE;
+int ThreadPool::threadpool_add_batch(ThreadPoolTask *tasks, int n)
+{
+    if (shutdown)
+    {
+        return THREADPOOL_SHUTDOWN;
+    }
+
+    /* 一次CAS为尽可能多的任务占用位置 */
+    int size = queue_size.load();
+    int count = 0;
+    while (size < queue_max_size)
+    {
+        count = std::min(n, queue_max_size - size);
+        if (queue_size.compare_exchange_weak(size, size + count))
             break;
+        count = 0;
+    }
+
+    /*占到位置的任务一次分配到各队列*/
+    if (count > 0)
+    {
+        dispatch(tasks, count);
+    }
+
+    /*队列放不下的任务逐个按过载策略处理*/
+    int rejected = 0;
+    for (int i = count; i < n; i++)
+    {
+        int err = threadpool_add(std::move(tasks[i]));
+        if (err == THREADPOOL_REJECTED)
+        {
+            rejected++;
         }
-        int _busy_thr_num = busy_thr_num; /* 忙着的线程数 */
-        if (pthread_mutex_unlock(&thread_counter) != 0)
+        else if (err < 0)
         {
-            err = THREADPOOL_LOCK_FAILURE;
-            break;
+            return err;
         }
+    }
+    return rejected;
+}
+
+static unsigned long long monotonicNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void ThreadPool::runTask(ThreadPoolTask &task)
+{
+    busy_thr_num.fetch_add(1); /*忙状态线程数+1*/
+    unsigned long long begin = monotonicNs();
+    task(); /*执行回调函数任务*/
+    task.reset();
+    /*工作线程记录处理时间，供管理线程估计需要的线程数；过载时在添加者线程中执行的任务不计入*/
+    if (worker_index >= 0)
+    {
+        ThreadPoolWorker &worker = workers[worker_index];
+        worker.service_ns.fetch_add(monotonicNs() - begin, std::memory_order_relaxed);
+        worker.completed.fetch_add(1, std::memory_order_relaxed);
+    }
+    busy_thr_num.fetch_sub(1); /*处理掉一个任务，忙状态数线程数-1*/
+}
 
-        /* 创建新线程 算法： 当前任务数大于最小任务数, 且存活的线程数少于最大线程个数时 如：30>=10 && 40<100*/
-        if (_queue_size >= MIN_WAIT_TASK_NUM && _live_thr_num < max_thr_num)
+/*清除指定数目的空闲线程，如果要结束的线程个数大于0，且线程池里线程个数大于最小值时结束当前线程*/
+bool ThreadPool::tryExit(int index)
+{
+    /*每次没有任务可做时都会检查，不需要退出时不加锁*/
+    if (wait_exit_thr_num.load(std::memory_order_relaxed) <= 0)
+    {
+        return false;
+    }
+    pthread_mutex_lock(&lock);
+    if (wait_exit_thr_num <= 0 || live_thr_num <= min_thr_num)
+    {
+        pthread_mutex_unlock(&lock);
+        return false;
+    }
+    wait_exit_thr_num--;
+    live_thr_num--;
+    threads_retired++;
+    /*槽位不再接收任务，已放入的任务由本线程处理完再退出；持有lock时管理线程不会复用该槽位*/
+    ThreadPoolWorker &worker = workers[index];
+    std::vector<ThreadPoolTask> left;
+    pthread_mutex_lock(&worker.lock);
+    worker.alive = false;
+    for (; worker.size > 0; worker.size--)
+    {
+        left.push_back(std::move(worker.tasks[worker.head]));
+        worker.head = (worker.head + 1) % WORKER_QUEUE_SIZE;
+    }
+    pthread_mutex_unlock(&worker.lock);
+    updateSpan();
+    memset(&threads[index], 0x00, sizeof(pthread_t));
+    pthread_mutex_unlock(&lock);
+    for (size_t i = 0; i < left.size(); i++)
+    {
+        releaseSlot();
+        runTask(left[i]);
+    }
+    // printf("thread 0x%x is exiting\n", (unsigned int)pthread_self());
+    return true;
+}
+
+/* 线程池中各个工作线程 */
+void *ThreadPool::threadpool_thread(void *args)
+{
+    int index = (int)(long)args;
+    worker_index = index;
+    ThreadPoolWorker &worker = workers[index];
+
+    while (!shutdown)
+    {
+        ThreadPoolTask task;
+        if (!takeTask(index, task))
         {
-            if (pthread_mutex_lock(&lock) != 0)
+            /*没有任务可做时才退出，被唤醒来处理任务的线程不会带着未处理的任务退出*/
+            if (tryExit(index))
             {
-                err = THREADPOOL_LOCK_FAILURE;
-                break;
+                pthread_exit(NULL);
             }
-            int add = 0;
-
-            /*一次增加 DEFAULT_THREAD_VARY个线程*/
-            // i < pool->max_thr_num防止越界
-            // 设置线程为分离状态
-            pthread_attr_t attr;
-            pthread_attr_init(&attr);
-            pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
-            for (i = 0; i < max_thr_num && add < DEFAULT_THREAD_VARY && live_thr_num < max_thr_num; i++)
+            /*先登记为空闲再检查一遍队列：检查之后添加的任务一定能看到本线程空闲并唤醒它*/
+            pthread_mutex_lock(&worker.lock);
+            worker.notified = false;
+            pthread_mutex_unlock(&worker.lock);
+            pushIdle(index);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (!takeTask(index, task))
             {
-                if (threads[i] == 0 || !is_thread_alive(threads[i]))
+                pthread_mutex_lock(&worker.lock);
+                while (!worker.notified && !shutdown)
                 {
-                    if (pthread_create(&threads[i], &attr, threadpool_thread, (void *)(0)) != 0)
-                    {
-                        // threadpool_destroy(pool);
-                        return NULL;
-                    }
-                    add++;
-                    live_thr_num++;
+                    pthread_cond_wait(&worker.wakeup, &worker.lock);
                 }
+                worker.notified = false;
+                pthread_mutex_unlock(&worker.lock);
+                removeIdle(index);
+                continue;
             }
+            removeIdle(index);
+        }
+
+        /*执行任务*/
+        // printf("thread 0x%x start working\n", (unsigned int)pthread_self());
+        runTask(task);
+        // printf("thread 0x%x end working\n", (unsigned int)pthread_self());
+    }
+
+    /*如果指定了true，要关闭线程池里的每个线程，自行退出处理*/
+    // printf("thread 0x%x is exiting\n", (unsigned int)pthread_self());
+    pthread_exit(NULL);
+}
 
-            if (pthread_mutex_unlock(&lock) != 0)
+// 各槽位处理完的任务数与处理时间之和
+void ThreadPool::sumWorkerStats(unsigned long &completed, unsigned long long &service_ns)
+{
+    completed = 0;
+    service_ns = 0;
+    for (int i = 0; i < max_thr_num; i++)
+    {
+        completed += workers[i].completed.load(std::memory_order_relaxed);
+        service_ns += workers[i].service_ns.load(std::memory_order_relaxed);
+    }
+}
+
+// 在空槽位上创建最多add个线程，调用者持有lock，返回创建的个数
+int ThreadPool::addThreads(int add)
+{
+    int added = 0;
+    // 设置线程为分离状态
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    for (int i = 0; i < max_thr_num && added < add && live_thr_num < max_thr_num; i++)
+    {
+        if (threads[i] == 0 || !is_thread_alive(threads[i]))
+        {
+            if (pthread_create(&threads[i], &attr, threadpool_thread, (void *)(long)i) != 0)
             {
-                err = THREADPOOL_LOCK_FAILURE;
+                memset(&threads[i], 0x00, sizeof(pthread_t));
                 break;
             }
+            /*持有lock时新线程不会退出，之后槽位可以接收任务*/
+            pthread_mutex_lock(&workers[i].lock);
+            workers[i].alive = true;
+            pthread_mutex_unlock(&workers[i].lock);
+            added++;
+            live_thr_num++;
         }
+    }
+    pthread_attr_destroy(&attr);
+    updateSpan();
+    return added;
+}
 
-        /* 销毁多余的空闲线程 算法：忙线程X2 小于 存活的线程数 且 存活的线程数 大于 最小线程数时*/
-        if ((_busy_thr_num * 2) < _live_thr_num && _live_thr_num > min_thr_num)
+// 重新计算worker_span，调用者持有lock(alive只在持有lock时修改)
+void ThreadPool::updateSpan()
+{
+    int span = 0;
+    for (int i = 0; i < max_thr_num; i++)
+    {
+        if (workers[i].alive)
         {
+            span = i + 1;
+        }
+    }
+    worker_span = span;
+}
+
+/* 管理线程 */
+/* 每ADJUST_INTERVAL_MS按测得的任务到达速率与处理时间计算需要的线程数：
+ * 由Little定律，平均忙碌的线程数 = 到达速率 * 处理时间，再除以目标利用率留出余量；
+ * 队列中积压的任务要在TARGET_QUEUE_WAIT_MS内处理完，还需要 积压数 * 处理时间 / 目标等待时间 个线程。
+ * 需要更多线程且有任务在等待时立即增加(速率估计的抖动不会在有空闲线程时创建线程)；
+ * 需要的线程数持续低于当前线程数SHRINK_DELAY_MS后，才减少到这段时间内需要的最大值 */
+void *ThreadPool::adjust_thread(void *)
+{
+    unsigned long last_arrivals = arrivals.load();
+    unsigned long last_completed;
+    unsigned long long last_service;
+    sumWorkerStats(last_completed, last_service);
+    unsigned long long last_time = monotonicNs();
+    unsigned long long low_since = 0; /* 需要的线程数开始低于当前线程数的时间，0表示没有 */
+    int low_max = 0;                  /* 这段时间内需要的最大线程数 */
+    double rate = 0, service = 0, backlog = 0;
+
+    while (!shutdown)
+    {
+        usleep(ADJUST_INTERVAL_MS * 1000); /*定时 对线程池管理*/
+
+        unsigned long long now = monotonicNs();
+        double interval = (now - last_time) / 1e9;
+        last_time = now;
+        unsigned long _arrivals = arrivals.load(std::memory_order_relaxed);
+        unsigned long completed;
+        unsigned long long service_ns;
+        sumWorkerStats(completed, service_ns);
+        unsigned long done = completed - last_completed;
+        unsigned long long spent = service_ns - last_service;
+        int _queue_size = queue_size.load(); /* 关注 任务数 */
+        int _busy_thr_num = busy_thr_num.load(); /* 忙着的线程数 */
+
+        rate = EWMA_ALPHA * ((_arrivals - last_arrivals) / interval) + (1 - EWMA_ALPHA) * rate;
+        backlog = EWMA_ALPHA * _queue_size + (1 - EWMA_ALPHA) * backlog;
+        if (done > 0)
+        {
+            service = EWMA_ALPHA * (spent / 1e9 / done) + (1 - EWMA_ALPHA) * service;
+        }
+        else if (_busy_thr_num > 0 && service < interval)
+        {
+            /*这段时间没有任务完成，正在处理的任务至少已经用了一个周期*/
+            service = interval;
+        }
+        last_arrivals = _arrivals;
+        last_completed = completed;
+        last_service = service_ns;
 
-            /* 一次销毁DEFAULT_THREAD_VARY个线程 */
-            if (pthread_mutex_lock(&lock) != 0)
+        double need = rate * service / TARGET_UTILIZATION + backlog * service / (TARGET_QUEUE_WAIT_MS / 1000.0);
+        int target = (int)ceil(need);
+        /* 正在处理任务的线程不能减少 */
+        target = std::max(target, _busy_thr_num);
+        target = std::min(std::max(target, min_thr_num), max_thr_num);
+
+        int exit_num = 0;
+        if (pthread_mutex_lock(&lock) != 0)
+        {
+            break;
+        }
+        int _live_thr_num = live_thr_num; /* 存活 线程数 */
+        target_thr_num = target;
+        arrival_rate = rate;
+        service_time = service;
+        queue_wait = rate > 0 ? _queue_size / rate : 0;
+        if (target > _live_thr_num && (_queue_size > 0 || _busy_thr_num >= _live_thr_num))
+        {
+            /* 需要更多线程且有任务在等待或线程都在忙时立即创建，并取消尚未完成的减少 */
+            wait_exit_thr_num = 0;
+            low_since = 0;
+            int added = addThreads(target - _live_thr_num);
+            if (added > 0)
             {
-                err = THREADPOOL_LOCK_FAILURE;
-                break;
+                threads_added += added;
+                grow_times++;
             }
-            wait_exit_thr_num = DEFAULT_THREAD_VARY; /* 要销毁的线程数 设置为10 */
-            if (pthread_mutex_unlock(&lock) != 0)
+        }
+        else if (target < _live_thr_num)
+        {
+            if (low_since == 0)
             {
-                err = THREADPOOL_LOCK_FAILURE;
-                break;
+                low_since = now;
+                low_max = target;
             }
-
-            for (i = 0; i < DEFAULT_THREAD_VARY; i++)
+            low_max = std::max(low_max, target);
+            if (now - low_since >= SHRINK_DELAY_MS * 1000000ULL)
             {
-                /* 通知处在空闲状态的线程, 他们会自行终止*/
-                pthread_cond_signal(&queue_not_empty);
+                /* 要销毁的线程数，空闲的线程被唤醒后自行退出 */
+                exit_num = _live_thr_num - low_max;
+                wait_exit_thr_num = exit_num;
+                low_since = 0;
+                shrink_times++;
             }
         }
+        else
+        {
+            wait_exit_thr_num = 0;
+            low_since = 0;
+        }
+        if (pthread_mutex_unlock(&lock) != 0)
+        {
+            break;
+        }
+
+        /* 通知处在空闲状态的线程, 他们会自行终止*/
+        wakeIdle(exit_num);
     }
 
     pthread_exit(NULL);
@@ -367,12 +832,14 @@ int ThreadPool::threadpool_destroy()
         // 等待管理线程结束
         pthread_join(adjust_tid, NULL);
         /*通知所有的空闲线程*/
-        // 通知消费者
-        if (pthread_cond_broadcast(&queue_not_empty) != 0)
+        // 通知消费者和阻塞的添加者
+        for (i = 0; i < max_thr_num; i++)
         {
-            err = THREADPOOL_LOCK_FAILURE;
-            break;
+            notifyWorker(i);
         }
+        pthread_mutex_lock(&lock);
+        pthread_cond_broadcast(&queue_not_full);
+        pthread_mutex_unlock(&lock);
         // 等待所有消费者全部退出
         for (i = 0; i < max_thr_num; i++)
         {
@@ -397,13 +864,15 @@ int ThreadPool::threadpool_free()
     {
         threads.clear();
     }
-    if (queue.size())
+    for (size_t i = 0; i < workers.size(); i++)
     {
-        queue.clear();
+        pthread_mutex_destroy(&workers[i].lock);
+        pthread_cond_destroy(&workers[i].wakeup);
     }
+    workers.clear();
+    idle_workers.clear();
     pthread_mutex_destroy(&lock);
-    pthread_mutex_destroy(&thread_counter);
-    pthread_cond_destroy(&queue_not_empty);
+    pthread_mutex_destroy(&idle_lock);
     pthread_cond_destroy(&queue_not_full);
 
     return 0;
@@ -422,11 +891,45 @@ int ThreadPool::threadpool_all_threadnum()
 // 返回线程池中忙的线程
 int ThreadPool::threadpool_busy_threadnum()
 {
-    int busy_threadnum = -1;
-    pthread_mutex_lock(&thread_counter);
-    busy_threadnum = busy_thr_num;
-    pthread_mutex_unlock(&thread_counter);
-    return busy_threadnum;
+    return busy_thr_num.load();
+}
+
+int ThreadPool::threadpool_target_threadnum()
+{
+    int target = -1;
+    pthread_mutex_lock(&lock);
+    target = target_thr_num;
+    pthread_mutex_unlock(&lock);
+    return target;
+}
+
+void ThreadPool::threadpool_report()
+{
+    // 有任务到达时输出线程数控制器的状态与决策
+    unsigned long _arrivals = arrivals.load(std::memory_order_relaxed);
+    if (_arrivals != last_report_arrivals)
+    {
+        last_report_arrivals = _arrivals;
+        pthread_mutex_lock(&lock);
+        int live = live_thr_num, target = target_thr_num;
+        double rate = arrival_rate, service = service_time, wait = queue_wait;
+        unsigned long grows = grow_times, shrinks = shrink_times, added = threads_added, retired = threads_retired;
+        pthread_mutex_unlock(&lock);
+        MutexLockGuard_LOG();
+        logfile.Write("[threadpool] live=%d target=%d arrivals/s=%.0f service_ms=%.3f queue_wait_ms=%.3f grows=%lu shrinks=%lu added=%lu retired=%lu\n",
+                      live, target, rate, service * 1000, wait * 1000, grows, shrinks, added, retired);
+    }
+
+    unsigned long blocked = overload_blocked.load(std::memory_order_relaxed);
+    unsigned long rejected = overload_rejected.load(std::memory_order_relaxed);
+    unsigned long inlined = overload_inline.load(std::memory_order_relaxed);
+    unsigned long shed = overload_shed.load(std::memory_order_relaxed);
+    unsigned long total = blocked + rejected + inlined + shed;
+    if (total == last_overloads)
+        return;
+    last_overloads = total;
+    MutexLockGuard_LOG();
+    logfile.Write("[threadpool] overload blocked=%lu rejected=%lu inline=%lu shed=%lu\n", blocked, rejected, inlined, shed);
 }
 
 // 判断线程是否活着
@@ -3,15 +3,22 @@
 #include <string>
 #include <sys/time.h>
 
+// 当前时间，以毫秒计
+static size_t getNowMs()
+{
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return (now.tv_sec * 1000) + (now.tv_usec / 1000);
+}
+
 // 为每一个连接添加一个过期时间
 TimerNode::TimerNode(SP_ReqData _request_data, int timeout) : deleted(false),
+                                                              queued_time(0),
+                                                              queued(false),
                                                               request_data(_request_data)
 {
     // cout << "TimerNode()" << endl;
-    struct timeval now;
-    gettimeofday(&now, NULL);
-    // 以毫秒计
-    expired_time = ((now.tv_sec * 1000) + (now.tv_usec / 1000)) + timeout;
+    expired_time = getNowMs() + timeout;
 }
 
 TimerNode::~TimerNode()
@@ -19,24 +26,27 @@ TimerNode::~TimerNode()
     // cout << "~TimerNode()" << endl;
     if (request_data != NULL)
     {
-        Epoll::epoll_del(request_data->getFd());
+        request_data->getLoop()->epoll_del(request_data->getFd());
     }
 }
 
 void TimerNode::update(int timeout)
 {
-    struct timeval now;
-    gettimeofday(&now, NULL);
-    expired_time = ((now.tv_sec * 1000) + (now.tv_usec / 1000)) + timeout;
+    expired_time = getNowMs() + timeout;
+}
+
+// 连接处理完一个请求后复用同一个节点重新计时
+void TimerNode::rearm(SP_ReqData _request_data, int timeout)
+{
+    request_data = _request_data;
+    deleted = false;
+    update(timeout);
 }
 
 // 是否有效(没有超时)
 bool TimerNode::isvalid()
 {
-    struct timeval now;
-    gettimeofday(&now, NULL);
-    size_t temp = ((now.tv_sec * 1000) + (now.tv_usec / 1000));
-    if (temp < expired_time)
+    if (getNowMs() < expired_time)
     {
         return true;
     }
@@ -47,6 +57,15 @@ bool TimerNode::isvalid()
     }
 }
 
+// 超时：从epoll中删除连接，并释放节点对连接的引用
+void TimerNode::expire()
+{
+    SP_ReqData req(request_data);
+    clearReq();
+    if (req != NULL)
+        req->getLoop()->epoll_del(req->getFd());
+}
+
 void TimerNode::clearReq()
 {
     // 给智能指针制空值
@@ -70,22 +89,60 @@ size_t TimerNode::getExpTime() const
     return expired_time;
 }
 
+// 入堆时以当前的过期时间作为排序键
+void TimerNode::setQueued(bool _queued)
+{
+    queued = _queued;
+    if (queued)
+        queued_time = expired_time;
+}
+
+bool TimerNode::isQueued() const
+{
+    return queued;
+}
+
+size_t TimerNode::getQueuedTime() const
+{
+    return queued_time;
+}
+
 TimerManager::TimerManager()
 {
 }
 
+// 计时中的节点与连接互相引用，退出时释放堆中节点对连接的引用
 TimerManager::~TimerManager()
 {
+    while (!TimerNodeQueue.empty())
+    {
+        TimerNodeQueue.top()->clearReq();
+        TimerNodeQueue.pop();
+    }
 }
 
+/* 每个连接复用同一个计时节点，长连接上的请求不再每次新建节点
+节点还在堆中时不能修改它的排序键，只更新实际的过期时间，等它到达堆顶时再按新的过期时间重新入堆。
+新的过期时间早于节点在堆中的排序键时(长连接转为短连接)，旧节点留在堆中等待丢弃，换一个新节点。
+*/
 void TimerManager::addTimer(SP_ReqData request_data, int timeout)
 {
-    SP_TimerNode new_node(new TimerNode(request_data, timeout));
+    SP_TimerNode node(request_data->getTimer());
+    MutexLockGuard locker(lock);
+    if (node != NULL)
+        node->rearm(request_data, timeout);
+    if (node == NULL || (node->isQueued() && node->getExpTime() < node->getQueuedTime()))
+    {
+        if (node != NULL)
+            node->clearReq();
+        node.reset(new TimerNode(request_data, timeout));
+        request_data->linkTimer(node);
+    }
+    if (!node->isQueued())
     {
-        MutexLockGuard locker(lock);
-        TimerNodeQueue.push(new_node);
+        node->setQueued(true);
+        TimerNodeQueue.push(node);
     }
-    request_data->linkTimer(new_node);
 }
 
 void TimerManager::addTimer(SP_TimerNode timer_node){}
@@ -109,22 +166,32 @@ void TimerManager::addTimer(SP_TimerNode timer_node){}
 void TimerManager::handle_expired_event()
 {
     MutexLockGuard locker(lock);
+    size_t now = getNowMs();
     while (!TimerNodeQueue.empty())
     {
         SP_TimerNode ptimer_now = TimerNodeQueue.top();
         if (ptimer_now->isDeleted())
         {
             TimerNodeQueue.pop();
+            ptimer_now->setQueued(false);
             // delete ptimer_now;
         }
-        else if (ptimer_now->isvalid() == false)
+        else if (ptimer_now->getQueuedTime() > now)
         {
+            break;
+        }
+        else if (ptimer_now->isvalid())
+        {
+            // 在堆中期间连接被重新计时，按新的过期时间重新入堆
             TimerNodeQueue.pop();
-            // delete ptimer_now;
+            ptimer_now->setQueued(true);
+            TimerNodeQueue.push(ptimer_now);
         }
         else
         {
-            break;
+            TimerNodeQueue.pop();
+            ptimer_now->setQueued(false);
+            ptimer_now->expire();
         }
     }
 }
\ No newline at end of file
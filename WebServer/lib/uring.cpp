@@ -0,0 +1,526 @@
+#include "uring.h"
+#include "_cmpublic.h"
+#include "ioStats.h"
+#include "log.h"
+#include <sys/syscall.h>
+
+extern CLogFile logfile;
+extern int TIMER_TIME_OUT;
+
+// 内核提供缓冲区的组号、个数(必须是2的幂)与大小
+const unsigned short URING_BGID = 1;
+const unsigned URING_BUF_COUNT = 256;
+const unsigned URING_BUF_SIZE = MAX_BUFF;
+// 空闲连接检查周期(毫秒)
+const int URING_TICK_MS = 200;
+// 长连接空闲超时时间，与epoll后端一致
+const int URING_KEEPALIVE_TIME_OUT = 5 * 60 * 1000;
+// 文件段每次读入内存发送的最大字节数，每个连接的内存占用与文件大小无关
+const size_t URING_FILE_CHUNK = 64 * 1024;
+
+static size_t now_ms()
+{
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return (now.tv_sec * 1000) + (now.tv_usec / 1000);
+}
+
+static unsigned long long make_user_data(unsigned long long op, int fd)
+{
+    return (op << 56) | (unsigned int)fd;
+}
+
+UringLoop::UringLoop() : ring_fd(-1),
+                         sq_ptr(MAP_FAILED),
+                         sq_len(0),
+                         sqes(NULL),
+                         sqes_len(0),
+                         cq_ptr(MAP_FAILED),
+                         cq_len(0),
+                         buf_ring(NULL),
+                         buf_ring_len(0),
+                         buf_base(NULL),
+                         buf_count(URING_BUF_COUNT),
+                         buf_size(URING_BUF_SIZE),
+                         buf_tail(0),
+                         listen_fd(-1)
+{
+}
+
+UringLoop::~UringLoop()
+{
+    conns.clear();
+    if (buf_ring != NULL)
+        munmap(buf_ring, buf_ring_len);
+    delete[] buf_base;
+    if (sqes != NULL)
+        munmap(sqes, sqes_len);
+    if (cq_ptr != MAP_FAILED && cq_ptr != sq_ptr)
+        munmap(cq_ptr, cq_len);
+    if (sq_ptr != MAP_FAILED)
+        munmap(sq_ptr, sq_len);
+    if (ring_fd >= 0)
+        close(ring_fd);
+}
+
+// 创建io_uring实例，映射提交/完成队列，注册内核提供的接收缓冲区
+// 内核不支持时返回-1，由调用者回退到epoll后端
+int UringLoop::uring_init(unsigned entries, int _listen_fd)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    // multishot recv会产生大量完成事件，完成队列开大一些
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = entries * 4;
+    ring_fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring_fd < 0)
+        return -1;
+
+    sq_entries = params.sq_entries;
+    sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    // 新内核中提交队列与完成队列可以一次映射
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (cq_len > sq_len)
+            sq_len = cq_len;
+        cq_len = sq_len;
+    }
+    sq_ptr = mmap(NULL, sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    if (sq_ptr == MAP_FAILED)
+        return -1;
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+        cq_ptr = sq_ptr;
+    else
+    {
+        cq_ptr = mmap(NULL, cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+        if (cq_ptr == MAP_FAILED)
+            return -1;
+    }
+    sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+    void *sqes_ptr = mmap(NULL, sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+    if (sqes_ptr == MAP_FAILED)
+        return -1;
+    sqes = static_cast<struct io_uring_sqe *>(sqes_ptr);
+
+    char *sq = static_cast<char *>(sq_ptr);
+    sq_head = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+    sq_tail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+    sq_mask = reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+    sq_array = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+    sq_local_tail = *sq_tail;
+    char *cq = static_cast<char *>(cq_ptr);
+    cq_head = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+    cq_tail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+    cq_mask = reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+    cqes = reinterpret_cast<struct io_uring_cqe *>(cq + params.cq_off.cqes);
+
+    // 注册内核提供的缓冲区环，recv完成时由内核从中挑选缓冲区
+    buf_ring_len = buf_count * sizeof(struct io_uring_buf);
+    void *ring_ptr = mmap(NULL, buf_ring_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring_ptr == MAP_FAILED)
+        return -1;
+    buf_ring = static_cast<struct io_uring_buf_ring *>(ring_ptr);
+    buf_base = new char[buf_count * buf_size];
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long long)buf_ring;
+    reg.ring_entries = buf_count;
+    reg.bgid = URING_BGID;
+    if (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+        return -1;
+    for (unsigned i = 0; i < buf_count; ++i)
+        recycleBuffer(i);
+    if (probeRecvMultishot() < 0)
+        return -1;
+
+    listen_fd = _listen_fd;
+    prepAccept();
+    prepTimeout();
+    return 0;
+}
+
+// 5.19内核已支持缓冲区环但不支持multishot recv(6.0)，每个recv都会以-EINVAL结束
+// 启动时在socketpair上试一次：收到数据且带IORING_CQE_F_MORE才算支持，否则返回-1由调用者回退到epoll
+int UringLoop::probeRecvMultishot()
+{
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, sv) < 0)
+        return -1;
+    bool supported = false;
+    bool failed = write(sv[1], "x", 1) != 1;
+    if (!failed)
+    {
+        // 关闭写端，multishot recv收到数据后以0结束
+        shutdown(sv[1], SHUT_WR);
+        struct io_uring_sqe *sqe = getSqe();
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = sv[0];
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = URING_BGID;
+        sqe->user_data = make_user_data(URING_OP_RECV, sv[0]);
+    }
+    bool done = failed;
+    while (!done)
+    {
+        if (submitAndWait(1) < 0)
+        {
+            failed = true;
+            break;
+        }
+        unsigned head = *cq_head;
+        unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; ++head)
+        {
+            struct io_uring_cqe *cqe = &cqes[head & *cq_mask];
+            if (cqe->flags & IORING_CQE_F_BUFFER)
+                recycleBuffer(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+            if (cqe->res > 0 && (cqe->flags & IORING_CQE_F_MORE))
+                supported = true;
+            else if (cqe->res < 0)
+                failed = true;
+            if (!(cqe->flags & IORING_CQE_F_MORE))
+                done = true;
+        }
+        __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+    }
+    close(sv[0]);
+    close(sv[1]);
+    return supported && !failed ? 0 : -1;
+}
+
+// 取一个空闲的SQE，提交队列满时先提交已有的请求
+struct io_uring_sqe *UringLoop::getSqe()
+{
+    unsigned head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+    if (sq_local_tail - head >= sq_entries)
+    {
+        submitAndWait(0);
+        head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+    }
+    unsigned index = sq_local_tail & *sq_mask;
+    struct io_uring_sqe *sqe = &sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sq_array[index] = index;
+    ++sq_local_tail;
+    return sqe;
+}
+
+// 一次io_uring_enter完成本轮所有请求的提交，并等待至少wait_nr个完成事件
+int UringLoop::submitAndWait(unsigned wait_nr)
+{
+    __atomic_store_n(sq_tail, sq_local_tail, __ATOMIC_RELEASE);
+    unsigned to_submit = sq_local_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+    unsigned flags = wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0;
+    int ret;
+    do
+    {
+        IoStats::addSyscall();
+        ret = syscall(__NR_io_uring_enter, ring_fd, to_submit, wait_nr, flags, NULL, 0);
+    } while (ret < 0 && errno == EINTR);
+    return ret;
+}
+
+void UringLoop::prepAccept()
+{
+    struct io_uring_sqe *sqe = getSqe();
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listen_fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = make_user_data(URING_OP_ACCEPT, listen_fd);
+}
+
+void UringLoop::prepRecv(int fd)
+{
+    struct io_uring_sqe *sqe = getSqe();
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BGID;
+    sqe->user_data = make_user_data(URING_OP_RECV, fd);
+    conns[fd].recv_armed = true;
+}
+
+// 取消进行中的multishot recv，recv随后以-ECANCELED结束
+void UringLoop::prepCancelRecv(int fd)
+{
+    struct io_uring_sqe *sqe = getSqe();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = make_user_data(URING_OP_RECV, fd);
+    sqe->user_data = make_user_data(URING_OP_CANCEL, fd);
+}
+
+void UringLoop::prepSend(int fd)
+{
+    Conn &conn = conns[fd];
+    struct io_uring_sqe *sqe = getSqe();
+    SendBuffer &sb = *conn.sending;
+    // 输出队列中的各段用一个sendmsg发出，不需要先拼接
+    memset(&sb.msg, 0, sizeof(sb.msg));
+    sb.msg.msg_iov = sb.iov;
+    sb.msg.msg_iovlen = sb.queue.fillIovec(sb.iov, OUTPUT_MAX_IOV);
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long long)&sb.msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = make_user_data(URING_OP_SEND, fd);
+    conn.send_inflight = true;
+}
+
+// 周期性超时，用于检查空闲连接
+void UringLoop::prepTimeout()
+{
+    tick.tv_sec = URING_TICK_MS / 1000;
+    tick.tv_nsec = (URING_TICK_MS % 1000) * 1000000LL;
+    struct io_uring_sqe *sqe = getSqe();
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->fd = -1;
+    sqe->addr = (unsigned long long)&tick;
+    sqe->len = 1;
+    sqe->user_data = make_user_data(URING_OP_TIMEOUT, 0);
+}
+
+// 把用完的缓冲区还给内核
+void UringLoop::recycleBuffer(unsigned short bid)
+{
+    // 不使用buf_ring->bufs：__DECLARE_FLEX_ARRAY在C++中会引入一个非零大小的空结构体，导致偏移错误
+    struct io_uring_buf *buf = reinterpret_cast<struct io_uring_buf *>(buf_ring) + (buf_tail & (buf_count - 1));
+    buf->addr = (unsigned long long)(buf_base + (size_t)bid * buf_size);
+    buf->len = buf_size;
+    buf->bid = bid;
+    ++buf_tail;
+    __atomic_store_n(&buf_ring->tail, buf_tail, __ATOMIC_RELEASE);
+}
+
+int UringLoop::uring_wait()
+{
+    flushSends();
+    if (submitAndWait(1) < 0)
+        return -1;
+
+    unsigned head = *cq_head;
+    unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+    while (head != tail)
+    {
+        struct io_uring_cqe *cqe = &cqes[head & *cq_mask];
+        unsigned long long op = cqe->user_data >> 56;
+        int fd = (int)(cqe->user_data & 0xffffffffULL);
+        if (op == URING_OP_ACCEPT)
+            handleAccept(cqe);
+        else if (op == URING_OP_RECV)
+            handleRecv(fd, cqe);
+        else if (op == URING_OP_SEND)
+            handleSend(fd, cqe);
+        else if (op == URING_OP_TIMEOUT)
+            handleTimeout();
+        // URING_OP_CANCEL的结果在被取消的recv的完成事件中处理
+        ++head;
+        // 处理过程中可能产生了新的完成事件
+        if (head == tail)
+            tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+    }
+    __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+    IoStats::flush();
+    return 0;
+}
+
+void UringLoop::handleAccept(struct io_uring_cqe *cqe)
+{
+    // multishot accept被内核终止(如fd耗尽)后需要重新提交
+    if (!(cqe->flags & IORING_CQE_F_MORE))
+        prepAccept();
+    if (cqe->res < 0)
+    {
+        MutexLockGuard_LOG();
+        logfile.Write("io_uring accept failed: %s\n", strerror(-cqe->res));
+        return;
+    }
+    int accept_fd = cqe->res;
+    // multishot accept不返回对端地址
+    struct sockaddr_in client_addr;
+    socklen_t client_addr_len = sizeof(client_addr);
+    char str[INET_ADDRSTRLEN] = "";
+    IoStats::addSyscall();
+    if (getpeername(accept_fd, (struct sockaddr *)&client_addr, &client_addr_len) == 0)
+        inet_ntop(AF_INET, &client_addr.sin_addr, str, sizeof(str));
+    {
+        MutexLockGuard_LOG();
+        logfile.Write("客户端(%s)已连接。\n", str);
+    }
+
+    if ((size_t)accept_fd >= conns.size())
+        conns.resize(accept_fd + 1);
+    Conn &conn = conns[accept_fd];
+    conn.req.reset(new RequestData(NULL, accept_fd, std::string(str), "/"));
+    conn.sending.reset(new SendBuffer());
+    conn.recv_armed = false;
+    conn.recv_paused = false;
+    conn.send_inflight = false;
+    conn.closing = false;
+    conn.close_after_send = false;
+    conn.expired_time = now_ms() + TIMER_TIME_OUT;
+    prepRecv(accept_fd);
+}
+
+void UringLoop::handleRecv(int fd, struct io_uring_cqe *cqe)
+{
+    Conn &conn = conns[fd];
+    bool more = (cqe->flags & IORING_CQE_F_MORE) != 0;
+    if (!more)
+        conn.recv_armed = false;
+    if (cqe->res > 0 && (cqe->flags & IORING_CQE_F_BUFFER))
+    {
+        unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        if (!conn.closing)
+        {
+            conn.req->handleData(buf_base + (size_t)bid * buf_size, cqe->res);
+            conn.expired_time = now_ms() + URING_KEEPALIVE_TIME_OUT;
+            pending_send.push_back(fd);
+            if (conn.req->shouldClose())
+                conn.close_after_send = true;
+        }
+        recycleBuffer(bid);
+        // 缓冲区暂时用完等原因导致multishot结束，重新提交；暂停接收时等数据发出后再提交
+        if (!more)
+        {
+            if (conn.closing)
+                releaseConn(fd);
+            else if (!conn.recv_paused)
+                prepRecv(fd);
+        }
+        return;
+    }
+    if (cqe->res == -ENOBUFS && !conn.closing)
+    {
+        if (!conn.recv_paused)
+            prepRecv(fd);
+        return;
+    }
+    // 因输出积压取消；取消生效前积压已经发出时重新提交
+    if (cqe->res == -ECANCELED && !conn.closing)
+    {
+        if (!conn.recv_paused)
+            prepRecv(fd);
+        return;
+    }
+    // 对端关闭(0)或出错
+    if (conn.closing)
+        releaseConn(fd);
+    else
+        closeConn(fd);
+}
+
+void UringLoop::handleSend(int fd, struct io_uring_cqe *cqe)
+{
+    Conn &conn = conns[fd];
+    conn.send_inflight = false;
+    if (conn.closing)
+    {
+        releaseConn(fd);
+        return;
+    }
+    if (cqe->res < 0)
+    {
+        conn.sending->queue.clear();
+        closeConn(fd);
+        return;
+    }
+    conn.sending->queue.consume(cqe->res);
+    // 没有发完或发送期间又产生了新数据，下一轮继续发送
+    pending_send.push_back(fd);
+}
+
+// 检查空闲超时的连接
+void UringLoop::handleTimeout()
+{
+    prepTimeout();
+    size_t now = now_ms();
+    for (size_t fd = 0; fd < conns.size(); ++fd)
+    {
+        Conn &conn = conns[fd];
+        if (conn.req && !conn.closing && !conn.send_inflight && conn.expired_time <= now)
+            closeConn(fd);
+    }
+}
+
+// 关闭连接：shutdown使进行中的recv结束，所有请求完成后再释放RequestData(析构时close fd)
+void UringLoop::closeConn(int fd)
+{
+    Conn &conn = conns[fd];
+    if (conn.closing)
+        return;
+    conn.closing = true;
+    if (conn.recv_armed)
+    {
+        IoStats::addSyscall();
+        shutdown(fd, SHUT_RDWR);
+    }
+    releaseConn(fd);
+}
+
+void UringLoop::releaseConn(int fd)
+{
+    Conn &conn = conns[fd];
+    if (conn.recv_armed || conn.send_inflight)
+        return;
+    IoStats::addSyscall();
+    conn.req.reset();
+    conn.sending.reset();
+}
+
+// 把本轮产生的响应批量加入提交队列，随下一次io_uring_enter一起提交
+void UringLoop::flushSends()
+{
+    for (size_t i = 0; i < pending_send.size(); ++i)
+    {
+        int fd = pending_send[i];
+        Conn &conn = conns[fd];
+        if (!conn.req || conn.closing || conn.send_inflight)
+            continue;
+        // 待发送的数据低于高水位时才取出新的响应，流水线中因积压暂停的请求也在此时继续处理
+        if (conn.sending->queue.size() < OUTPUT_HIGH_WATER_MARK)
+        {
+            conn.req->resumeInput();
+            if (conn.req->shouldClose())
+                conn.close_after_send = true;
+            conn.req->takeOutput(conn.sending->queue);
+        }
+        updateRecv(fd);
+        // sendmsg只能发送内存数据，队首的文件段分块读入后再发送
+        if (conn.sending->queue.loadFile(URING_FILE_CHUNK) < 0)
+        {
+            conn.sending->queue.clear();
+            closeConn(fd);
+            continue;
+        }
+        if (!conn.sending->queue.empty())
+            prepSend(fd);
+        else if (conn.close_after_send)
+            closeConn(fd);
+    }
+    pending_send.clear();
+}
+
+// 输出积压超过高水位时取消recv，不再接收新的请求；积压发出后重新提交
+void UringLoop::updateRecv(int fd)
+{
+    Conn &conn = conns[fd];
+    bool backlog = conn.sending->queue.size() >= OUTPUT_HIGH_WATER_MARK || conn.req->inputPaused();
+    if (backlog && !conn.recv_paused)
+    {
+        conn.recv_paused = true;
+        if (conn.recv_armed)
+            prepCancelRecv(fd);
+    }
+    else if (!backlog && conn.recv_paused)
+    {
+        conn.recv_paused = false;
+        if (!conn.recv_armed)
+            prepRecv(fd);
+    }
+}
@@ -1,5 +1,7 @@
 #include "util.h"
 #include "_cmpublic.h"
+#include "ioStats.h"
+#include <algorithm>
 
 // HTTP读取缓存大小
 const int MAX_BUFF = 4096;
@@ -110,14 +112,15 @@ ssize_t readn(int fd, void *buff, size_t n)
   return readSum;
 }
 
-ssize_t readn(int fd, std::string &inBuffer)
+ssize_t readn(int fd, std::string &inBuffer, size_t limit)
 {
   ssize_t nread = 0;
   ssize_t readSum = 0;
-  while (true)
+  while ((size_t)readSum < limit)
   {
     char buff[MAX_BUFF];
-    if ((nread = read(fd, buff, MAX_BUFF)) < 0)
+    IoStats::addSyscall();
+    if ((nread = read(fd, buff, std::min((size_t)MAX_BUFF, limit - readSum))) < 0)
     {
       if (errno == EINTR)
         continue;
@@ -134,7 +137,7 @@ ssize_t readn(int fd, std::string &inBuffer)
     else if (nread == 0)
       break;
     readSum += nread;
-    inBuffer += std::string(buff, buff + nread);
+    inBuffer.append(buff, nread);
   }
   return readSum;
 }
@@ -148,6 +151,7 @@ ssize_t writen(int fd, void *buff, size_t n)
   char *ptr = (char *)buff;
   while (nleft > 0)
   {
+    IoStats::addSyscall();
     if ((nwritten = write(fd, ptr, nleft)) <= 0)
     {
       if (nwritten < 0)
@@ -177,6 +181,7 @@ ssize_t writen(int fd, std::string &sbuff)
   const char *ptr = sbuff.c_str();
   while (nleft > 0)
   {
+    IoStats::addSyscall();
     if ((nwritten = write(fd, ptr, nleft)) <= 0)
     {
       if (nwritten < 0)
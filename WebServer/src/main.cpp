@@ -1,10 +1,19 @@
 #include "HttpRequestData.h"
 #include "epoll.h"
+#include "reactorPool.h"
 #include "threadpool.h"
 #include "connectionPool.h"
 #include "util.h"
 #include "_cmpublic.h"
 #include "log.h"
+#include "ioStats.h"
+#include "uring.h"
+#include "staticCache.h"
+#include "compressCache.h"
+#include "openFileCache.h"
+#include "headerScan.h"
+#include "bodySink.h"
+#include "router.h"
 
 using namespace std;
 
@@ -18,6 +27,54 @@ const int THREADPOOL_MAX_THREAD_NUM = 100;
 const int THREADPOOL_MIN_THREAD_NUM = 4;
 // const int QUEUE_MAX_SIZE = 65535;
 const int QUEUE_MAX_SIZE = 100;
+// 任务队列满时的处理方式，见threadpool.h中OVERLOAD_*的说明；不阻塞epoll线程
+const int OVERLOAD_POLICY = OVERLOAD_REJECT;
+
+// IO线程(Reactor)个数的缺省值，启动参数-t可以修改，为0时使用单epoll线程+线程池的处理方式
+// 大于0时主线程只负责accept，连接分发到各个IO线程，由IO线程直接处理(one loop per thread)
+const int REACTOR_THREAD_NUM = 4;
+const int REACTOR_THREAD_MAX = 256;
+// 多Reactor模式下监听方式的缺省值，启动参数-l可以修改，见reactorPool.h中LISTEN_*的说明
+const int LISTEN_MODE = LISTEN_REUSEPORT;
+
+// io_uring后端每个IO线程的提交队列长度
+const unsigned URING_ENTRIES = 1024;
+// 统计信息写入日志的间隔(秒)
+const int STATS_INTERVAL = 10;
+
+// 静态文件缓存监视的目录(相对于bin目录)，只缓存这些目录中的文件
+const char *STATIC_DIRS[] = {"../doc", "../css", "../js"};
+
+// 补充的MIME类型(mime.types格式，相对于bin目录)，文件不存在时只使用内置的类型
+const char *MIME_TYPES_FILE = "../mime.types";
+
+// 打开文件缓存的最大文件数与有效期(毫秒)
+const size_t OPEN_FILE_CACHE_MAX = 256;
+const int OPEN_FILE_CACHE_VALID = 5000;
+
+// 请求体：单个请求体的最大长度，单个请求体在内存中的最大长度，所有请求体合计在内存中的最大长度
+// 超过后两者的请求体写入BODY_SPOOL_DIR中的临时文件
+const size_t BODY_MAX_SIZE = 64 * 1024 * 1024;
+const size_t BODY_MEMORY_THRESHOLD = 64 * 1024;
+const size_t BODY_MEMORY_BUDGET = 16 * 1024 * 1024;
+const char *BODY_SPOOL_DIR = "/tmp";
+
+static int loginRoute(RequestData &request, const RouteMatch &)
+{
+    return request.serveLogin();
+}
+
+static int staticRoute(RequestData &request, const RouteMatch &)
+{
+    return request.serveStatic();
+}
+
+// 路由表：请求方式、路径模式、匹配方式、处理函数，启动时编译为前缀树
+// 登录页面向自身的地址提交表单，所以所有POST请求都交给登录处理
+const RouteDef ROUTES[] = {
+    {METHOD_POST, "/", ROUTE_PREFIX, loginRoute},
+    {METHOD_GET, "/", ROUTE_PREFIX, staticRoute},
+};
 
 // 服务器使用的端口
 const int PORT = 8888;
@@ -25,7 +82,8 @@ const int PORT = 8888;
 extern CLogFile logfile; // 服务程序的运行日志
 
 // 初始化监听描述符
-int socket_bind_listen(int port)
+// reuseport为true时设置SO_REUSEPORT，多个监听描述符可以绑定同一端口，由内核在它们之间分配新连接
+int socket_bind_listen(int port, bool reuseport = false)
 {
     // 检查port值，取正确区间范围
     if (port < 1024 || port > 65535)
@@ -40,6 +98,11 @@ int socket_bind_listen(int port)
     int optval = 1;
     if (setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval)) == -1)
         return -1;
+    if (reuseport && setsockopt(listen_fd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(optval)) == -1)
+    {
+        close(listen_fd);
+        return -1;
+    }
 
     // 设置服务器IP和Port，和监听描述符绑定
     struct sockaddr_in server_addr;
@@ -63,8 +126,54 @@ int socket_bind_listen(int port)
     return listen_fd;
 }
 
-int main()
+// 主线程无事可做时周期性输出统计信息
+static void report_stats_forever(const char *backend)
+{
+    while (true)
+    {
+        sleep(STATS_INTERVAL);
+        IoStats::report(backend);
+    }
+}
+
+// 解析-t的参数，不是0到REACTOR_THREAD_MAX之间的整数时返回-1
+static int parse_reactor_num(const char *arg)
 {
+    char *end;
+    long num = strtol(arg, &end, 10);
+    if (end == arg || *end != '\0' || num < 0 || num > REACTOR_THREAD_MAX)
+        return -1;
+    return num;
+}
+
+// 启动参数：-b epoll|uring 选择IO后端，缺省为epoll
+// -t n 设置IO线程个数，0表示单epoll线程+线程池；-l acceptor|reuseport|exclusive 设置多Reactor模式下的监听方式
+int main(int argc, char *argv[])
+{
+    int backend = IO_BACKEND_EPOLL;
+    int reactor_num = REACTOR_THREAD_NUM;
+    int listen_mode = LISTEN_MODE;
+    int opt;
+    while ((opt = getopt(argc, argv, "b:t:l:")) != -1)
+    {
+        if (opt == 'b' && strcmp(optarg, "uring") == 0)
+            backend = IO_BACKEND_URING;
+        else if (opt == 'b' && strcmp(optarg, "epoll") == 0)
+            backend = IO_BACKEND_EPOLL;
+        else if (opt == 't' && (reactor_num = parse_reactor_num(optarg)) >= 0)
+            continue;
+        else if (opt == 'l' && strcmp(optarg, "acceptor") == 0)
+            listen_mode = LISTEN_ACCEPTOR;
+        else if (opt == 'l' && strcmp(optarg, "reuseport") == 0)
+            listen_mode = LISTEN_REUSEPORT;
+        else if (opt == 'l' && strcmp(optarg, "exclusive") == 0)
+            listen_mode = LISTEN_EXCLUSIVE;
+        else
+        {
+            printf("usage: %s [-b epoll|uring] [-t reactor_threads] [-l acceptor|reuseport|exclusive]\n", argv[0]);
+            return -1;
+        }
+    }
     handle_for_sigpipe();
     // 打开日志文件
     if (logfile.Open("/home/student-4/wh/vscode-workspace/webServer/logfile.log", "a+") == false)
@@ -72,19 +181,92 @@ int main()
         printf("logfile.Open(%s) failed.\n", "/home/student-4/wh/vscode-workspace/webServer/logfile.log");
         return -1;
     }
-    if (Epoll::epoll_init(MAXEVENTS, LISTENQ) < 0)
+    if(ConnectionPool::sqlConnectionPoolCreate() < 0)
     {
-        logfile.Write("epoll init failed.\n");
+        logfile.Write("数据库连接失败！\n");
         return 1;
     }
-    if (ThreadPool::threadpool_create(THREADPOOL_MIN_THREAD_NUM, THREADPOOL_MAX_THREAD_NUM, QUEUE_MAX_SIZE) < 0)
+    logfile.Write("header scanner: %s\n", HeaderScan::implName());
+    if (MimeType::load(MIME_TYPES_FILE) < 0)
+        logfile.Write("%s not found, use built-in mime types\n", MIME_TYPES_FILE);
+    logfile.Write("mime types: %zu\n", MimeType::size());
+    OpenFileCache::cache_init(OPEN_FILE_CACHE_MAX, OPEN_FILE_CACHE_VALID);
+    BodySink::sink_init(BODY_MAX_SIZE, BODY_MEMORY_THRESHOLD, BODY_MEMORY_BUDGET, BODY_SPOOL_DIR);
+    for (size_t i = 0; i < sizeof(ROUTES) / sizeof(ROUTES[0]); ++i)
     {
-        logfile.Write("threadpool create failed\n");
+        if (Router::addRoute(ROUTES[i].method, ROUTES[i].pattern, ROUTES[i].type, ROUTES[i].handler) < 0)
+            logfile.Write("invalid route %s\n", ROUTES[i].pattern);
+    }
+    Router::compile();
+    // inotify不可用时不启用静态文件缓存，每次请求都直接读取文件
+    if (StaticCache::cache_init(vector<string>(STATIC_DIRS, STATIC_DIRS + sizeof(STATIC_DIRS) / sizeof(STATIC_DIRS[0]))) < 0)
+        logfile.Write("static cache init failed, serve files without cache\n");
+    // 没有后台压缩线程时只发送预压缩文件，不在IO线程中压缩
+    if (CompressCache::cache_init() < 0)
+        logfile.Write("compress cache init failed, serve precompressed files only\n");
+    // io_uring后端：每个IO线程一个SO_REUSEPORT监听描述符，单Reactor时在一个IO线程中运行
+    if (backend == IO_BACKEND_URING)
+    {
+        int loop_num = reactor_num > 0 ? reactor_num : 1;
+        vector<int> listen_fds;
+        for (int i = 0; i < loop_num; ++i)
+        {
+            int fd = socket_bind_listen(PORT, true);
+            if (fd < 0)
+            {
+                logfile.Write("socket bind failed\n");
+                return 1;
+            }
+            listen_fds.push_back(fd);
+        }
+        if (ReactorPool::uring_create(loop_num, URING_ENTRIES, listen_fds) == 0)
+            report_stats_forever("uring");
+        // 内核不支持multishot accept/provided buffer ring等特性，回退到epoll
+        logfile.Write("io_uring init failed, fall back to epoll\n");
+        for (size_t i = 0; i < listen_fds.size(); ++i)
+            close(listen_fds[i]);
+    }
+    // 每个IO线程自己accept：REUSEPORT模式每个IO线程一个监听描述符，EXCLUSIVE模式共享一个
+    if (reactor_num > 0 && listen_mode != LISTEN_ACCEPTOR)
+    {
+        int listen_cnt = (listen_mode == LISTEN_REUSEPORT) ? reactor_num : 1;
+        vector<int> listen_fds;
+        for (int i = 0; i < listen_cnt; ++i)
+        {
+            int fd = socket_bind_listen(PORT, listen_mode == LISTEN_REUSEPORT);
+            if (fd < 0 || setnonblocking(fd) < 0)
+            {
+                logfile.Write("socket bind failed\n");
+                return 1;
+            }
+            listen_fds.push_back(fd);
+        }
+        if (ReactorPool::reactor_create(reactor_num, MAXEVENTS, LISTENQ, listen_fds, listen_mode) < 0)
+        {
+            logfile.Write("reactor pool create failed\n");
+            return 1;
+        }
+        report_stats_forever("epoll");
+    }
+
+    // 主事件循环：单Reactor模式下处理所有连接，多Reactor模式下只负责accept
+    Epoll main_loop;
+    if (main_loop.epoll_init(MAXEVENTS, LISTENQ) < 0)
+    {
+        logfile.Write("epoll init failed.\n");
         return 1;
     }
-    if(ConnectionPool::sqlConnectionPoolCreate() < 0)
+    if (reactor_num > 0)
     {
-        logfile.Write("数据库连接失败！\n");
+        if (ReactorPool::reactor_create(reactor_num, MAXEVENTS, LISTENQ, vector<int>(), LISTEN_ACCEPTOR) < 0)
+        {
+            logfile.Write("reactor pool create failed\n");
+            return 1;
+        }
+    }
+    else if (ThreadPool::threadpool_create(THREADPOOL_MIN_THREAD_NUM, THREADPOOL_MAX_THREAD_NUM, QUEUE_MAX_SIZE, OVERLOAD_POLICY) < 0)
+    {
+        logfile.Write("threadpool create failed\n");
         return 1;
     }
     int listen_fd = socket_bind_listen(PORT);
@@ -101,15 +283,22 @@ int main()
     __uint32_t event = EPOLLIN | EPOLLET;
     shared_ptr<RequestData> request(new RequestData());
     request->setFd(listen_fd);
-    int ret = Epoll::epoll_add(listen_fd, request, event);
+    int ret = main_loop.epoll_add(listen_fd, request, event);
     if (ret < 0)
     {
         logfile.Write("epoll add failed\n");
         return 1;
     }
+    time_t last_report = time(NULL);
     while (true)
     {
-        if (Epoll::my_epoll_wait(listen_fd, MAXEVENTS, -1) < 0)
+        if (time(NULL) - last_report >= STATS_INTERVAL)
+        {
+            IoStats::report("epoll");
+            ThreadPool::threadpool_report();
+            last_report = time(NULL);
+        }
+        if (main_loop.my_epoll_wait(listen_fd, MAXEVENTS, -1) < 0)
         {
             MutexLockGuard_LOG();
             // pthread_mutex_lock(&log_lock);